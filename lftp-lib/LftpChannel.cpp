@@ -0,0 +1,121 @@
+/**
+ * @file LftpChannel.cpp
+ * @author fox
+ * @brief bounded single producer single consumer status channel
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <string.h>
+#include <unistd.h>
+
+#include "LftpChannel.h"
+#include "LftpLog.h"
+
+#define LFTP_CHANNEL_MASK (LFTP_CHANNEL_RING - 1)
+
+void LftpChannelInit(LftpChannel* c)
+{
+    c->head.store(0);
+    c->tail.store(0);
+    memset(&c->latest, 0, sizeof(c->latest));
+    c->latest_seq.store(0);
+    c->last_state = LFTP_STATE_MAX;
+    c->last_index = -2;
+    c->delivered = 0;
+}
+
+static void LftpChannelWriteLatest(LftpChannel* c, const LftpStatus* status)
+{
+    unsigned int seq = c->latest_seq.load(std::memory_order_relaxed);
+
+    c->latest_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&c->latest, status, sizeof(*status));
+    c->latest_seq.store(seq + 2, std::memory_order_release);
+}
+
+static void LftpChannelReadLatest(LftpChannel* c, LftpStatus* status)
+{
+    while (true) {
+        unsigned int before = c->latest_seq.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(status, &c->latest, sizeof(*status));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (c->latest_seq.load(std::memory_order_relaxed) == before) {
+            return;
+        }
+    }
+}
+
+int LftpChannelPublish(LftpChannel* c, const LftpStatus* status, const volatile int* running)
+{
+    bool transition = status->all_finish
+        || status->transfer_state != c->last_state
+        || status->file_index != c->last_index;
+
+    if (!transition) {
+        LftpChannelWriteLatest(c, status);
+        return 0;
+    }
+
+    c->last_state = status->transfer_state;
+    c->last_index = status->file_index;
+
+    unsigned int tail = c->tail.load(std::memory_order_relaxed);
+    while (tail - c->head.load(std::memory_order_acquire) == LFTP_CHANNEL_RING) {
+        if (!*running) {
+            LFTP_LOG("status ring full, drop state %d of file %d", status->transfer_state, status->file_index);
+            return -1;
+        }
+        usleep(1000);
+    }
+
+    memcpy(&c->ring[tail & LFTP_CHANNEL_MASK], status, sizeof(*status));
+    c->tail.store(tail + 1, std::memory_order_release);
+
+    return 0;
+}
+
+bool LftpChannelPeek(LftpChannel* c, LftpStatus* status, unsigned long long* sequence)
+{
+    bool found = false;
+
+    unsigned int head = c->head.load(std::memory_order_relaxed);
+    if (head != c->tail.load(std::memory_order_acquire)) {
+        memcpy(status, &c->ring[head & LFTP_CHANNEL_MASK], sizeof(*status));
+        found = true;
+    }
+
+    // progress older than the next transition goes first, stale progress never
+    if (c->latest_seq.load(std::memory_order_acquire)) {
+        LftpStatus latest;
+        LftpChannelReadLatest(c, &latest);
+        if (latest.sequence > c->delivered && (!found || latest.sequence < status->sequence)) {
+            memcpy(status, &latest, sizeof(latest));
+            found = true;
+        }
+    }
+
+    if (found) {
+        *sequence = status->sequence;
+    }
+
+    return found;
+}
+
+void LftpChannelConsume(LftpChannel* c, const LftpStatus* status)
+{
+    unsigned int head = c->head.load(std::memory_order_relaxed);
+
+    if (head != c->tail.load(std::memory_order_acquire)
+        && c->ring[head & LFTP_CHANNEL_MASK].sequence == status->sequence) {
+        c->head.store(head + 1, std::memory_order_release);
+    }
+
+    c->delivered = status->sequence;
+}
@@ -0,0 +1,68 @@
+/**
+ * @file LftpChannel.h
+ * @author fox
+ * @brief bounded single producer single consumer status channel
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPCHANNEL_H
+#define LFTPCHANNEL_H
+
+#include <atomic>
+
+#include "LftpLib.h"
+
+#define LFTP_CHANNEL_RING 64    // power of two
+
+/*
+ * Every producer thread owns one channel. State transitions (new state, new
+ * file, final status) go through the ring and are never dropped. Progress
+ * of the same state only replaces the latest cell, a slow reader sees the
+ * newest progress instead of a backlog.
+ */
+typedef struct _LftpChannel {
+    LftpStatus ring[LFTP_CHANNEL_RING];
+    std::atomic<unsigned int> head;     // next slot to read, consumer owned
+    std::atomic<unsigned int> tail;     // next slot to write, producer owned
+
+    LftpStatus latest;
+    std::atomic<unsigned int> latest_seq; // seqlock, odd while latest is written
+
+    // producer only
+    LFTP_STATE last_state;
+    int last_index;
+
+    // consumer only
+    unsigned long long delivered;       // sequence of the last status handed out
+} LftpChannel;
+
+void LftpChannelInit(LftpChannel* c);
+
+/**
+ * @brief publish a status, status->sequence has to be set and increasing
+ *
+ * A transition waits for a free slot while running is set, a full ring after
+ * a stop means nobody reads anymore and the transition is dropped.
+ *
+ * @return int 0 success, -1 dropped
+ */
+int LftpChannelPublish(LftpChannel* c, const LftpStatus* status, const volatile int* running);
+
+/**
+ * @brief the oldest status of the channel that was not read yet
+ *
+ * @param sequence its sequence, to merge several channels in order
+ * @return true a status is waiting
+ */
+bool LftpChannelPeek(LftpChannel* c, LftpStatus* status, unsigned long long* sequence);
+
+/**
+ * @brief drop the status returned by the last LftpChannelPeek
+ */
+void LftpChannelConsume(LftpChannel* c, const LftpStatus* status);
+
+#endif
@@ -0,0 +1,354 @@
+/**
+ * @file LftpCrc.cpp
+ * @author fox
+ * @brief CRC32C and CRC32 of the upload stream
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#include "LftpCrc.h"
+
+#define LFTP_CRC32C_POLY 0x82f63b78 // reflected Castagnoli
+#define LFTP_CRC32_POLY 0xedb88320  // reflected IEEE 802.3, zlib
+
+typedef unsigned int (*LftpCrcFunc)(unsigned int crc, const unsigned char* p, size_t len);
+
+// slicing by 8: one table lookup per byte, eight independent ones per step
+typedef struct _LftpCrcTable {
+    unsigned int t[8][256];
+} LftpCrcTable;
+
+static void LftpCrcTableInit(LftpCrcTable* table, unsigned int poly)
+{
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (crc & 1 ? poly : 0);
+        }
+        table->t[0][i] = crc;
+    }
+
+    for (unsigned int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            unsigned int prev = table->t[k - 1][i];
+            table->t[k][i] = (prev >> 8) ^ table->t[0][prev & 0xff];
+        }
+    }
+}
+
+static const LftpCrcTable* LftpCrcTableGet(unsigned int poly)
+{
+    // built once, C++11 makes the static init thread safe
+    static struct LftpCrcTables {
+        LftpCrcTable crc32c;
+        LftpCrcTable crc32;
+        LftpCrcTables()
+        {
+            LftpCrcTableInit(&crc32c, LFTP_CRC32C_POLY);
+            LftpCrcTableInit(&crc32, LFTP_CRC32_POLY);
+        }
+    } tables;
+
+    return poly == LFTP_CRC32C_POLY ? &tables.crc32c : &tables.crc32;
+}
+
+// crc is the inverted running value
+static unsigned int LftpCrcSlice8(const LftpCrcTable* table, unsigned int crc, const unsigned char* p, size_t len)
+{
+    const unsigned int (*t)[256] = table->t;
+
+    while (len >= 8) {
+        crc ^= (unsigned int)p[0] | (unsigned int)p[1] << 8 | (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24;
+        crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff] ^ t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24]
+            ^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+
+    return crc;
+}
+
+static unsigned int LftpCrc32cSlice8(unsigned int crc, const unsigned char* p, size_t len)
+{
+    return LftpCrcSlice8(LftpCrcTableGet(LFTP_CRC32C_POLY), crc, p, len);
+}
+
+static unsigned int LftpCrc32Slice8(unsigned int crc, const unsigned char* p, size_t len)
+{
+    return LftpCrcSlice8(LftpCrcTableGet(LFTP_CRC32_POLY), crc, p, len);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int LftpCrc32cHardware(unsigned int crc, const unsigned char* p, size_t len)
+{
+    unsigned long long c = crc;
+
+    while (len && ((uintptr_t)p & 7)) {
+        c = __builtin_ia32_crc32qi(c, *p++);
+        len--;
+    }
+
+    while (len >= 8) {
+        unsigned long long v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        c = __builtin_ia32_crc32qi(c, *p++);
+    }
+
+    return c;
+}
+
+static LftpCrcFunc LftpCrc32cDetect(const char** name)
+{
+    if (__builtin_cpu_supports("sse4.2")) {
+        *name = "sse4.2";
+        return LftpCrc32cHardware;
+    }
+
+    *name = "software";
+    return LftpCrc32cSlice8;
+}
+
+/*
+ * SSE4.2 only has the crc32 instruction for CRC32C. CRC32 folds the buffer with
+ * carry-less multiplies instead, four 16 byte lanes at a time, and reduces the
+ * last 128 bits with Barrett (Intel, "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction"). Bit-reflected constants of
+ * LFTP_CRC32_POLY, the tail under 16 bytes goes to the table.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int LftpCrc32Hardware(unsigned int crc, const unsigned char* p, size_t len)
+{
+    if (len < 64) {
+        return LftpCrc32Slice8(crc, p, len);
+    }
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0, x1, x2, x3, x4;
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), _mm_cvtsi32_si128(crc));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 16));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 32));
+    x4 = _mm_loadu_si128((const __m128i*)(p + 48));
+    p += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x00), _mm_clmulepi64_si128(x1, k1k2, 0x11)),
+            _mm_loadu_si128((const __m128i*)p));
+        x2 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x00), _mm_clmulepi64_si128(x2, k1k2, 0x11)),
+            _mm_loadu_si128((const __m128i*)(p + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x00), _mm_clmulepi64_si128(x3, k1k2, 0x11)),
+            _mm_loadu_si128((const __m128i*)(p + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x00), _mm_clmulepi64_si128(x4, k1k2, 0x11)),
+            _mm_loadu_si128((const __m128i*)(p + 48)));
+        p += 64;
+        len -= 64;
+    }
+
+    // the four lanes into one, then the 16 byte blocks left
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x2);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x3);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)), x4);
+    while (len >= 16) {
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x00), _mm_clmulepi64_si128(x1, k3k4, 0x11)),
+            _mm_loadu_si128((const __m128i*)p));
+        p += 16;
+        len -= 16;
+    }
+
+    // 128 to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k5k0, 0x00), x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x10);
+    x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask), poly, 0x00);
+    crc = _mm_extract_epi32(_mm_xor_si128(x1, x0), 1);
+
+    return LftpCrc32Slice8(crc, p, len);
+}
+
+static LftpCrcFunc LftpCrc32Detect(const char** name)
+{
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        *name = "pclmul";
+        return LftpCrc32Hardware;
+    }
+
+    *name = "software";
+    return LftpCrc32Slice8;
+}
+#elif defined(__aarch64__)
+__attribute__((target("arch=armv8-a+crc")))
+static unsigned int LftpCrc32cHardware(unsigned int crc, const unsigned char* p, size_t len)
+{
+    while (len && ((uintptr_t)p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+
+    return crc;
+}
+
+static LftpCrcFunc LftpCrc32cDetect(const char** name)
+{
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        *name = "armv8";
+        return LftpCrc32cHardware;
+    }
+
+    *name = "software";
+    return LftpCrc32cSlice8;
+}
+
+// the same instructions without the c, polynomial of zlib
+__attribute__((target("arch=armv8-a+crc")))
+static unsigned int LftpCrc32Hardware(unsigned int crc, const unsigned char* p, size_t len)
+{
+    while (len && ((uintptr_t)p & 7)) {
+        crc = __crc32b(crc, *p++);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32d(crc, v);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = __crc32b(crc, *p++);
+    }
+
+    return crc;
+}
+
+static LftpCrcFunc LftpCrc32Detect(const char** name)
+{
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        *name = "armv8";
+        return LftpCrc32Hardware;
+    }
+
+    *name = "software";
+    return LftpCrc32Slice8;
+}
+#else
+static LftpCrcFunc LftpCrc32cDetect(const char** name)
+{
+    *name = "software";
+    return LftpCrc32cSlice8;
+}
+
+static LftpCrcFunc LftpCrc32Detect(const char** name)
+{
+    *name = "software";
+    return LftpCrc32Slice8;
+}
+#endif
+
+static LftpCrcFunc LftpCrc32cGet(const char** name)
+{
+    static const char* impl_name;
+    static LftpCrcFunc impl = LftpCrc32cDetect(&impl_name);
+
+    if (name) {
+        *name = impl_name;
+    }
+
+    return impl;
+}
+
+static LftpCrcFunc LftpCrc32Get(const char** name)
+{
+    static const char* impl_name;
+    static LftpCrcFunc impl = LftpCrc32Detect(&impl_name);
+
+    if (name) {
+        *name = impl_name;
+    }
+
+    return impl;
+}
+
+unsigned int LftpCrc32c(unsigned int crc, const void* buf, size_t len)
+{
+    return ~LftpCrc32cGet(NULL)(~crc, (const unsigned char*)buf, len);
+}
+
+unsigned int LftpCrc32cSoftware(unsigned int crc, const void* buf, size_t len)
+{
+    return ~LftpCrc32cSlice8(~crc, (const unsigned char*)buf, len);
+}
+
+unsigned int LftpCrc32(unsigned int crc, const void* buf, size_t len)
+{
+    return ~LftpCrc32Get(NULL)(~crc, (const unsigned char*)buf, len);
+}
+
+unsigned int LftpCrc32Software(unsigned int crc, const void* buf, size_t len)
+{
+    return ~LftpCrc32Slice8(~crc, (const unsigned char*)buf, len);
+}
+
+const char* LftpCrc32cName(void)
+{
+    const char* name;
+    LftpCrc32cGet(&name);
+
+    return name;
+}
+
+const char* LftpCrc32Name(void)
+{
+    const char* name;
+    LftpCrc32Get(&name);
+
+    return name;
+}
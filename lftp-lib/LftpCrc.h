@@ -0,0 +1,46 @@
+/**
+ * @file LftpCrc.h
+ * @author fox
+ * @brief CRC32C and CRC32 of the upload stream
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPCRC_H
+#define LFTPCRC_H
+
+#include <stddef.h>
+
+/*
+ * Both continue a running crc, start with 0. CRC32C (Castagnoli) uses the crc32
+ * instructions of SSE4.2 or ARMv8 when the cpu has them. CRC32 is the one of
+ * zlib, XCRC and HASH CRC32 of ftp servers, it uses PCLMULQDQ folding or the
+ * ARMv8 crc32 instructions.
+ */
+unsigned int LftpCrc32c(unsigned int crc, const void* buf, size_t len);
+unsigned int LftpCrc32(unsigned int crc, const void* buf, size_t len);
+
+/**
+ * @brief table driven CRC32C, what LftpCrc32c falls back to
+ */
+unsigned int LftpCrc32cSoftware(unsigned int crc, const void* buf, size_t len);
+
+/**
+ * @brief table driven CRC32, what LftpCrc32 falls back to
+ */
+unsigned int LftpCrc32Software(unsigned int crc, const void* buf, size_t len);
+
+/**
+ * @brief "sse4.2", "armv8" or "software"
+ */
+const char* LftpCrc32cName(void);
+
+/**
+ * @brief "pclmul", "armv8" or "software"
+ */
+const char* LftpCrc32Name(void);
+
+#endif
@@ -0,0 +1,763 @@
+/**
+ * @file LftpFtp.cpp
+ * @author fox
+ * @brief minimal in-process ftp client used by the native upload engine
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include <string>
+
+using std::string;
+
+#include "LftpFtp.h"
+#include "LftpLog.h"
+
+static int LftpFtpWait(LftpFtp* ftp, int fd, short events)
+{
+    struct pollfd pfd[2];
+
+    pfd[0].fd = fd;
+    pfd[0].events = events;
+    pfd[1].fd = ftp->stop_fd;
+    pfd[1].events = POLLIN;
+
+    while (true) {
+        int ret = poll(pfd, ftp->stop_fd >= 0 ? 2 : 1, ftp->timeout_ms);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            ftp->err = errno;
+            return -1;
+        } else if (ret == 0) {
+            ftp->err = ETIMEDOUT;
+            return -1;
+        }
+
+        if (ftp->stop_fd >= 0 && (pfd[1].revents & POLLIN)) {
+            ftp->err = ECANCELED;
+            return -1;
+        }
+
+        return 0;
+    }
+}
+
+static int LftpFtpSocket(LftpFtp* ftp, const struct sockaddr* addr, socklen_t len)
+{
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        ftp->err = errno;
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (connect(fd, addr, len) != 0) {
+        if (errno != EINPROGRESS) {
+            ftp->err = errno;
+            close(fd);
+            return -1;
+        }
+
+        if (LftpFtpWait(ftp, fd, POLLOUT) != 0) {
+            close(fd);
+            return -1;
+        }
+
+        int so_error = 0;
+        socklen_t so_len = sizeof(so_error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &so_len);
+        if (so_error) {
+            ftp->err = so_error;
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+static int LftpFtpSendAll(LftpFtp* ftp, int fd, const char* buf, size_t len)
+{
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n > 0) {
+            buf += n;
+            len -= n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            if (LftpFtpWait(ftp, fd, POLLOUT) != 0) {
+                return -1;
+            }
+        } else {
+            ftp->err = errno;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int LftpFtpReadLine(LftpFtp* ftp, string& line)
+{
+    line.clear();
+
+    while (true) {
+        char* eol = (char*)memchr(ftp->rbuf, '\n', ftp->rlen);
+        if (eol) {
+            size_t n = eol - ftp->rbuf + 1;
+            line.assign(ftp->rbuf, n);
+            while (line.size() && (line.back() == '\n' || line.back() == '\r')) {
+                line.pop_back();
+            }
+            memmove(ftp->rbuf, ftp->rbuf + n, ftp->rlen - n);
+            ftp->rlen -= n;
+            return 0;
+        }
+
+        if (ftp->rlen == sizeof(ftp->rbuf)) {
+            // overlong line, keep only the head
+            line.append(ftp->rbuf, ftp->rlen);
+            ftp->rlen = 0;
+        }
+
+        ssize_t n = recv(ftp->ctrl, ftp->rbuf + ftp->rlen, sizeof(ftp->rbuf) - ftp->rlen, 0);
+        if (n > 0) {
+            ftp->rlen += n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            if (LftpFtpWait(ftp, ftp->ctrl, POLLIN) != 0) {
+                return -1;
+            }
+        } else {
+            ftp->err = n ? errno : ECONNRESET;
+            return -1;
+        }
+    }
+}
+
+static int LftpFtpReply(LftpFtp* ftp)
+{
+    string line;
+
+    if (LftpFtpReadLine(ftp, line) != 0) {
+        ftp->code = -1;
+        return -1;
+    }
+
+    // multi line reply: "211-..." up to a line starting with "211 "
+    if (line.size() >= 4 && line[3] == '-') {
+        string end = line.substr(0, 3) + " ";
+        string next;
+        do {
+            if (LftpFtpReadLine(ftp, next) != 0) {
+                ftp->code = -1;
+                return -1;
+            }
+        } while (next.compare(0, 4, end) != 0);
+    }
+
+    ftp->code = atoi(line.c_str());
+    snprintf(ftp->reply, sizeof(ftp->reply), "%s", line.c_str());
+
+    LFTP_LOG("<- %s", ftp->reply);
+
+    return ftp->code;
+}
+
+void LftpFtpInit(LftpFtp* ftp, int stop_fd)
+{
+    ftp->ctrl = -1;
+    ftp->data = -1;
+    ftp->timeout_ms = LFTP_FTP_TIMEOUT_MS;
+    ftp->stop_fd = stop_fd;
+    ftp->code = 0;
+    ftp->err = 0;
+    ftp->reply[0] = 0;
+    ftp->rlen = 0;
+    ftp->epsv_failed = false;
+    ftp->peer_len = 0;
+    ftp->no_xcrc = false;
+    ftp->no_hash = false;
+    ftp->hash_crc32 = false;
+    ftp->splice = false;
+    ftp->pipe[0] = ftp->pipe[1] = -1;
+    ftp->piped = 0;
+}
+
+int LftpFtpConnect(LftpFtp* ftp, const char* host, const char* port)
+{
+    struct addrinfo hints;
+    struct addrinfo* res = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int ret = getaddrinfo(host, port, &hints, &res);
+    if (ret != 0) {
+        LFTP_LOG("getaddrinfo %s:%s failed: %s", host, port, gai_strerror(ret));
+        ftp->err = EHOSTUNREACH;
+        return -1;
+    }
+
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        ftp->ctrl = LftpFtpSocket(ftp, ai->ai_addr, ai->ai_addrlen);
+        if (ftp->ctrl >= 0) {
+            memcpy(&ftp->peer, ai->ai_addr, ai->ai_addrlen);
+            ftp->peer_len = ai->ai_addrlen;
+            break;
+        }
+    }
+    freeaddrinfo(res);
+
+    if (ftp->ctrl < 0) {
+        LFTP_LOG("connect %s:%s failed: %s", host, port, strerror(ftp->err));
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(ftp->ctrl, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (LftpFtpReply(ftp) != 220) {
+        LftpFtpAbort(ftp);
+        return -1;
+    }
+
+    return 0;
+}
+
+int LftpFtpCmd(LftpFtp* ftp, const char* format, ...)
+{
+    char cmd[LFTP_FTP_REPLY_MAX];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(cmd, sizeof(cmd) - 2, format, args);
+    va_end(args);
+
+    if (len < 0 || len >= (int)sizeof(cmd) - 2) {
+        ftp->code = -1;
+        return -1;
+    }
+
+    LFTP_LOG("-> %s", strncmp(cmd, "PASS ", 5) ? cmd : "PASS ****");
+
+    cmd[len++] = '\r';
+    cmd[len++] = '\n';
+
+    if (LftpFtpSendAll(ftp, ftp->ctrl, cmd, len) != 0) {
+        ftp->code = -1;
+        return -1;
+    }
+
+    return LftpFtpReply(ftp);
+}
+
+int LftpFtpLogin(LftpFtp* ftp, const char* user, const char* pass)
+{
+    int code = LftpFtpCmd(ftp, "USER %s", user);
+    if (code == 331) {
+        code = LftpFtpCmd(ftp, "PASS %s", pass);
+    }
+
+    if (code != 230 && code != 202) {
+        return -1;
+    }
+
+    if (LftpFtpCmd(ftp, "TYPE I") != 200) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// 257 "/home/ftp" is the current directory, "" inside the name is one "
+static int LftpFtpPwd(LftpFtp* ftp, string& dir)
+{
+    if (LftpFtpCmd(ftp, "PWD") != 257) {
+        return -1;
+    }
+
+    const char* s = strchr(ftp->reply, '"');
+    if (!s) {
+        return -1;
+    }
+
+    dir.clear();
+    for (s++; *s; s++) {
+        if (*s == '"' && s[1] != '"') {
+            return 0;
+        } else if (*s == '"') {
+            s++;
+        }
+        dir += *s;
+    }
+
+    return -1;
+}
+
+int LftpFtpMkdirP(LftpFtp* ftp, const char* path, int* created)
+{
+    string dir(path);
+    string refused;
+    size_t pos = 0;
+
+    *created = 0;
+
+    while (pos != string::npos) {
+        pos = dir.find('/', pos + 1);
+
+        string sub = dir.substr(0, pos);
+        if (sub.empty() || sub == "/") {
+            continue;
+        }
+
+        int code = LftpFtpCmd(ftp, "MKD %s", sub.c_str());
+        if (code == 257) {
+            (*created)++;
+        } else if (code < 0) {
+            return -1;
+        } else {
+            refused = ftp->reply;
+        }
+    }
+
+    if (refused.empty()) {
+        return 0;
+    }
+
+    // 550 is what servers answer for an existing directory, but also for no
+    // permission or a missing parent, only a CWD tells them apart
+    string home;
+    if (dir[0] != '/' && LftpFtpPwd(ftp, home) != 0) {
+        return -1;
+    }
+    if (LftpFtpCwd(ftp, path) != 0) {
+        LFTP_LOG("mkdir %s failed: %s", path, refused.c_str());
+        return -1;
+    }
+    // a relative path is one from the login directory, go back there
+    if (home.size() && LftpFtpCwd(ftp, home.c_str()) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int LftpFtpCwd(LftpFtp* ftp, const char* path)
+{
+    return LftpFtpCmd(ftp, "CWD %s", path) == 250 ? 0 : -1;
+}
+
+long long LftpFtpSize(LftpFtp* ftp, const char* name)
+{
+    if (LftpFtpCmd(ftp, "SIZE %s", name) != 213) {
+        return -1;
+    }
+
+    return atoll(ftp->reply + 4);
+}
+
+static int LftpFtpPassive(LftpFtp* ftp)
+{
+    struct sockaddr_storage addr;
+    int port = -1;
+
+    memcpy(&addr, &ftp->peer, ftp->peer_len);
+
+    if (!ftp->epsv_failed) {
+        // 229 Entering Extended Passive Mode (|||6446|)
+        if (LftpFtpCmd(ftp, "EPSV") == 229) {
+            const char* p = strchr(ftp->reply, '(');
+            if (p && p[1] && p[2] == p[1] && p[3] == p[1]) {
+                port = atoi(p + 4);
+            }
+        } else if (ftp->code < 0) {
+            return -1;
+        } else {
+            ftp->epsv_failed = true;
+        }
+    }
+
+    if (port < 0 && ftp->peer.ss_family == AF_INET) {
+        // 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)
+        unsigned int h[4], p[2];
+
+        if (LftpFtpCmd(ftp, "PASV") != 227) {
+            return -1;
+        }
+
+        const char* s = strchr(ftp->reply, '(');
+        if (!s || sscanf(s, "(%u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) != 6) {
+            return -1;
+        }
+
+        // the advertised host is ignored, servers behind nat often get it wrong
+        port = (p[0] << 8) | p[1];
+    }
+
+    if (port <= 0 || port > 65535) {
+        LFTP_LOG("no usable passive port: %s", ftp->reply);
+        return -1;
+    }
+
+    if (addr.ss_family == AF_INET) {
+        ((struct sockaddr_in*)&addr)->sin_port = htons(port);
+    } else {
+        ((struct sockaddr_in6*)&addr)->sin6_port = htons(port);
+    }
+
+    ftp->data = LftpFtpSocket(ftp, (struct sockaddr*)&addr, ftp->peer_len);
+
+    return ftp->data >= 0 ? 0 : -1;
+}
+
+static int LftpFtpRecvAll(LftpFtp* ftp, int fd, string& data)
+{
+    char buf[4096];
+
+    while (true) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            data.append(buf, n);
+        } else if (n == 0) {
+            return 0;
+        } else if (errno == EAGAIN || errno == EINTR) {
+            if (LftpFtpWait(ftp, fd, POLLIN) != 0) {
+                return -1;
+            }
+        } else {
+            ftp->err = errno;
+            return -1;
+        }
+    }
+}
+
+// type=file;size=1234;modify=20240319120000; name
+static void LftpFtpParseMlsd(const string& line, LftpFtpListEntry entry, void* ctx)
+{
+    size_t space = line.find(' ');
+    if (space == string::npos || space + 1 >= line.size()) {
+        return;
+    }
+
+    bool file = false;
+    long long size = -1;
+    size_t pos = 0;
+    while (pos < space) {
+        size_t end = line.find(';', pos);
+        if (end == string::npos || end > space) {
+            end = space;
+        }
+        string fact = line.substr(pos, end - pos);
+        if (!strcasecmp(fact.c_str(), "type=file")) {
+            file = true;
+        } else if (!strncasecmp(fact.c_str(), "size=", 5)) {
+            size = atoll(fact.c_str() + 5);
+        }
+        pos = end + 1;
+    }
+
+    if (file && size >= 0) {
+        entry(ctx, line.c_str() + space + 1, size);
+    }
+}
+
+// -rw-r--r--    1 ftp      ftp          1234 Mar 19 12:00 name
+static void LftpFtpParseList(const string& line, LftpFtpListEntry entry, void* ctx)
+{
+    long long size;
+    int name = 0;
+
+    if (line.empty() || line[0] != '-'
+        || sscanf(line.c_str(), "%*s %*s %*s %*s %lld %*s %*s %*s %n", &size, &name) != 1 || !name) {
+        return;
+    }
+
+    entry(ctx, line.c_str() + name, size);
+}
+
+int LftpFtpList(LftpFtp* ftp, LftpFtpListEntry entry, void* ctx)
+{
+    bool mlsd = true;
+    int code;
+
+    while (true) {
+        if (LftpFtpPassive(ftp) != 0) {
+            return -1;
+        }
+
+        code = LftpFtpCmd(ftp, mlsd ? "MLSD" : "LIST");
+        if (code == 150 || code == 125) {
+            break;
+        }
+
+        close(ftp->data);
+        ftp->data = -1;
+
+        // 500 unknown command, 502 not implemented
+        if (!mlsd || (code != 500 && code != 502)) {
+            return -1;
+        }
+        mlsd = false;
+    }
+
+    string data;
+    int ret = LftpFtpRecvAll(ftp, ftp->data, data);
+    close(ftp->data);
+    ftp->data = -1;
+
+    code = LftpFtpReply(ftp);
+    if (ret != 0 || (code != 226 && code != 250)) {
+        return -1;
+    }
+
+    size_t pos = 0;
+    while (pos < data.size()) {
+        size_t eol = data.find('\n', pos);
+        if (eol == string::npos) {
+            eol = data.size();
+        }
+        string line = data.substr(pos, eol - pos);
+        if (line.size() && line.back() == '\r') {
+            line.pop_back();
+        }
+        pos = eol + 1;
+
+        if (mlsd) {
+            LftpFtpParseMlsd(line, entry, ctx);
+        } else {
+            LftpFtpParseList(line, entry, ctx);
+        }
+    }
+
+    return 0;
+}
+
+int LftpFtpStorBegin(LftpFtp* ftp, const char* name, unsigned long long offset)
+{
+    if (LftpFtpPassive(ftp) != 0) {
+        return -1;
+    }
+
+    if (offset && LftpFtpCmd(ftp, "REST %llu", offset) != 350) {
+        close(ftp->data);
+        ftp->data = -1;
+        return -1;
+    }
+
+    int code = LftpFtpCmd(ftp, "STOR %s", name);
+    if (code != 150 && code != 125) {
+        close(ftp->data);
+        ftp->data = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+int LftpFtpWrite(LftpFtp* ftp, const char* buf, size_t len)
+{
+    return LftpFtpSendAll(ftp, ftp->data, buf, len);
+}
+
+// fill the empty pipe from the file, then drain it into the data connection
+static ssize_t LftpFtpSplice(LftpFtp* ftp, int fd, unsigned long long offset, size_t len)
+{
+    if (ftp->pipe[0] < 0) {
+        if (pipe2(ftp->pipe, O_CLOEXEC) != 0) {
+            return -1;
+        }
+        // fewer round trips through the pipe, the default size is fine too
+        fcntl(ftp->pipe[1], F_SETPIPE_SZ, LFTP_FTP_PIPE_SIZE);
+    }
+
+    if (!ftp->piped) {
+        loff_t off = offset;
+        ssize_t n = splice(fd, &off, ftp->pipe[1], NULL, len, SPLICE_F_MOVE);
+        if (n <= 0) {
+            return n;
+        }
+        ftp->piped = n;
+    }
+
+    ssize_t n = splice(ftp->pipe[0], NULL, ftp->data, NULL, ftp->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        ftp->piped -= n;
+    }
+
+    return n;
+}
+
+ssize_t LftpFtpSendFile(LftpFtp* ftp, int fd, unsigned long long offset, size_t len)
+{
+    size_t sent = 0;
+
+    while (sent < len) {
+        ssize_t n;
+        if (!ftp->splice) {
+            off_t off = offset + sent;
+            n = sendfile(ftp->data, fd, &off, len - sent);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS) && !sent) {
+                LFTP_LOG("sendfile not supported, splice");
+                ftp->splice = true;
+                continue;
+            }
+        } else {
+            n = LftpFtpSplice(ftp, fd, offset + sent, len - sent);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS) && !sent && !ftp->piped) {
+                ftp->err = EOPNOTSUPP;
+                return -1;
+            }
+        }
+
+        if (n > 0) {
+            sent += n;
+        } else if (n == 0) {
+            // end of the file
+            break;
+        } else if (errno == EAGAIN || errno == EINTR) {
+            if (LftpFtpWait(ftp, ftp->data, POLLOUT) != 0) {
+                return -1;
+            }
+        } else {
+            ftp->err = errno;
+            return -1;
+        }
+    }
+
+    return sent;
+}
+
+int LftpFtpStorEnd(LftpFtp* ftp)
+{
+    if (ftp->data >= 0) {
+        close(ftp->data);
+        ftp->data = -1;
+    }
+
+    int code = LftpFtpReply(ftp);
+
+    return (code == 226 || code == 250) ? 0 : -1;
+}
+
+static bool LftpFtpUnknown(int code)
+{
+    // unknown command, not implemented, not implemented for that parameter
+    return code == 500 || code == 502 || code == 504;
+}
+
+static int LftpFtpParseHex(const char* s, unsigned int* crc)
+{
+    char* end;
+
+    while (*s == ' ') {
+        s++;
+    }
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        s += 2;
+    }
+
+    unsigned long value = strtoul(s, &end, 16);
+    if (end == s || (*end && *end != ' ')) {
+        return -1;
+    }
+    *crc = value;
+
+    return 0;
+}
+
+int LftpFtpCrc32(LftpFtp* ftp, const char* name, unsigned int* crc)
+{
+    int timeout_ms = ftp->timeout_ms;
+    int ret = -1;
+
+    ftp->timeout_ms = LFTP_FTP_CRC_TIMEOUT_MS;
+
+    if (!ftp->no_xcrc) {
+        // 250 A1B2C3D4
+        int code = LftpFtpCmd(ftp, "XCRC %s", name);
+        if (code == 250) {
+            ret = LftpFtpParseHex(ftp->reply + 4, crc);
+            goto crc_exit;
+        }
+        ftp->no_xcrc = LftpFtpUnknown(code);
+        if (!ftp->no_xcrc) {
+            goto crc_exit;
+        }
+    }
+
+    if (!ftp->no_hash) {
+        if (!ftp->hash_crc32) {
+            int code = LftpFtpCmd(ftp, "OPTS HASH CRC32");
+            ftp->hash_crc32 = code == 200;
+            ftp->no_hash = !ftp->hash_crc32 && (code == 501 || LftpFtpUnknown(code));
+        }
+
+        // 213 CRC32 0-1234 a1b2c3d4 name
+        if (ftp->hash_crc32) {
+            int code = LftpFtpCmd(ftp, "HASH %s", name);
+            char hex[16];
+            if (code == 213 && sscanf(ftp->reply + 4, "%*s %*s %15s", hex) == 1) {
+                ret = LftpFtpParseHex(hex, crc);
+            }
+            ftp->no_hash = LftpFtpUnknown(code);
+        }
+    }
+
+crc_exit:
+    ftp->timeout_ms = timeout_ms;
+
+    return ret;
+}
+
+void LftpFtpClose(LftpFtp* ftp)
+{
+    if (ftp->ctrl >= 0 && ftp->data < 0) {
+        LftpFtpCmd(ftp, "QUIT");
+    }
+
+    LftpFtpAbort(ftp);
+}
+
+void LftpFtpAbort(LftpFtp* ftp)
+{
+    if (ftp->data >= 0) {
+        close(ftp->data);
+        ftp->data = -1;
+    }
+
+    if (ftp->ctrl >= 0) {
+        close(ftp->ctrl);
+        ftp->ctrl = -1;
+    }
+
+    // bytes left in the pipe belong to a transfer that failed
+    if (ftp->pipe[0] >= 0) {
+        close(ftp->pipe[0]);
+        close(ftp->pipe[1]);
+        ftp->pipe[0] = ftp->pipe[1] = -1;
+    }
+    ftp->piped = 0;
+    // the next session tries sendfile again
+    ftp->splice = false;
+
+    ftp->rlen = 0;
+}
@@ -0,0 +1,162 @@
+/**
+ * @file LftpFtp.h
+ * @author fox
+ * @brief minimal in-process ftp client used by the native upload engine
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPFTP_H
+#define LFTPFTP_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define LFTP_FTP_REPLY_MAX 1024
+#define LFTP_FTP_TIMEOUT_MS (30 * 1000)
+#define LFTP_FTP_PIPE_SIZE (1024 * 1024)
+#define LFTP_FTP_CRC_TIMEOUT_MS (5 * 60 * 1000) // the server reads the whole file
+
+typedef struct _LftpFtp {
+    int ctrl;
+    int data;
+
+    int timeout_ms;
+    int stop_fd;
+
+    int code;
+    int err;
+    char reply[LFTP_FTP_REPLY_MAX];
+
+    char rbuf[LFTP_FTP_REPLY_MAX];
+    size_t rlen;
+
+    bool epsv_failed;
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+
+    bool no_xcrc;               // the server does not know XCRC
+    bool no_hash;               // nor HASH with CRC32
+    bool hash_crc32;            // OPTS HASH CRC32 done
+
+    bool splice;                // sendfile refused a file, splice through pipe for the rest of the session
+    int pipe[2];
+    size_t piped;               // bytes in pipe not yet sent
+} LftpFtp;
+
+/**
+ * @brief reset a ftp handle, no connection is made
+ *
+ * @param ftp
+ * @param stop_fd readable fd (eventfd) aborts any wait on the sockets, -1 for none
+ */
+void LftpFtpInit(LftpFtp* ftp, int stop_fd);
+
+/**
+ * @brief open the control connection and read the greeting
+ *
+ * @param ftp
+ * @param host
+ * @param port
+ * @return int 0 success, -1 fail (ftp->err holds errno)
+ */
+int LftpFtpConnect(LftpFtp* ftp, const char* host, const char* port);
+
+/**
+ * @brief USER/PASS and switch to binary mode
+ *
+ * @return int 0 success, -1 fail (ftp->code holds the reply code)
+ */
+int LftpFtpLogin(LftpFtp* ftp, const char* user, const char* pass);
+
+/**
+ * @brief send one command and wait for the final reply
+ *
+ * @return int reply code, -1 on connection error
+ */
+int LftpFtpCmd(LftpFtp* ftp, const char* format, ...);
+
+/**
+ * @brief create every missing component of path, like `mkdir -p`
+ *
+ * @param created number of directories created
+ * @return int 0 success, -1 fail or path is no directory after all
+ */
+int LftpFtpMkdirP(LftpFtp* ftp, const char* path, int* created);
+
+int LftpFtpCwd(LftpFtp* ftp, const char* path);
+
+/**
+ * @brief remote file size
+ *
+ * @return long long size, -1 if unknown
+ */
+long long LftpFtpSize(LftpFtp* ftp, const char* name);
+
+/**
+ * @brief called once per regular file of a listing
+ */
+typedef void (*LftpFtpListEntry)(void* ctx, const char* name, long long size);
+
+/**
+ * @brief list the regular files of the current directory with their sizes,
+ * MLSD, LIST if the server does not know MLSD
+ *
+ * @return int 0 success, -1 fail
+ */
+int LftpFtpList(LftpFtp* ftp, LftpFtpListEntry entry, void* ctx);
+
+/**
+ * @brief open a passive data connection and start STOR, REST first if offset
+ *
+ * @return int 0 success, -1 fail
+ */
+int LftpFtpStorBegin(LftpFtp* ftp, const char* name, unsigned long long offset);
+
+/**
+ * @brief write the whole buffer to the data connection
+ *
+ * @return int 0 success, -1 fail
+ */
+int LftpFtpWrite(LftpFtp* ftp, const char* buf, size_t len);
+
+/**
+ * @brief send len bytes of file fd from offset on the data connection without
+ * copying them to user space, sendfile first, splice through a pipe if the
+ * file does not support sendfile
+ *
+ * The file position of fd is not used nor changed.
+ *
+ * @return ssize_t bytes sent, less than len only at the end of the file, -1 fail
+ * (ftp->err is EOPNOTSUPP if the file supports neither, nothing was sent then)
+ */
+ssize_t LftpFtpSendFile(LftpFtp* ftp, int fd, unsigned long long offset, size_t len);
+
+/**
+ * @brief close the data connection and wait for the transfer complete reply
+ *
+ * @return int 0 success, -1 fail
+ */
+int LftpFtpStorEnd(LftpFtp* ftp);
+
+/**
+ * @brief CRC32 of a remote file, XCRC or else HASH with CRC32
+ *
+ * @return int 0 success, -1 fail or not supported by the server
+ */
+int LftpFtpCrc32(LftpFtp* ftp, const char* name, unsigned int* crc);
+
+/**
+ * @brief QUIT and close all connections
+ */
+void LftpFtpClose(LftpFtp* ftp);
+
+/**
+ * @brief close all connections without talking to the server
+ */
+void LftpFtpAbort(LftpFtp* ftp);
+
+#endif
@@ -0,0 +1,212 @@
+/**
+ * @file LftpJournal.cpp
+ * @author fox
+ * @brief append only resume journal of finished files and upload offsets
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "LftpJournal.h"
+#include "LftpLog.h"
+
+static unsigned long long LftpJournalNowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static string LftpJournalRecord(const string& key, const LftpJournalEntry& e)
+{
+    char head[96];
+
+    snprintf(head, sizeof(head), "%c %llu %lld %llu ", e.done ? 'D' : 'O', e.size, e.mtime, e.offset);
+
+    return string(head) + key + "\n";
+}
+
+static int LftpJournalWrite(int fd, const string& data)
+{
+    const char* p = data.data();
+    size_t len = data.size();
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static void LftpJournalLoad(LftpJournal* j, const string& path)
+{
+    FILE* fp = fopen(path.c_str(), "re");
+    if (!fp) {
+        return;
+    }
+
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &cap, fp)) > 0) {
+        // a record cut by a crash has no newline
+        if (line[n - 1] != '\n') {
+            break;
+        }
+        line[n - 1] = 0;
+
+        char type;
+        LftpJournalEntry e;
+        int key = 0;
+        if (sscanf(line, "%c %llu %lld %llu %n", &type, &e.size, &e.mtime, &e.offset, &key) != 4
+            || !key || (type != 'D' && type != 'O')) {
+            continue;
+        }
+        e.done = type == 'D';
+        j->entries[line + key] = e;
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+int LftpJournalOpen(LftpJournal* j, const string& path)
+{
+    j->fd = -1;
+    j->entries.clear();
+    j->sync_ms = LftpJournalNowMs();
+    j->dirty = false;
+    pthread_mutex_init(&j->lock, NULL);
+
+    LftpJournalLoad(j, path);
+
+    // compact into a new file, the old one stays valid until the rename
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LFTP_LOG("open journal %s failed: %s", tmp.c_str(), strerror(errno));
+        return -1;
+    }
+
+    string data;
+    for (map<string, LftpJournalEntry>::iterator it = j->entries.begin(); it != j->entries.end(); ++it) {
+        data += LftpJournalRecord(it->first, it->second);
+    }
+
+    if (LftpJournalWrite(fd, data) != 0 || fdatasync(fd) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        LFTP_LOG("write journal %s failed: %s", path.c_str(), strerror(errno));
+        close(fd);
+        unlink(tmp.c_str());
+        return -1;
+    }
+    close(fd);
+
+    j->fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (j->fd < 0) {
+        LFTP_LOG("open journal %s failed: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    LFTP_LOG("journal %s: %d entries", path.c_str(), (int)j->entries.size());
+
+    return 0;
+}
+
+void LftpJournalClose(LftpJournal* j)
+{
+    if (j->fd >= 0) {
+        if (j->dirty) {
+            fdatasync(j->fd);
+        }
+        close(j->fd);
+        j->fd = -1;
+    }
+
+    j->entries.clear();
+    pthread_mutex_destroy(&j->lock);
+}
+
+bool LftpJournalLookup(LftpJournal* j, const string& key, unsigned long long size, long long mtime,
+    LftpJournalEntry* entry)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&j->lock);
+    map<string, LftpJournalEntry>::iterator it = j->entries.find(key);
+    if (it != j->entries.end() && it->second.size == size && it->second.mtime == mtime) {
+        *entry = it->second;
+        found = true;
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    return found;
+}
+
+static int LftpJournalAppend(LftpJournal* j, const string& key, const LftpJournalEntry& e)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&j->lock);
+
+    j->entries[key] = e;
+    if (j->fd >= 0) {
+        ret = LftpJournalWrite(j->fd, LftpJournalRecord(key, e));
+        j->dirty = true;
+
+        // records of all workers share one fsync per interval
+        unsigned long long now = LftpJournalNowMs();
+        if (ret == 0 && now - j->sync_ms >= LFTP_JOURNAL_SYNC_MS) {
+            ret = fdatasync(j->fd);
+            j->sync_ms = now;
+            j->dirty = false;
+        }
+    }
+
+    pthread_mutex_unlock(&j->lock);
+
+    if (ret != 0) {
+        LFTP_LOG("journal write failed: %s", strerror(errno));
+    }
+
+    return ret;
+}
+
+int LftpJournalCheckpoint(LftpJournal* j, const string& key, unsigned long long size, long long mtime,
+    unsigned long long offset)
+{
+    LftpJournalEntry e;
+    e.done = false;
+    e.offset = offset;
+    e.size = size;
+    e.mtime = mtime;
+
+    return LftpJournalAppend(j, key, e);
+}
+
+int LftpJournalComplete(LftpJournal* j, const string& key, unsigned long long size, long long mtime)
+{
+    LftpJournalEntry e;
+    e.done = true;
+    e.offset = size;
+    e.size = size;
+    e.mtime = mtime;
+
+    return LftpJournalAppend(j, key, e);
+}
@@ -0,0 +1,76 @@
+/**
+ * @file LftpJournal.h
+ * @author fox
+ * @brief append only resume journal of finished files and upload offsets
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPJOURNAL_H
+#define LFTPJOURNAL_H
+
+#include <pthread.h>
+
+#include <map>
+#include <string>
+
+using std::map;
+using std::string;
+
+#define LFTP_JOURNAL_SYNC_MS 1000   // fsync at most once per interval
+
+typedef struct _LftpJournalEntry {
+    bool done;
+    unsigned long long offset;  // bytes sent when not done
+    unsigned long long size;    // local file when the entry was written
+    long long mtime;
+} LftpJournalEntry;
+
+/*
+ * One line per record, `<D|O> <size> <mtime> <offset> <key>`, the last record
+ * of a key wins. Entries only match while the local file keeps size and mtime.
+ * Use one journal file per session.
+ */
+typedef struct _LftpJournal {
+    int fd;
+    pthread_mutex_t lock;
+    map<string, LftpJournalEntry> entries;
+    unsigned long long sync_ms;
+    bool dirty;                 // written since the last fsync
+} LftpJournal;
+
+/**
+ * @brief load the journal and rewrite it with one record per key
+ *
+ * @return int 0 success, -1 fail (the journal is off)
+ */
+int LftpJournalOpen(LftpJournal* j, const string& path);
+
+/**
+ * @brief fsync and close
+ */
+void LftpJournalClose(LftpJournal* j);
+
+/**
+ * @brief entry of key if it still matches the local file
+ *
+ * @return true found
+ */
+bool LftpJournalLookup(LftpJournal* j, const string& key, unsigned long long size, long long mtime,
+    LftpJournalEntry* entry);
+
+/**
+ * @brief record the bytes sent so far
+ */
+int LftpJournalCheckpoint(LftpJournal* j, const string& key, unsigned long long size, long long mtime,
+    unsigned long long offset);
+
+/**
+ * @brief record a finished file
+ */
+int LftpJournalComplete(LftpJournal* j, const string& key, unsigned long long size, long long mtime);
+
+#endif
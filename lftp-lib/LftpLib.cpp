@@ -8,91 +8,242 @@
  * @copyright Copyright (c) 2024
  * 
  */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
-#include <queue>
-#include <regex>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 
-using std::queue;
+using std::map;
+using std::set;
 using std::string;
+using std::vector;
 
+#include "LftpChannel.h"
+#include "LftpCrc.h"
+#include "LftpFtp.h"
+#include "LftpJournal.h"
 #include "LftpLib.h"
+#include "LftpLog.h"
+#include "LftpParse.h"
+#include "LftpProc.h"
+#include "LftpRate.h"
+#include "LftpRemux.h"
+#include "LftpTimings.h"
+#include "LftpUring.h"
 
-#define LFTP_DEBUG
+struct _LftpInfo;
 
-#ifdef LFTP_DEBUG
-#define DEBUG(format, ...) printf(format, ##__VA_ARGS__)
-#else
-#define DEBUG(format, ...)
-#endif
+typedef struct _LftpWorker {
+    struct _LftpInfo* info;
+    int id;
+    pthread_t tid;
 
-#define LFTP_LOG(format, ...)                   \
-    do {                                        \
-        DEBUG("[%s:%d] Lftp-> " format "\n",    \
-            __func__, __LINE__, ##__VA_ARGS__); \
-    } while (0)
+    LftpChannel* channel;
+    LftpStatus status;
+    unsigned long long pos;         // position in the current file
+    unsigned long long bytes;       // pos as last published under lock
+    unsigned long long cpu_ns;      // cpu time of the uploads in the batch, under lock
+    unsigned long long sent;        // bytes sent in that time, under lock
+
+    unsigned int crc32c;            // of the bytes of the current file sent so far
+    unsigned int crc32;
+    unsigned long long hashed;      // bytes in the crcs
+    unsigned long long remux_send_ns; // time the remux output spent sending, current file
+
+    LftpFtp ftp;                    // native engine session, kept across files
+    bool connected;                 // ftp is logged in and in remote_path
+    bool transient;                 // the last upload failed in a way a retry may fix
+    int file_index;                 // file taken from the queue, -1 none, under lock
+    bool canceled;                  // LftpSessionCancel of file_index, set under lock
+} LftpWorker;
+
+typedef struct _LftpJob {
+    int index;                  // index in LftpParam.files
+    string file_name;           // name reported in the status
+    string file_path;           // local file to upload
+    bool temp;                  // transcoded copy, removed after upload
+    bool remux;                 // file_path is ts, remuxed to mp4 while uploading
+    unsigned long long transcode_ns; // ffmpeg run that made file_path, 0 for none
+    int part;                   // of a split file, sent as its own remote file
+    int parts;                  // 0 for a whole file
+    unsigned long long part_offset; // in file_path, on a ts packet boundary
+    unsigned long long part_size;
+} LftpJob;
+
+// a file uploaded as parts, by index
+typedef struct _LftpSplit {
+    int left;                   // parts no worker is done with yet
+    set<int> sent;              // parts on the server
+    unsigned long long size;
+    unsigned long long part_size; // of every part but the last
+} LftpSplit;
+
+// place of a file in the queues, the smallest key is taken first
+typedef struct _LftpQueueKey {
+    int priority;               // higher first
+    long long deadline_ms;      // CLOCK_MONOTONIC, earlier first, LLONG_MAX for none
+    long long order;            // by queue_order: 0 fifo, -mtime newest, size smallest
+    int index;                  // then in the order queued
+    int part;                   // then the parts of a split file
+
+    bool operator<(const struct _LftpQueueKey& o) const
+    {
+        if (priority != o.priority) {
+            return priority > o.priority;
+        }
+        if (deadline_ms != o.deadline_ms) {
+            return deadline_ms < o.deadline_ms;
+        }
+        if (order != o.order) {
+            return order < o.order;
+        }
+        if (index != o.index) {
+            return index < o.index;
+        }
+        return part < o.part;
+    }
+} LftpQueueKey;
 
-typedef struct _LftpInfo {
+struct _LftpInfo {
     LftpParam param;
 
     struct {
         pthread_t tid;
+        bool joinable;          // tid was started and not joined yet
         int running;
-        FILE* pipe;
+        int stop_fd;            // eventfd, readable once a stop was requested
+        LftpFtp ftp;            // session of the remote mkdir, handed to the first worker
+        bool connected;
     } sender;
 
     pthread_mutex_t lock;
 
     LftpStatus status;
-    queue<LftpStatus> status_queue;
 
-} LftpInfo;
+    // one channel per producer: the sender, the transcoders, then the workers
+    LftpChannel* channels;
+    int channel_count;
+    std::atomic<unsigned long long> sequence;
 
-static LftpInfo lftpInfo;
+    LftpRateFlow rate;          // share of the global rate limit
+    LftpJournal journal;        // fd -1 while off
+    FILE* manifest;             // checksums of the sent files, NULL while off
+    LftpTimings timings;        // phase histograms of all batches of the session
 
-static string LftpBytesToString(unsigned long long bytes)
-{
-    char result[32] = { 0 };
+    // listing of remote_path from the batch start, kept up to date, under lock
+    struct {
+        bool valid;
+        map<string, long long> sizes; // -1 unknown since an upload failed
+    } remote;
 
-    if (bytes < 1024) {
-        sprintf(result, "%lluB", bytes);
-    } else if (bytes < 1024 * 1024) {
-        sprintf(result, "%.2fKB", (float)bytes / 1024);
-    } else if (bytes < 1024 * 1024 * 1024) {
-        sprintf(result, "%.2fMB", (float)bytes / (1024 * 1024));
-    } else {
-        sprintf(result, "%.2fGB", (float)bytes / (1024 * 1024 * 1024));
-    }
+    // tells the reader a status is waiting
+    struct {
+        int fd;                 // eventfd, readable while statuses are waiting
+        LftpStatusNotify callback;
+        void* ctx;
+    } notify;
 
-    return string(result);
-}
+    vector<LftpWorker> workers;
+    vector<LftpWorker> transcoders; // resized under lock
 
-static string LftpSecondsToString(unsigned long long seconds)
-{
-    char result[32] = { 0 };
+    // shared file queues, protected by lock
+    struct {
+        pthread_cond_t cond;
+        set<LftpQueueKey> pending;         // waiting for a transcoder
+        map<LftpQueueKey, LftpJob> ready;  // waiting for an upload worker
+        vector<LftpQueueKey> keys;         // by file index
+        int takers;             // workers still taking files, -1 before they start
+        int producing;          // transcoders that may still add to ready
+        bool watching;          // the sender may still add new files of path
+        int finished;
+        bool failed;
+        vector<unsigned long long> sizes;
+        unsigned long long total_bytes;
+        unsigned long long finished_bytes;
+        int sessions;           // native logins, the mkdir one included
+        int uploads;            // files sent by the native engine
+        map<int, LftpSplit> split; // files uploaded as parts
+    } files;
 
-    if (seconds < 60) {
-        sprintf(result, "%llds", seconds);
-    } else if (seconds < 60 * 60) {
-        sprintf(result, "%lldm", seconds / 60);
-    } else if (seconds < 60 * 60 * 24) {
-        sprintf(result, "%lldh", seconds / (60 * 60));
-    } else {
-        sprintf(result, "%lldd", seconds / (60 * 60 * 24));
-    }
+};
 
-    return string(result);
-}
+typedef struct _LftpInfo LftpInfo;
+
+// session behind the LftpUploadFiles* functions
+static LftpSession* lftpDefault = NULL;
+
+#define LFTP_CHANNEL_SENDER 0
+#define LFTP_CHANNEL_TRANSCODERS 1  // one per transcoder, the workers follow
+
+// ioprio_set(2), glibc has no wrapper
+#define LFTP_IOPRIO_WHO_PROCESS 1
+#define LFTP_IOPRIO_CLASS_SHIFT 13
+#define LFTP_IOPRIO_CLASS_IDLE 3
+
+// connect, USER, PASS, TYPE, CWD and QUIT of a login per file
+#define LFTP_NATIVE_SESSION_ROUND_TRIPS 6
+
+#define LFTP_TS_PACKET_SIZE 188
+
+// parts of a split file are named <name>.part000 and up
+#define LFTP_SPLIT_PARTS_MAX 1000
+
+// longest wait of a live file for an inotify event
+#define LFTP_NATIVE_FOLLOW_POLL_MS 500
+
+// longest wait of the directory watch, it also ends when a worker failed
+#define LFTP_WATCH_POLL_MS 500
+
+// bytes per sendfile/splice call, the rate limit is taken per chunk
+#define LFTP_NATIVE_SENDFILE_CHUNK (512 * 1024)
 
-static string LftpStateToString(LFTP_STATE state)
+// readahead is asked for and sent bytes are dropped in steps of this
+#define LFTP_NATIVE_READAHEAD (8 * 1024 * 1024)
+
+// offset, length and buffer of O_DIRECT reads, the largest common block size
+#define LFTP_NATIVE_DIRECT_ALIGN 4096
+
+// a cancel ends the backoff before a retry within this
+#define LFTP_RETRY_POLL_MS 100
+
+// registered buffer of a uring transfer, the bytes of one read→send chain
+#define LFTP_URING_CHUNK (256 * 1024)
+#define LFTP_URING_RATE_CHUNK (64 * 1024)
+
+// idle uring transfers look for new files, and backoffs end, within this
+#define LFTP_URING_TICK_MS 100
+
+// user_data of a uring op: worker id << LFTP_URING_OP_BITS | LFTP_URING_OP
+#define LFTP_URING_OP_BITS 8
+
+static const char* LftpStateToString(LFTP_STATE state)
 {
-    string state_str;
+    const char* state_str = "";
     switch (state) {
     case LFTP_STATE_IDLE:
         state_str = "Start...";
@@ -115,6 +266,9 @@ static string LftpStateToString(LFTP_STATE state)
     case LFTP_STATE_ABORT:
         state_str = "Transfer abort";
         break;
+    case LFTP_STATE_CHECKSUM_MISMATCH:
+        state_str = "Checksum mismatch";
+        break;
     case LFTP_STATE_TRANSCODING:
         state_str = "Transcoding...";
         break;
@@ -124,6 +278,15 @@ static string LftpStateToString(LFTP_STATE state)
     case LFTP_STATE_TRANSFERRED:
         state_str = "Transferred";
         break;
+    case LFTP_STATE_RETRYING:
+        state_str = "Retrying...";
+        break;
+    case LFTP_STATE_CANCELED:
+        state_str = "Canceled";
+        break;
+    case LFTP_STATE_TRANSCODE_FAILED:
+        state_str = "Transcode failed";
+        break;
     default:
         LFTP_LOG("unkown lftp state");
         break;
@@ -132,490 +295,3852 @@ static string LftpStateToString(LFTP_STATE state)
     return state_str;
 }
 
-static int LftpParseOutput(const string& output, LftpInfo* p)
+const char* LftpPhaseName(LFTP_PHASE phase)
 {
-    std::smatch match;
+    switch (phase) {
+    case LFTP_PHASE_CONNECT:
+        return "connect";
+    case LFTP_PHASE_LOGIN:
+        return "login";
+    case LFTP_PHASE_MKDIR:
+        return "mkdir";
+    case LFTP_PHASE_TRANSCODE:
+        return "transcode";
+    case LFTP_PHASE_TRANSFER:
+        return "transfer";
+    case LFTP_PHASE_CHECKSUM:
+        return "checksum";
+    case LFTP_PHASE_FILE:
+        return "file";
+    default:
+        return "";
+    }
+}
 
-    if (output.find("Sending") != std::string::npos) {
-        // Transferring: `.../20240321160232.ts' at 1013275648 (83%) 11.18M/s eta:18s [Sending data]
-        std::regex pattern(R"(`(.*?)' at (\d+) \((\d+)%\) (\d+\.\d+\w\/s) eta:(\w+) )");
-        // Transferring: `/home/deviser/ts/20240228140912_5191_HDMI.ts' at 81003344 (72%) [Sending data]
-        std::regex pattern_ex(R"(`(.*?)' at (\d+) \((\d+)%\) )");
+static int LftpParseOutput(const char* line, size_t len, LftpStatus* status, unsigned long long* pos)
+{
+    LftpProgressLine progress;
 
-        p->status.transfer_state = LFTP_STATE_TRANSFERRING;
+    bool parsed = LftpParseProgressLine(line, len, &progress) == 0;
+    if (!parsed) {
+        LFTP_LOG("parse failed: %.*s", (int)len, line);
+    }
 
-        if (std::regex_search(output, match, pattern)) {
-            // Transferring: `.../20240321160232.ts' at 1013275648 (83%) 11.18M/s eta:18s [Sending data]
-            string file_name = match[1].str();
-            size_t found = file_name.find_last_of("/");
-            if (found != std::string::npos) {
-                file_name.erase(0, found + 1);
-            }
+    if (progress.type == LFTP_LINE_SENDING) {
+        status->transfer_state = LFTP_STATE_TRANSFERRING;
 
-            // p->status.file_name = file_name;
-            string bytes = match[2].str();
-            p->status.transferred_bytes = LftpBytesToString(atoll(bytes.c_str()));
-            p->status.transferred_progress = match[3].str();
-            p->status.transfer_rate = match[4].str();
-            p->status.remaining_time = match[5].str();
-        } else if (std::regex_search(output, match, pattern_ex)) {
-            // Transferring: `/home/deviser/ts/20240228140912_5191_HDMI.ts' at 81003344 (72%) [Sending data]
-            string file_name = match[1].str();
-            size_t found = file_name.find_last_of("/");
-            if (found != std::string::npos) {
-                file_name.erase(0, found + 1);
-            }
+        if (parsed) {
+            *pos = progress.bytes;
+            status->transferred_bytes = progress.bytes;
+            status->transferred_progress = progress.percent;
 
-            // p->status.file_name = file_name;
-            string bytes = match[2].str();
-            p->status.transferred_bytes = LftpBytesToString(atoll(bytes.c_str()));
-            p->status.transferred_progress = match[3].str();
-            p->status.transfer_rate = "0";
-            p->status.remaining_time = "0";
-        } else {
-            LFTP_LOG("parse failed: %s", output.c_str());
+            if (progress.detailed) {
+                status->transfer_rate = LftpParseRate(progress.rate);
+                status->remaining_time = LftpParseDuration(progress.eta);
+            } else {
+                status->transfer_rate = 0;
+                status->remaining_time = -1;
+            }
         }
-    } else if (output.find("transferred") != std::string::npos) {
-        // transferred: 1219759412 bytes transferred in 104 seconds (11.20 MiB/s)
-        // transferred: 1110982416 bytes transferred in 1 second (82.17M/s)
-        // transferred: (small file and transferred fast): 14661659 bytes transferred
-        std::regex pattern("(\\d+) bytes transferred in (\\d+) seconds? \\(([^)]+)\\)");
-        std::regex pattern_ex("(\\d+) bytes transferred");
+    } else if (progress.type == LFTP_LINE_TRANSFERRED) {
+        status->transfer_state = LFTP_STATE_TRANSFERRED;
 
-        p->status.transfer_state = LFTP_STATE_TRANSFERRED;
+        if (parsed) {
+            *pos = progress.bytes;
+            status->transferred_bytes = progress.bytes;
+            status->transferred_progress = 100;
+            status->remaining_time = 0;
 
-        if (std::regex_search(output, match, pattern)) {
-            string bytes = match[1].str();
-            p->status.transferred_bytes = LftpBytesToString(atoll(bytes.c_str()));
-            p->status.transferred_progress = string("100");
-            p->status.transferred_time = match[2].str();
-            string time = match[2].str();
-            p->status.transferred_time = LftpSecondsToString(atoll(time.c_str()));
-            p->status.transfer_rate = match[3].str();
-        } else if (std::regex_search(output, match, pattern_ex)) {
-            string bytes = match[1].str();
-            p->status.transferred_bytes = LftpBytesToString(atoll(bytes.c_str()));
-            p->status.transferred_progress = string("100");
-        } else {
-            LFTP_LOG("parse failed: %s", output.c_str());
+            if (progress.detailed) {
+                status->transferred_time = progress.seconds;
+                status->transfer_rate = LftpParseRate(progress.rate);
+            }
         }
-    } else if (output.find("Login incorrect") != std::string::npos) {
-        p->status.transfer_state = LFTP_STATE_LOGIN_INCORRECT;
-    } else if (output.find("No route to host") != std::string::npos 
-        || output.find("Delaying before reconnect") != std::string::npos
-        || output.find("Not connected") != std::string::npos) {
-        p->status.transfer_state = LFTP_STATE_NO_ROUTE_TO_HOST;
-    } else if (output.find("mkdir ok") != std::string::npos) {
-        p->status.transfer_state = LFTP_STATE_MKDIR_OK;
-    } else if (output.find("mkdir: Access failed") != std::string::npos) {
-        p->status.transfer_state = LFTP_STATE_REMOTE_DIR_EXIST;
+    } else if (LftpSpanContains(line, len, "Login incorrect")) {
+        status->transfer_state = LFTP_STATE_LOGIN_INCORRECT;
+    } else if (LftpSpanContains(line, len, "No route to host")
+        || LftpSpanContains(line, len, "Delaying before reconnect")
+        || LftpSpanContains(line, len, "Not connected")) {
+        status->transfer_state = LFTP_STATE_NO_ROUTE_TO_HOST;
+    } else if (LftpSpanContains(line, len, "mkdir ok")) {
+        status->transfer_state = LFTP_STATE_MKDIR_OK;
+    } else if (LftpSpanContains(line, len, "mkdir: Access failed")) {
+        status->transfer_state = LFTP_STATE_REMOTE_DIR_EXIST;
     }
 
     return 0;
 }
 
-static int LftpLock(void)
+static unsigned long long LftpNowMs(void)
 {
-    if (lftpInfo.sender.running) {
-        return pthread_mutex_lock(&lftpInfo.lock);
-    } else {
-        return 0;
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static int LftpUnlock(void)
+static unsigned long long LftpNowNs(void)
 {
-    if (lftpInfo.sender.running) {
-        return pthread_mutex_unlock(&lftpInfo.lock);
-    } else {
-        return 0;
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static int LftpStatusEnqueue(LftpInfo* p)
+// one run of a phase, into the histograms of the session and the status of the file
+static void LftpPhaseAdd(LftpInfo* p, LftpStatus& status, LFTP_PHASE phase, unsigned long long ns)
 {
-    pthread_mutex_lock(&p->lock);
-    p->status.transfer_state_str = LftpStateToString(p->status.transfer_state);
-    p->status_queue.push(p->status);
-    pthread_mutex_unlock(&p->lock);
-
-    return 0;
+    LftpTimingsAdd(&p->timings, phase, ns);
+    status.phase_ms[phase] += ns / 1e6;
 }
 
-static bool LftpStatusDequeue(LftpStatus& status)
+static void LftpPhaseDone(LftpInfo* p, LftpStatus& status, LFTP_PHASE phase, unsigned long long start_ns)
 {
-    bool ret = true;
+    LftpPhaseAdd(p, status, phase, LftpNowNs() - start_ns);
+}
 
-    LftpLock();
+static void LftpStatusAggregate(LftpInfo* p, LftpStatus& status)
+{
+    unsigned long long bytes = p->files.finished_bytes;
+    unsigned long long cpu_ns = 0;
+    unsigned long long sent = 0;
+    for (size_t i = 0; i < p->workers.size(); i++) {
+        bytes += p->workers[i].bytes;
+        cpu_ns += p->workers[i].cpu_ns;
+        sent += p->workers[i].sent;
+    }
 
-    if (lftpInfo.status_queue.size()) {
-        status = lftpInfo.status_queue.front();
-        lftpInfo.status_queue.pop();
-    } else {
-        ret = false;
+    if (bytes > p->files.total_bytes) {
+        // mp4 exports are a bit larger than their ts sources
+        bytes = p->files.total_bytes;
     }
 
-    LftpUnlock();
+    status.files_total = p->param.files.size();
+    status.files_finished = p->files.finished;
+    status.all_transferred_bytes = bytes;
+    status.all_progress = p->files.total_bytes ? bytes * 100 / p->files.total_bytes : 0;
+    status.rate_limit = LftpRateShare(&p->rate);
+    // ns per byte is s per 10^9 bytes
+    status.all_cpu_per_gb = sent ? (double)cpu_ns / sent : 0;
 
-    return ret;
+    // against one session for the mkdir and one per file
+    int saved = p->files.sessions ? 1 + p->files.uploads - p->files.sessions : 0;
+    status.saved_round_trips = saved > 0 ? saved * LFTP_NATIVE_SESSION_ROUND_TRIPS : 0;
 }
 
-static int LftpStatusQueueClear(LftpInfo* p)
+static int LftpStatusPush(LftpInfo* p, LftpChannel* c, LftpStatus& status)
 {
-    LftpLock();
+    pthread_mutex_lock(&p->lock);
+    LftpStatusAggregate(p, status);
+    pthread_mutex_unlock(&p->lock);
 
-    while (!p->status_queue.empty()) {
-        p->status_queue.pop();
+    status.transfer_state_str = LftpStateToString(status.transfer_state);
+    status.sequence = ++p->sequence;
+    status.timestamp_ms = LftpNowMs();
+
+    if (LftpChannelPublish(c, &status, &p->sender.running) != 0) {
+        return -1;
     }
 
-    LftpUnlock();
+    eventfd_write(p->notify.fd, 1);
+    if (p->notify.callback) {
+        p->notify.callback(p, p->notify.ctx);
+    }
 
     return 0;
 }
 
-static int LftpStatusClear(LftpInfo* p)
+static int LftpStatusEnqueue(LftpWorker* w)
 {
-    p->status.file_name = "";
-    p->status.transferred_bytes = "0";
-    p->status.transferred_progress = "0";
-    p->status.transfer_rate = "0";
-    p->status.remaining_time = "0";
-    p->status.transferred_time = "0";
-    p->status.transfer_state_str = "0";
-    p->status.transfer_state = LFTP_STATE_IDLE;
-    p->status.all_finish = false;
+    pthread_mutex_lock(&w->info->lock);
+    w->bytes = w->pos;
+    pthread_mutex_unlock(&w->info->lock);
 
-    return 0;
+    return LftpStatusPush(w->info, w->channel, w->status);
 }
 
-static int LftpCreateRemoteDirectory(LftpInfo* p)
+static bool LftpStatusDequeue(LftpInfo* p, LftpStatus& status)
 {
-    char cmd[256] = { 0 };
-    int ret = 0;
-
-    snprintf(cmd, sizeof(cmd),
-        "unbuffer lftp -e 'open -u %s,%s ftp://%s:%s; mkdir -p %s; exit' 2>&1",
-        p->param.username.c_str(),
-        p->param.password.c_str(),
-        p->param.server.c_str(),
-        p->param.port.c_str(),
-        p->param.remote_path.c_str());
-
-    LFTP_LOG("cmd: %s\n", cmd);
+    LftpChannel* next = NULL;
+    unsigned long long next_sequence = 0;
+    LftpStatus candidate;
 
-    FILE* pipe = popen(cmd, "r");
-    if (NULL == pipe) {
-        LFTP_LOG("mkdir error");
-        return -1;
+    // merge the producers in the order their statuses were made
+    for (int i = 0; i < p->channel_count; i++) {
+        unsigned long long sequence;
+        if (LftpChannelPeek(&p->channels[i], &candidate, &sequence)
+            && (!next || sequence < next_sequence)) {
+            next = &p->channels[i];
+            next_sequence = sequence;
+            status = candidate;
+        }
     }
 
-    string output;
-    char c;
-
-    while ((c = fgetc(pipe)) != EOF) {
-        if (c == '\r' || c == '\n') {
-            LFTP_LOG("output: %s", output.c_str());
+    if (!next) {
+        return false;
+    }
 
-            LftpParseOutput(output, p);
+    LftpChannelConsume(next, &status);
 
-            if (LFTP_STATE_LOGIN_INCORRECT == p->status.transfer_state
-                || LFTP_STATE_NO_ROUTE_TO_HOST == p->status.transfer_state
-                || LFTP_STATE_PORT_INCORRECT == p->status.transfer_state) {
-                LftpStatusEnqueue(p);
-                ret = -1;
+    return true;
+}
 
-                system("killall -9 lftp");
+static int LftpStatusChannelsReset(LftpInfo* p, int count)
+{
+    delete[] p->channels;
+    p->channels = NULL;
+    p->channel_count = 0;
+    p->sequence = 0;
 
-                LFTP_LOG("killall -9 lftp");
-                break;
-            }
-            output.clear();
-        } else {
-            output += c;
+    if (count) {
+        p->channels = new LftpChannel[count];
+        p->channel_count = count;
+        for (int i = 0; i < count; i++) {
+            LftpChannelInit(&p->channels[i]);
         }
     }
 
-    pclose(pipe);
-
-    return ret;
+    return 0;
 }
 
-static int LftpPrintStatus(LftpStatus& status)
+static int LftpStatusClear(LftpStatus& status)
 {
-    LFTP_LOG("******************************************************");
-    LFTP_LOG("* File name            : %s", status.file_name.c_str());
-    LFTP_LOG("* Transferred bytes    : %s", status.transferred_bytes.c_str());
-    LFTP_LOG("* Transferred progress : %s", status.transferred_progress.c_str());
-    LFTP_LOG("* Transfer rate        : %s", status.transfer_rate.c_str());
-    LFTP_LOG("* Remaining time       : %s", status.remaining_time.c_str());
-    LFTP_LOG("* Transferred time     : %s", status.transferred_time.c_str());
-    LFTP_LOG("* Transfer state       : %d", status.transfer_state);
-    LFTP_LOG("* Transfer state str   : %s", status.transfer_state_str.c_str());
-    LFTP_LOG("* Transfer all finish  : %d", status.all_finish);
-    LFTP_LOG("******************************************************");
+    memset(&status, 0, sizeof(status));
+    status.remaining_time = -1;
+    status.transfer_state_str = LftpStateToString(LFTP_STATE_IDLE);
+    status.transfer_state = LFTP_STATE_IDLE;
+    status.file_index = -1;
 
     return 0;
 }
 
-static int LftpExecCmd(const string& cmd, LftpInfo* p)
+static void LftpStatusSetFileName(LftpStatus& status, const string& file_name)
 {
-    int ret = 0;
+    snprintf(status.file_name, sizeof(status.file_name), "%s", file_name.c_str());
+}
 
-    p->sender.pipe = popen(cmd.c_str(), "r");
-    if (NULL == p->sender.pipe) {
-        LFTP_LOG("popen [%s\n] failed\n", cmd.c_str());
-        return ret;
+static string LftpExpandPath(const string& path)
+{
+    // the lftp engine gets `~` expanded by the shell, do the same for open()
+    if (path.size() && path[0] == '~' && (path.size() == 1 || path[1] == '/')) {
+        const char* home = getenv("HOME");
+        if (home) {
+            return string(home) + path.substr(1);
+        }
     }
 
-    string output;
-    char c;
+    return path;
+}
 
-    while ((c = fgetc(p->sender.pipe)) != EOF) {
-        if (c == '\r' || c == '\n') {
-            LFTP_LOG("output: %s", output.c_str());
+static LFTP_STATE LftpNativeErrorState(LftpFtp* ftp)
+{
+    if (ftp->err == ECANCELED) {
+        return LFTP_STATE_ABORT;
+    } else if (ftp->code == 530) {
+        return LFTP_STATE_LOGIN_INCORRECT;
+    } else if (ftp->err == ECONNREFUSED) {
+        return LFTP_STATE_PORT_INCORRECT;
+    }
 
-            LftpParseOutput(output, p);
+    return LFTP_STATE_NO_ROUTE_TO_HOST;
+}
 
-            if (!p->sender.running) {
-                p->status.transfer_state = LFTP_STATE_ABORT;
-                ret = -1;
-                LftpStatusEnqueue(p);
+// a lost connection or a 4xx reply may be gone on the next try, a 5xx reply,
+// a refused connection, a local error or a stop will not
+static bool LftpNativeTransient(LftpFtp* ftp)
+{
+    if (ftp->err == ECANCELED || ftp->err == ECONNREFUSED || ftp->code == 530) {
+        return false;
+    }
+    if (ftp->code >= 400) {
+        return ftp->code < 500;
+    }
 
-                system("killall -9 lftp");
+    switch (ftp->err) {
+    case ETIMEDOUT:
+    case ECONNRESET:
+    case ECONNABORTED:
+    case EPIPE:
+    case ENETDOWN:
+    case ENETUNREACH:
+    case EHOSTDOWN:
+    case EHOSTUNREACH:
+        return true;
+    default:
+        break;
+    }
 
-                LFTP_LOG("killall -9 lftp");
-                break;
-            } else {
-                LftpStatusEnqueue(p);
+    // closed before a reply
+    return ftp->code == -1;
+}
 
-                if (LFTP_STATE_LOGIN_INCORRECT == p->status.transfer_state
-                    || LFTP_STATE_NO_ROUTE_TO_HOST == p->status.transfer_state
-                    || LFTP_STATE_PORT_INCORRECT == p->status.transfer_state) {
-                    ret = -1;
+// equal jitter: half of the exponential delay is kept, the other half is random,
+// so workers that failed together do not come back together
+static int LftpRetryDelay(LftpInfo* p, int attempt)
+{
+    long long delay = p->param.retry_base_ms > 0 ? p->param.retry_base_ms : 0;
+    for (int i = 0; i < attempt && delay < p->param.retry_max_ms; i++) {
+        delay *= 2;
+    }
+    if (delay > p->param.retry_max_ms) {
+        delay = p->param.retry_max_ms > 0 ? p->param.retry_max_ms : 0;
+    }
 
-                    system("killall -9 lftp");
+    unsigned int seed = (unsigned int)LftpNowNs() ^ (unsigned int)pthread_self();
+    long long half = delay / 2;
 
-                    LFTP_LOG("killall -9 lftp");
-                    break;
-                }
-            }
-            output.clear();
-        } else {
-            output += c;
+    return delay - half + (half ? rand_r(&seed) % (half + 1) : 0);
+}
+
+/**
+ * @brief wait delay_ms before the next try
+ *
+ * @param canceled checked every LFTP_RETRY_POLL_MS, NULL for none
+ * @return int 0 try again, -1 a stop or a cancel came first
+ */
+static int LftpRetryWait(LftpInfo* p, int delay_ms, const bool* canceled)
+{
+    struct pollfd pfd;
+    pfd.fd = p->sender.stop_fd;
+    pfd.events = POLLIN;
+
+    unsigned long long end_ms = LftpNowMs() + delay_ms;
+    unsigned long long now_ms;
+    while (p->sender.running && !(canceled && *canceled) && (now_ms = LftpNowMs()) < end_ms) {
+        unsigned long long timeout = end_ms - now_ms;
+        if (canceled && timeout > LFTP_RETRY_POLL_MS) {
+            timeout = LFTP_RETRY_POLL_MS;
+        }
+        int ret = poll(&pfd, 1, timeout);
+        if (ret > 0 || (ret < 0 && errno != EINTR)) {
+            break;
         }
     }
 
-    pclose(p->sender.pipe);
-
-    return ret;
+    return p->sender.running && !(canceled && *canceled) ? 0 : -1;
 }
 
-string LftpMakeMp4Filename(const string& filename)
+static int LftpNativeLogin(LftpInfo* p, LftpFtp* ftp, LftpStatus& status)
 {
-    size_t dot_pos = filename.rfind('.');
-    if (dot_pos != std::string::npos) {
-        return filename.substr(0, dot_pos) + ".mp4";
+    LftpFtpInit(ftp, p->sender.stop_fd);
+
+    unsigned long long start_ns = LftpNowNs();
+    int ret = LftpFtpConnect(ftp, p->param.server.c_str(), p->param.port.c_str());
+    LftpPhaseDone(p, status, LFTP_PHASE_CONNECT, start_ns);
+
+    if (ret == 0) {
+        start_ns = LftpNowNs();
+        ret = LftpFtpLogin(ftp, p->param.username.c_str(), p->param.password.c_str());
+        LftpPhaseDone(p, status, LFTP_PHASE_LOGIN, start_ns);
     }
 
-    return string("");
+    if (ret != 0) {
+        status.transfer_state = LftpNativeErrorState(ftp);
+        LftpFtpAbort(ftp);
+        return -1;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->files.sessions++;
+    pthread_mutex_unlock(&p->lock);
+
+    return 0;
 }
 
-static void* LftpSenderThread(void* arg)
+static int LftpNativeMkdir(LftpInfo* p)
 {
-    pthread_detach(pthread_self());
+    LftpFtp* ftp = &p->sender.ftp;
+    int created = 0;
 
-    LftpInfo* p = (LftpInfo*)arg;
+    p->sender.connected = false;
 
-    p->sender.running = true;
+    if (LftpNativeLogin(p, ftp, p->status) != 0) {
+        LftpStatusPush(p, &p->channels[LFTP_CHANNEL_SENDER], p->status);
+        return -1;
+    }
 
-    LFTP_LOG("transfer start");
-    LFTP_LOG("ip          : %s", p->param.server.c_str());
-    LFTP_LOG("port        : %s", p->param.port.c_str());
-    LFTP_LOG("remote dir  : %s", p->param.remote_path.c_str());
-    LFTP_LOG("username    : %s", p->param.username.c_str());
-    LFTP_LOG("password    : %s", p->param.password.c_str());
-    LFTP_LOG("local dir   : %s", p->param.path.c_str());
-    for (int i = 0; i < p->param.files.size(); i++) {
-        LFTP_LOG("file[%2d]    : %s", i, p->param.files.at(i).c_str());
+    unsigned long long start_ns = LftpNowNs();
+    if (LftpFtpMkdirP(ftp, p->param.remote_path.c_str(), &created) != 0) {
+        LftpPhaseDone(p, p->status, LFTP_PHASE_MKDIR, start_ns);
+        p->status.transfer_state = LftpNativeErrorState(ftp);
+        LftpStatusPush(p, &p->channels[LFTP_CHANNEL_SENDER], p->status);
+        LftpFtpAbort(ftp);
+        return -1;
     }
 
-    // init params
-    LftpStatusClear(p);
+    p->status.transfer_state = created ? LFTP_STATE_MKDIR_OK : LFTP_STATE_REMOTE_DIR_EXIST;
 
-    if (0 != LftpCreateRemoteDirectory(p)) {
-        LFTP_LOG("create dir failed, exit");
-        goto lftp_exit;
+    // keep the session for the first worker, already in remote_path
+    if (LftpFtpCwd(ftp, p->param.remote_path.c_str()) == 0) {
+        p->sender.connected = true;
+    } else {
+        LftpFtpAbort(ftp);
     }
+    LftpPhaseDone(p, p->status, LFTP_PHASE_MKDIR, start_ns);
 
-    if (p->param.files.size()) {
-        char base[1024] = { 0 };
-        string file_path;
-        string cmd;
-
-        snprintf(base, sizeof(base),
-            "lftp -e 'open -u %s,%s ftp://%s:%s; cd %s; ",
-            p->param.username.c_str(),
-            p->param.password.c_str(),
-            p->param.server.c_str(),
-            p->param.port.c_str(),
-            p->param.remote_path.c_str());
+    return 0;
+}
 
-        for (int i = 0; i < p->param.files.size(); i++) {
-            LftpStatusClear(p);
+static int LftpNativeSession(LftpWorker* w)
+{
+    LftpInfo* p = w->info;
 
-            p->status.file_name = p->param.files.at(i);
-            string ts_file_path;
-        
-            if (p->param.path.back() == '/') {
-                ts_file_path = p->param.path + p->status.file_name;
-            } else {
-                ts_file_path = p->param.path + "/" + p->status.file_name;
-            }
+    if (w->connected) {
+        return 0;
+    }
 
-            if (p->param.export_format == LFTP_EXP_FMT_MP4) {
-                string mp4_file_path = LftpMakeMp4Filename(ts_file_path);
-                if (mp4_file_path.size()) {
-                    cmd = string("ffmpeg -i ") + ts_file_path + " -c copy " + mp4_file_path + " -loglevel quiet";
+    if (LftpNativeLogin(p, &w->ftp, w->status) != 0) {
+        return -1;
+    }
 
-                    LFTP_LOG("system:%s", cmd.c_str());
-                    p->status.transfer_state = LFTP_STATE_TRANSCODING;
-                    LftpStatusEnqueue(p);
+    if (LftpFtpCwd(&w->ftp, p->param.remote_path.c_str()) != 0) {
+        w->status.transfer_state = LftpNativeErrorState(&w->ftp);
+        LftpFtpAbort(&w->ftp);
+        return -1;
+    }
 
-                    system(cmd.c_str());
+    w->connected = true;
 
-                    file_path = mp4_file_path;
-                    p->status.file_name = LftpMakeMp4Filename(p->status.file_name);
-                }
-            } else {
-                file_path = ts_file_path;
-            }
+    return 0;
+}
 
-            if (!file_path.size()) {
-                LFTP_LOG("file_path invalid");
-                continue;
-            }
+static void LftpNativeSessionClose(LftpWorker* w, bool quit)
+{
+    if (!w->connected) {
+        return;
+    }
 
-            cmd = string("unbuffer ") + base + " mput -c " + file_path + ";exit' 2>&1";
+    if (quit) {
+        LftpFtpClose(&w->ftp);
+    } else {
+        LftpFtpAbort(&w->ftp);
+    }
+    w->connected = false;
+}
 
-            LFTP_LOG("upload cmd %d: %s", i, cmd.c_str());
-            LFTP_LOG("upload start [%d]: %s", i, p->status.file_name.c_str());
+static bool LftpNativeSessionLost(LftpWorker* w, bool& reused)
+{
+    LftpFtp* ftp = &w->ftp;
 
-            if (LftpExecCmd(cmd, p) != 0) {
-                LFTP_LOG("upload abort %d: %s", i, p->status.file_name.c_str());
+    // the server may drop a session that idled between two files, reopen it once
+    if (!reused || (ftp->code != -1 && ftp->code != 421) || ftp->err == ECANCELED
+        || !w->info->sender.running) {
+        return false;
+    }
+    reused = false;
 
-                if (p->param.export_format == LFTP_EXP_FMT_MP4) {
-                    cmd = string("rm -rf ") + file_path;
-                    LFTP_LOG("system:%s", cmd.c_str());
-                    system(cmd.c_str());
-                }
-                
-                break;
-            }
+    LFTP_LOG("session %d lost (%d), reconnect", w->id, ftp->code);
+    LftpNativeSessionClose(w, false);
 
-            if (p->param.export_format == LFTP_EXP_FMT_MP4) {
-                cmd = string("rm -rf ") + file_path;
-                LFTP_LOG("system:%s", cmd.c_str());
-                system(cmd.c_str());
-            }
+    return LftpNativeSession(w) == 0;
+}
 
-            LFTP_LOG("upload finish [%d]: %s", i, p->status.file_name.c_str());
-        }
+static unsigned long long LftpThreadCpuNs(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_THREAD, &ru) != 0) {
+        return 0;
     }
 
-lftp_exit:
-    p->sender.running = false;
-    p->sender.tid = 0;
-    p->sender.pipe = NULL;
+    return (unsigned long long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL
+        + (unsigned long long)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+}
 
-    if (p->status.transfer_state == LFTP_STATE_TRANSFERRING) {
-        p->status.transfer_state = LFTP_STATE_TRANSFERRED;
-    }
-    p->status.all_finish = true;
-    LftpStatusEnqueue(p);
+// account cpu time since the last call, the kernel side of sendfile included
+static void LftpNativeCpu(LftpWorker* w, unsigned long long& cpu_ns, unsigned long long& sent,
+    unsigned long long bytes, unsigned long long offset, unsigned long long start_cpu_ns)
+{
+    unsigned long long now_ns = LftpThreadCpuNs();
 
-    pthread_mutex_destroy(&p->lock);
+    pthread_mutex_lock(&w->info->lock);
+    w->cpu_ns += now_ns - cpu_ns;
+    w->sent += bytes - sent;
+    pthread_mutex_unlock(&w->info->lock);
 
-    LFTP_LOG("transfer finish");
+    cpu_ns = now_ns;
+    sent = bytes;
+    w->status.cpu_per_gb = bytes > offset ? (double)(now_ns - start_cpu_ns) / (bytes - offset) : 0;
+}
 
-    return NULL;
+static void LftpNativeProgress(LftpWorker* w, unsigned long long bytes, unsigned long long offset,
+    unsigned long long size, unsigned long long start_ms)
+{
+    unsigned long long elapsed_ms = LftpNowMs() - start_ms;
+    double rate = elapsed_ms ? (double)(bytes - offset) * 1000 / elapsed_ms : 0;
+
+    w->pos = bytes;
+    w->status.transferred_bytes = bytes;
+    w->status.transferred_progress = size ? bytes * 100 / size : 100;
+    w->status.transfer_rate = rate;
+    w->status.remaining_time = rate > 0 ? (long long)((size - bytes) / rate) : -1;
+    w->status.transferred_time = elapsed_ms / 1000;
 }
 
-int LftpUploadFilesStart(LftpParam& param)
+static void LftpNativeHash(LftpWorker* w, const void* buf, size_t len)
 {
-    lftpInfo.param = param;
+    w->crc32c = LftpCrc32c(w->crc32c, buf, len);
+    w->crc32 = LftpCrc32(w->crc32, buf, len);
+    w->hashed += len;
+}
 
-    if (lftpInfo.sender.tid || lftpInfo.sender.running) {
-        LftpUploadFilesStop();
+// bytes that never pass user space, sent by sendfile or before a resume, read back
+// from the page cache
+static int LftpNativeHashFile(LftpWorker* w, int fd, char* buf, size_t buf_size,
+    unsigned long long from, unsigned long long to)
+{
+    while (from < to) {
+        ssize_t n = pread(fd, buf, to - from < buf_size ? to - from : buf_size, from);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            LFTP_LOG("read for checksum failed: %s", n ? strerror(errno) : "end of file");
+            return -1;
+        }
+        LftpNativeHash(w, buf, n);
+        from += n;
     }
 
-    if (pthread_mutex_init(&lftpInfo.lock, NULL) != 0) {
-        printf("pthread_mutex_init failed\n");
-    }
+    return 0;
+}
 
-    LftpStatusQueueClear(&lftpInfo);
+// O_DIRECT reads whole aligned blocks, read the ones around [pos, pos + len)
+// into buf (buf_size + LFTP_NATIVE_DIRECT_ALIGN) and point data at pos
+static ssize_t LftpNativeReadDirect(int fd, char* buf, unsigned long long pos, size_t len, char** data)
+{
+    unsigned long long start = pos & ~(unsigned long long)(LFTP_NATIVE_DIRECT_ALIGN - 1);
+    size_t head = pos - start;
+    size_t want = (head + len + LFTP_NATIVE_DIRECT_ALIGN - 1) & ~(size_t)(LFTP_NATIVE_DIRECT_ALIGN - 1);
 
-    if (0 == pthread_create(&(lftpInfo.sender.tid), NULL, LftpSenderThread, (void*)(&lftpInfo))) {
-        printf("create LftpSenderThread failed\n");
+    ssize_t n;
+    while ((n = pread(fd, buf, want, start)) < 0 && errno == EINTR) {
+    }
+    if (n < 0) {
+        return -1;
+    } else if ((size_t)n <= head) {
+        return 0;
     }
 
-    return 0;
+    *data = buf + head;
+    n -= head;
+
+    return (size_t)n < len ? n : len;
 }
 
-bool LftpUploadFilesStatus(LftpStatus& status)
+/*
+ * Keep the readahead one step ahead of the send position and drop the sent
+ * step behind it, so a big upload does not push the recorder out of the page
+ * cache. mark is where the current step started.
+ */
+static void LftpNativeReadahead(LftpInfo* p, int fd, unsigned long long* mark, unsigned long long bytes)
 {
-    return LftpStatusDequeue(status);
+    if (bytes - *mark < LFTP_NATIVE_READAHEAD) {
+        return;
+    }
+
+    if (p->param.drop_cache) {
+        posix_fadvise(fd, *mark, bytes - *mark, POSIX_FADV_DONTNEED);
+    }
+    posix_fadvise(fd, bytes, LFTP_NATIVE_READAHEAD, POSIX_FADV_WILLNEED);
+    *mark = bytes;
 }
 
-int LftpUploadFilesStop(void)
+static int LftpNativeRemuxOutput(void* ctx, const unsigned char* buf, size_t len)
 {
-    if (lftpInfo.sender.running) {
-        LFTP_LOG("transfer abort");
-        lftpInfo.sender.running = false;
+    LftpWorker* w = (LftpWorker*)ctx;
+    unsigned long long start_ns = LftpNowNs();
+
+    if (w->info->param.checksum) {
+        LftpNativeHash(w, buf, len);
     }
 
-    return 0;
+    int ret = LftpFtpWrite(&w->ftp, (const char*)buf, len);
+    w->remux_send_ns += LftpNowNs() - start_ns;
+
+    return ret;
 }
 
-int LftpUploadFilesDestroy(void)
+static void LftpManifestWrite(LftpInfo* p, LftpWorker* w, const string& remote_name)
 {
-    LftpStatusQueueClear(&lftpInfo);
-    LftpStatusClear(&lftpInfo);
-    lftpInfo.param.files.clear();
+    static const char* checks[] = { "none", "local", "verified", "mismatch" };
 
-    return 0;
+    if (!p->manifest) {
+        return;
+    }
+
+    // crc32c crc32 size check path, like the output of cksum
+    pthread_mutex_lock(&p->lock);
+    fprintf(p->manifest, "%08x %08x %llu %s %s/%s\n", w->crc32c, w->crc32, w->hashed,
+        checks[w->status.checksum], p->param.remote_path.c_str(), remote_name.c_str());
+    fflush(p->manifest);
+    pthread_mutex_unlock(&p->lock);
 }
 
-/* test lftp api */
-int main(void)
+// compare with the server after the STOR, -1 if it has other bytes
+static int LftpNativeChecksum(LftpWorker* w, const string& remote_name)
 {
-    LftpParam param;
+    unsigned int remote_crc;
 
-    param.files = { "swz.ts", "wucf-tv.ts" };
-    param.path = "~/Videos/ts-files";
-    param.server = "127.0.0.1";
-    param.port = "21";
-    param.username = "ftp";
-    param.password = "ftp-test";
-    param.remote_path = "lftp-test";
-    param.export_format = LFTP_EXP_FMT_TS;
-
-    LftpUploadFilesStart(param);
-
-    while (1) {
-        LftpStatus status;
-        if (LftpUploadFilesStatus(status)) {
-            LftpPrintStatus(status);
-            if (status.all_finish) {
-                break;
-            }
-        }
+    w->status.crc32c = w->crc32c;
+    w->status.crc32 = w->crc32;
 
-        usleep(500 * 1000);
+    if (LftpFtpCrc32(&w->ftp, remote_name.c_str(), &remote_crc) != 0) {
+        w->status.checksum = LFTP_CHECKSUM_LOCAL;
+    } else if (remote_crc == w->crc32) {
+        w->status.checksum = LFTP_CHECKSUM_VERIFIED;
+    } else {
+        LFTP_LOG("checksum of %s: sent %08x, server %08x", remote_name.c_str(), w->crc32, remote_crc);
+        w->status.checksum = LFTP_CHECKSUM_MISMATCH;
     }
 
-    LftpUploadFilesStop();
+    LftpManifestWrite(w->info, w, remote_name);
 
-    LftpUploadFilesDestroy();
+    return w->status.checksum == LFTP_CHECKSUM_MISMATCH ? -1 : 0;
+}
 
-    return 0;
-}
\ No newline at end of file
+static string LftpRemoteName(const LftpJob& job)
+{
+    string remote_name = job.remux ? job.file_name : job.file_path;
+    size_t slash = remote_name.find_last_of('/');
+    if (slash != string::npos) {
+        remote_name = remote_name.substr(slash + 1);
+    }
+
+    if (job.parts) {
+        char part[16];
+        snprintf(part, sizeof(part), ".part%03d", job.part);
+        remote_name += part;
+    }
+
+    return remote_name;
+}
+
+static void LftpRemoteListEntry(void* ctx, const char* name, long long size)
+{
+    ((LftpInfo*)ctx)->remote.sizes[name] = size;
+}
+
+// one listing instead of a SIZE per file, before the workers start
+static void LftpRemoteList(LftpInfo* p)
+{
+    LftpFtp ftp;
+    LftpFtp* list = &p->sender.ftp;
+
+    p->remote.valid = false;
+    p->remote.sizes.clear();
+
+    if (!p->sender.connected) {
+        // the lftp engine has no session of its own, open a short one
+        list = &ftp;
+        LftpFtpInit(list, p->sender.stop_fd);
+        if (LftpFtpConnect(list, p->param.server.c_str(), p->param.port.c_str()) != 0
+            || LftpFtpLogin(list, p->param.username.c_str(), p->param.password.c_str()) != 0
+            || LftpFtpCwd(list, p->param.remote_path.c_str()) != 0) {
+            LFTP_LOG("remote list failed: %s", list->reply);
+            LftpFtpAbort(list);
+            return;
+        }
+    }
+
+    p->remote.valid = LftpFtpList(list, LftpRemoteListEntry, p) == 0;
+    if (list == &ftp) {
+        LftpFtpClose(list);
+    }
+
+    LFTP_LOG("remote list: %s, %d files", p->remote.valid ? "ok" : "failed", (int)p->remote.sizes.size());
+}
+
+// remote size by the listing, 0 if the file is not there
+static bool LftpRemoteLookup(LftpInfo* p, const string& name, long long* size)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->remote.valid) {
+        map<string, long long>::iterator it = p->remote.sizes.find(name);
+        *size = it == p->remote.sizes.end() ? 0 : it->second;
+        found = *size >= 0;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return found;
+}
+
+static void LftpRemoteUpdate(LftpInfo* p, const string& name, long long size)
+{
+    pthread_mutex_lock(&p->lock);
+    if (p->remote.valid) {
+        p->remote.sizes[name] = size;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+static string LftpJournalKey(LftpInfo* p, const LftpJob& job)
+{
+    return LftpExpandPath(job.file_path) + " ftp://" + p->param.username + "@" + p->param.server
+        + ":" + p->param.port + "/" + p->param.remote_path + "/" + LftpRemoteName(job);
+}
+
+static long long LftpFileMtime(const struct stat& st)
+{
+    return (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// still written to, by the mtime
+static bool LftpFileLive(LftpInfo* p, const struct stat& st)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long now = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+    return p->param.follow && now - LftpFileMtime(st) < (long long)p->param.follow_idle_ms * 1000000;
+}
+
+// bytes of a live file that can be sent, whole ts packets only until the writer is done
+static unsigned long long LftpFileEnd(const struct stat& st, bool live)
+{
+    return live ? st.st_size - st.st_size % LFTP_TS_PACKET_SIZE : st.st_size;
+}
+
+/*
+ * follow mode: wait until more than bytes can be sent from the live file or the
+ * writer is done, by close or by follow_idle_ms without a write
+ *
+ * return 0 st refreshed, live cleared once the writer is done, -1 stopped
+ */
+static int LftpNativeFollow(LftpWorker* w, int fd, const string& path, int& notify, struct stat& st,
+    bool& live, unsigned long long bytes)
+{
+    LftpInfo* p = w->info;
+    bool closed = false;
+
+    if (notify < 0) {
+        notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (notify < 0 || inotify_add_watch(notify, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+            // without events the idle timeout still ends the file
+            LFTP_LOG("watch %s failed: %s", path.c_str(), strerror(errno));
+        }
+    }
+
+    while (true) {
+        if (fstat(fd, &st) != 0) {
+            return -1;
+        }
+
+        if (closed || !LftpFileLive(p, st)) {
+            live = false;
+            return 0;
+        } else if (LftpFileEnd(st, true) > bytes) {
+            return 0;
+        }
+
+        struct pollfd pfd[2];
+        pfd[0].fd = p->sender.stop_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = notify;
+        pfd[1].events = POLLIN;
+
+        // wake up in time for the idle timeout when no event comes
+        int ret = poll(pfd, 2, LFTP_NATIVE_FOLLOW_POLL_MS);
+        if (ret < 0 && errno != EINTR) {
+            return -1;
+        } else if (ret > 0 && (pfd[0].revents & POLLIN)) {
+            return -1;
+        } else if (ret > 0 && (pfd[1].revents & POLLIN)) {
+            char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t n;
+            while ((n = read(notify, buf, sizeof(buf))) > 0) {
+                for (char* e = buf; e < buf + n; e += sizeof(struct inotify_event) + ((struct inotify_event*)e)->len) {
+                    if (((struct inotify_event*)e)->mask & IN_CLOSE_WRITE) {
+                        closed = true;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// <name>.split lists the parts in order, `cat <name>.part[0-9]*` puts the file back together
+static int LftpSplitManifest(LftpWorker* w, const LftpJob& job, unsigned long long size,
+    unsigned long long part_size)
+{
+    LftpFtp* ftp = &w->ftp;
+    char line[LFTP_FILE_NAME_MAX + 64];
+
+    LftpJob whole = job;
+    whole.parts = 0;
+    string name = LftpRemoteName(whole);
+
+    // name size parts, then part offset size
+    snprintf(line, sizeof(line), "%s %llu %d\n", name.c_str(), size, job.parts);
+    string text = line;
+    for (int i = 0; i < job.parts; i++) {
+        LftpJob part = job;
+        part.part = i;
+        unsigned long long offset = i * part_size;
+        snprintf(line, sizeof(line), "%s %llu %llu\n", LftpRemoteName(part).c_str(), offset,
+            std::min(part_size, size - offset));
+        text += line;
+    }
+
+    name += ".split";
+    if (LftpNativeSession(w) != 0 || LftpFtpStorBegin(ftp, name.c_str(), 0) != 0
+        || LftpFtpWrite(ftp, text.data(), text.size()) != 0 || LftpFtpStorEnd(ftp) != 0) {
+        LFTP_LOG("stor %s failed: %s", name.c_str(), ftp->reply);
+        return -1;
+    }
+
+    LFTP_LOG("upload manifest [%d/%d]: %s", job.index, w->id, name.c_str());
+
+    return 0;
+}
+
+// the part is on the server, the last one sends the manifest; -1 it could not
+static int LftpSplitSent(LftpWorker* w, const LftpJob& job)
+{
+    LftpInfo* p = w->info;
+
+    pthread_mutex_lock(&p->lock);
+    LftpSplit& split = p->files.split[job.index];
+    split.sent.insert(job.part);
+    // a part retried for a failed manifest counts once
+    bool last = (int)split.sent.size() == job.parts;
+    unsigned long long size = split.size;
+    unsigned long long part_size = split.part_size;
+    pthread_mutex_unlock(&p->lock);
+
+    return last ? LftpSplitManifest(w, job, size, part_size) : 0;
+}
+
+// SIZE to the STOR reply, the time the remux spent in between is transcode
+static void LftpNativeTransferDone(LftpWorker* w, unsigned long long start_ns, unsigned long long feed_ns, bool remux)
+{
+    unsigned long long ns = LftpNowNs() - start_ns;
+    unsigned long long remux_ns = feed_ns > w->remux_send_ns ? feed_ns - w->remux_send_ns : 0;
+
+    if (remux) {
+        LftpPhaseAdd(w->info, w->status, LFTP_PHASE_TRANSCODE, remux_ns);
+    }
+    LftpPhaseAdd(w->info, w->status, LFTP_PHASE_TRANSFER, ns > remux_ns ? ns - remux_ns : 0);
+}
+
+static int LftpNativeUpload(LftpWorker* w, const LftpJob& job)
+{
+    LftpInfo* p = w->info;
+    LftpFtp* ftp = &w->ftp;
+    LftpRemux* remux = NULL;
+    bool reused = w->connected;
+    int ret = -1;
+
+    string local_path = LftpExpandPath(job.file_path);
+    string remote_name = LftpRemoteName(job);
+
+    int fd = open(local_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        LFTP_LOG("open %s failed: %s", local_path.c_str(), strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        // like lftp, a missing local file does not stop the batch
+        return 0;
+    }
+
+    unsigned long long size = st.st_size;
+    unsigned long long offset = 0;
+
+    // a part of a split file is sent from base, all positions below are within the part
+    unsigned long long base = job.part_offset;
+    // its planned size, a file shrunk since the split fails the part below
+    if (job.parts) {
+        size = job.part_size;
+    }
+
+    // follow mode, the file is still being recorded
+    bool live = !job.parts && LftpFileLive(p, st);
+    int notify = -1;
+
+    bool journal = p->journal.fd >= 0;
+    string key = journal ? LftpJournalKey(p, job) : string();
+    LftpJournalEntry entry;
+    bool journaled = journal && !job.remux && LftpJournalLookup(&p->journal, key, size, LftpFileMtime(st), &entry);
+
+    pthread_mutex_lock(&p->lock);
+    p->files.uploads++;
+    pthread_mutex_unlock(&p->lock);
+
+    if (LftpNativeSession(w) != 0) {
+        w->transient = p->sender.running && LftpNativeTransient(ftp);
+        LftpStatusEnqueue(w);
+        close(fd);
+        return -1;
+    }
+
+    // time in LftpRemuxFeed/Finish, their sends included
+    unsigned long long transfer_ns = LftpNowNs();
+    unsigned long long feed_ns = 0;
+    bool timed = false;
+    w->remux_send_ns = 0;
+
+    if (!job.remux) {
+        // same as `mput -c`: continue a shorter remote file, restart a longer one
+        // the remuxed output has no known size, it is always sent in full
+        long long remote_size;
+        if (!LftpRemoteLookup(p, remote_name, &remote_size)) {
+            remote_size = LftpFtpSize(ftp, remote_name.c_str());
+            if (remote_size < 0 && LftpNativeSessionLost(w, reused)) {
+                remote_size = LftpFtpSize(ftp, remote_name.c_str());
+            }
+        }
+        if (remote_size > 0 && (unsigned long long)remote_size <= size) {
+            offset = remote_size;
+        }
+        // bytes past the last checkpoint may never have reached the disk of the server
+        if (journaled && entry.offset < offset) {
+            offset = entry.offset;
+        }
+    }
+
+    w->status.transfer_state = LFTP_STATE_TRANSFERRING;
+
+    if (offset == size && size && !live) {
+        LftpNativeTransferDone(w, transfer_ns, 0, false);
+        timed = true;
+        LftpNativeProgress(w, size, size, size, LftpNowMs());
+        w->status.remaining_time = 0;
+        w->status.transfer_state = LFTP_STATE_TRANSFERRED;
+        LftpStatusEnqueue(w);
+        if (journal) {
+            LftpJournalComplete(&p->journal, key, size, LftpFileMtime(st));
+        }
+        ret = 0;
+        if (job.parts && LftpSplitSent(w, job) != 0) {
+            w->status.transfer_state = LftpNativeErrorState(ftp);
+            ret = -1;
+        }
+        goto native_exit;
+    }
+
+    if (lseek(fd, base + offset, SEEK_SET) < 0
+        || (LftpFtpStorBegin(ftp, remote_name.c_str(), offset) != 0
+            && (!LftpNativeSessionLost(w, reused) || LftpFtpStorBegin(ftp, remote_name.c_str(), offset) != 0))) {
+        LFTP_LOG("stor %s failed: %s", remote_name.c_str(), ftp->reply);
+        w->status.transfer_state = LftpNativeErrorState(ftp);
+        goto native_exit;
+    }
+
+    if (job.remux) {
+        remux = LftpRemuxCreate(LftpNativeRemuxOutput, w);
+    }
+
+    {
+        static const size_t buf_size = 64 * 1024;
+        char* buf = NULL;
+        bool zero_copy = p->param.zero_copy && !remux && !p->param.direct_io;
+        bool checksum = p->param.checksum;
+        unsigned long long bytes = offset;
+        unsigned long long mark = base + offset;
+        unsigned long long start_ms = LftpNowMs();
+        unsigned long long report_ms = 0;
+        unsigned long long start_cpu_ns = LftpThreadCpuNs();
+        unsigned long long cpu_ns = start_cpu_ns;
+        unsigned long long sent = bytes;
+        bool failed = false;
+
+        // a file still being written stays in the page cache, the recorder just wrote it
+        int direct = -1;
+        char* direct_buf = NULL;
+        if (p->param.direct_io && !live) {
+            direct = open(local_path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+            if (direct < 0 || posix_memalign((void**)&direct_buf, LFTP_NATIVE_DIRECT_ALIGN,
+                    buf_size + LFTP_NATIVE_DIRECT_ALIGN) != 0) {
+                LFTP_LOG("direct io not supported for %s, buffered", local_path.c_str());
+                if (direct >= 0) {
+                    close(direct);
+                    direct = -1;
+                }
+                direct_buf = NULL;
+            }
+        }
+
+        if (direct < 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            posix_fadvise(fd, base + offset, LFTP_NATIVE_READAHEAD, POSIX_FADV_WILLNEED);
+        }
+
+        w->crc32c = w->crc32 = 0;
+        w->hashed = 0;
+        if (checksum) {
+            buf = new char[buf_size];
+            // the crc covers the whole file, the part sent before a resume included
+            failed = LftpNativeHashFile(w, fd, buf, buf_size, base, base + offset) != 0;
+        }
+
+        LftpNativeProgress(w, bytes, offset, size, start_ms);
+        LftpStatusEnqueue(w);
+
+        while (!failed) {
+            if (w->canceled) {
+                failed = true;
+                break;
+            }
+
+            unsigned long long end = job.parts ? size : LftpFileEnd(st, live);
+            if (bytes >= end) {
+                if (!live) {
+                    break;
+                }
+                if (LftpNativeFollow(w, fd, local_path, notify, st, live, bytes) != 0) {
+                    failed = true;
+                    break;
+                }
+                if ((unsigned long long)st.st_size > size) {
+                    pthread_mutex_lock(&p->lock);
+                    p->files.total_bytes += st.st_size - size;
+                    p->files.sizes[job.index] = st.st_size;
+                    pthread_mutex_unlock(&p->lock);
+                    size = st.st_size;
+                    w->status.file_size = size;
+                }
+                continue;
+            }
+
+            ssize_t n;
+            if (zero_copy) {
+                // the file goes from the page cache to the socket, big chunks mean few calls
+                // under a rate limit the chunks of the read path keep the flow smooth
+                size_t chunk = LftpRateShare(&p->rate) > 0 ? buf_size : LFTP_NATIVE_SENDFILE_CHUNK;
+                if (end - bytes < chunk) {
+                    chunk = end - bytes;
+                }
+                if (LftpRateAcquire(&p->rate, chunk, p->sender.stop_fd) != 0) {
+                    failed = true;
+                    break;
+                }
+
+                n = LftpFtpSendFile(ftp, fd, base + bytes, chunk);
+                if (n < 0 && ftp->err == EOPNOTSUPP) {
+                    LFTP_LOG("zero copy not supported for %s, read/write", local_path.c_str());
+                    zero_copy = false;
+                    if (lseek(fd, base + bytes, SEEK_SET) < 0) {
+                        failed = true;
+                        break;
+                    }
+                    continue;
+                } else if (n < 0) {
+                    failed = true;
+                    break;
+                } else if (n == 0) {
+                    // file shrank under us, send what we have
+                    break;
+                }
+
+                if (checksum && LftpNativeHashFile(w, fd, buf, buf_size, base + bytes, base + bytes + n) != 0) {
+                    failed = true;
+                    break;
+                }
+            } else {
+                if (!buf) {
+                    buf = new char[buf_size];
+                }
+
+                char* data = buf;
+                size_t len = end - bytes < buf_size ? end - bytes : buf_size;
+                if (direct >= 0) {
+                    n = LftpNativeReadDirect(direct, direct_buf, base + bytes, len, &data);
+                    if (n < 0 && errno == EINVAL) {
+                        LFTP_LOG("direct io failed for %s, buffered", local_path.c_str());
+                        close(direct);
+                        direct = -1;
+                        if (lseek(fd, base + bytes, SEEK_SET) < 0) {
+                            failed = true;
+                            break;
+                        }
+                        continue;
+                    } else if (n < 0) {
+                        // EIO and the like, only EINVAL means O_DIRECT itself is refused
+                        LFTP_LOG("direct read %s failed: %s", local_path.c_str(), strerror(errno));
+                        ftp->err = errno;
+                        failed = true;
+                        break;
+                    }
+                } else {
+                    n = read(fd, buf, len);
+                }
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                } else if (n < 0) {
+                    // a short remote copy must not be reported as sent
+                    LFTP_LOG("read %s failed: %s", local_path.c_str(), strerror(errno));
+                    ftp->err = errno;
+                    failed = true;
+                    break;
+                } else if (n == 0) {
+                    break;
+                }
+
+                if (LftpRateAcquire(&p->rate, n, p->sender.stop_fd) != 0) {
+                    failed = true;
+                    break;
+                }
+
+                if (checksum && !remux) {
+                    LftpNativeHash(w, data, n);
+                }
+
+                int sent_ret;
+                if (remux) {
+                    unsigned long long feed_start_ns = LftpNowNs();
+                    sent_ret = LftpRemuxFeed(remux, (const unsigned char*)data, n);
+                    feed_ns += LftpNowNs() - feed_start_ns;
+                } else {
+                    sent_ret = LftpFtpWrite(ftp, data, n);
+                }
+                if (sent_ret != 0) {
+                    failed = true;
+                    break;
+                }
+            }
+            bytes += n;
+
+            if (direct < 0) {
+                LftpNativeReadahead(p, fd, &mark, base + bytes);
+            }
+
+            // lftp refreshes its progress line about twice a second
+            unsigned long long now_ms = LftpNowMs();
+            if (now_ms - report_ms >= 500) {
+                report_ms = now_ms;
+                LftpNativeProgress(w, bytes, offset, size, start_ms);
+                LftpNativeCpu(w, cpu_ns, sent, bytes, offset, start_cpu_ns);
+                LftpStatusEnqueue(w);
+                if (journal && !remux) {
+                    LftpJournalCheckpoint(&p->journal, key, size, LftpFileMtime(st), bytes);
+                }
+            }
+        }
+
+        delete[] buf;
+        free(direct_buf);
+        if (direct >= 0) {
+            close(direct);
+        }
+
+        // the .split manifest lists the planned part sizes, cat would join a short part into a corrupt file
+        if (job.parts && !failed && bytes < job.part_size) {
+            LFTP_LOG("part %d/%d of %s shrank to %llu of %llu bytes", job.part, job.parts, local_path.c_str(), bytes,
+                job.part_size);
+            ftp->err = ENODATA;
+            failed = true;
+        }
+
+        if (remux && !failed) {
+            unsigned long long feed_start_ns = LftpNowNs();
+            if (LftpRemuxFinish(remux) != 0) {
+                LFTP_LOG("remux %s failed", local_path.c_str());
+                failed = true;
+            }
+            feed_ns += LftpNowNs() - feed_start_ns;
+        }
+
+        LftpNativeCpu(w, cpu_ns, sent, bytes, offset, start_cpu_ns);
+
+        if (!failed && LftpFtpStorEnd(ftp) != 0) {
+            failed = true;
+        }
+
+        // the rest of the file and what the checksum read before a resume, sendfile
+        // pages still queued on the data socket could not be dropped before
+        if (p->param.drop_cache) {
+            posix_fadvise(fd, base, job.parts ? size : 0, POSIX_FADV_DONTNEED);
+        }
+        LftpNativeTransferDone(w, transfer_ns, feed_ns, remux != NULL);
+        timed = true;
+
+        bool mismatch = false;
+        if (!failed && checksum) {
+            unsigned long long checksum_ns = LftpNowNs();
+            mismatch = LftpNativeChecksum(w, remote_name) != 0;
+            LftpPhaseDone(p, w->status, LFTP_PHASE_CHECKSUM, checksum_ns);
+        }
+
+        if (failed) {
+            w->status.transfer_state = LftpNativeErrorState(ftp);
+        } else if (mismatch) {
+            w->status.transfer_state = LFTP_STATE_CHECKSUM_MISMATCH;
+        } else if (job.parts && LftpSplitSent(w, job) != 0) {
+            // the part is on the server, its retry only sends the manifest
+            w->status.transfer_state = LftpNativeErrorState(ftp);
+        } else {
+            LftpNativeProgress(w, bytes, offset, bytes, start_ms);
+            w->status.transferred_progress = 100;
+            w->status.remaining_time = 0;
+            w->status.transfer_state = LFTP_STATE_TRANSFERRED;
+            LftpStatusEnqueue(w);
+            if (journal) {
+                LftpJournalComplete(&p->journal, key, size, LftpFileMtime(st));
+            }
+            // the size of the remuxed output is not known here
+            LftpRemoteUpdate(p, remote_name, remux ? -1 : (long long)bytes);
+            ret = 0;
+        }
+    }
+
+native_exit:
+    if (!timed) {
+        LftpNativeTransferDone(w, transfer_ns, feed_ns, remux != NULL);
+    }
+
+    if (!p->sender.running) {
+        w->status.transfer_state = LFTP_STATE_ABORT;
+        ret = -1;
+    } else if (ret != 0 && w->canceled) {
+        w->status.transfer_state = LFTP_STATE_CANCELED;
+    }
+
+    // the session stays open for the next file unless it failed
+    if (ret != 0) {
+        w->transient = p->sender.running && w->status.transfer_state != LFTP_STATE_CHECKSUM_MISMATCH
+            && LftpNativeTransient(ftp);
+        LftpRemoteUpdate(p, remote_name, -1);
+        LftpStatusEnqueue(w);
+        LftpNativeSessionClose(w, false);
+    }
+
+    if (remux) {
+        LftpRemuxDestroy(remux);
+    }
+    if (notify >= 0) {
+        close(notify);
+    }
+    close(fd);
+
+    return ret;
+}
+
+static int LftpCreateRemoteDirectory(LftpInfo* p)
+{
+    char cmd[256] = { 0 };
+    int ret = 0;
+
+    if (p->param.engine != LFTP_ENGINE_LFTP) {
+        return LftpNativeMkdir(p);
+    }
+
+    unsigned long long start_ns = LftpNowNs();
+
+    snprintf(cmd, sizeof(cmd),
+        "unbuffer lftp -e 'open -u %s,%s ftp://%s:%s; mkdir -p %s; exit' 2>&1",
+        p->param.username.c_str(),
+        p->param.password.c_str(),
+        p->param.server.c_str(),
+        p->param.port.c_str(),
+        p->param.remote_path.c_str());
+
+    LFTP_LOG("cmd: %s\n", cmd);
+
+    LftpProc proc;
+    if (LftpProcSpawn(&proc, cmd) != 0) {
+        LFTP_LOG("mkdir error");
+        return -1;
+    }
+
+    const char* line;
+    size_t len;
+    unsigned long long pos = 0;
+    LFTP_PROC_READ rd;
+
+    while ((rd = LftpProcReadLine(&proc, p->sender.stop_fd, &line, &len)) == LFTP_PROC_READ_LINE) {
+        LFTP_LOG("output: %.*s", (int)len, line);
+
+        LftpParseOutput(line, len, &p->status, &pos);
+
+        if (LFTP_STATE_LOGIN_INCORRECT == p->status.transfer_state
+            || LFTP_STATE_NO_ROUTE_TO_HOST == p->status.transfer_state
+            || LFTP_STATE_PORT_INCORRECT == p->status.transfer_state) {
+            LftpStatusPush(p, &p->channels[LFTP_CHANNEL_SENDER], p->status);
+            ret = -1;
+            break;
+        }
+    }
+
+    if (rd == LFTP_PROC_READ_STOP) {
+        p->status.transfer_state = LFTP_STATE_ABORT;
+        LftpStatusPush(p, &p->channels[LFTP_CHANNEL_SENDER], p->status);
+        ret = -1;
+    }
+
+    if (ret != 0) {
+        LftpProcKill(&proc);
+    }
+    LftpProcWait(&proc);
+    LftpPhaseDone(p, p->status, LFTP_PHASE_MKDIR, start_ns);
+
+    return ret;
+}
+
+static int LftpExecCmd(const string& cmd, LftpWorker* w)
+{
+    LftpInfo* p = w->info;
+    int ret = 0;
+
+    LftpProc proc;
+    if (LftpProcSpawn(&proc, cmd.c_str()) != 0) {
+        LFTP_LOG("spawn [%s] failed", cmd.c_str());
+        w->status.transfer_state = LFTP_STATE_ABORT;
+        LftpStatusEnqueue(w);
+        return -1;
+    }
+
+    const char* line;
+    size_t len;
+    LFTP_PROC_READ rd;
+
+    while ((rd = LftpProcReadLine(&proc, p->sender.stop_fd, &line, &len)) == LFTP_PROC_READ_LINE) {
+        LFTP_LOG("output: %.*s", (int)len, line);
+
+        LftpParseOutput(line, len, &w->status, &w->pos);
+        LftpStatusEnqueue(w);
+
+        if (LFTP_STATE_LOGIN_INCORRECT == w->status.transfer_state
+            || LFTP_STATE_NO_ROUTE_TO_HOST == w->status.transfer_state
+            || LFTP_STATE_PORT_INCORRECT == w->status.transfer_state) {
+            ret = -1;
+            break;
+        }
+
+        if (w->canceled) {
+            w->status.transfer_state = LFTP_STATE_CANCELED;
+            LftpStatusEnqueue(w);
+            ret = -1;
+            break;
+        }
+    }
+
+    if (rd == LFTP_PROC_READ_STOP || !p->sender.running) {
+        w->status.transfer_state = LFTP_STATE_ABORT;
+        LftpStatusEnqueue(w);
+        ret = -1;
+    }
+
+    if (ret != 0) {
+        LftpProcKill(&proc);
+    }
+
+    // unbuffer or lftp missing, or an error the parser does not know, is no upload
+    int status = LftpProcWait(&proc);
+    if (ret == 0 && status != 0) {
+        LFTP_LOG("[%s] exited with %d", cmd.c_str(), status);
+        w->status.transfer_state = LFTP_STATE_ABORT;
+        LftpStatusEnqueue(w);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+string LftpMakeMp4Filename(const string& filename)
+{
+    size_t dot_pos = filename.rfind('.');
+    if (dot_pos != std::string::npos) {
+        return filename.substr(0, dot_pos) + ".mp4";
+    }
+
+    return string("");
+}
+
+static string LftpLocalFilePath(LftpInfo* p, const string& file_name)
+{
+    if (p->param.path.back() == '/') {
+        return p->param.path + file_name;
+    }
+
+    return p->param.path + "/" + file_name;
+}
+
+// watch mode grows the file list while the workers run, read it under lock
+static string LftpFileName(LftpInfo* p, int i)
+{
+    pthread_mutex_lock(&p->lock);
+    string file_name = p->param.files.at(i);
+    pthread_mutex_unlock(&p->lock);
+
+    return file_name;
+}
+
+static unsigned long long LftpFileSize(LftpInfo* p, int i)
+{
+    pthread_mutex_lock(&p->lock);
+    unsigned long long size = p->files.sizes.at(i);
+    pthread_mutex_unlock(&p->lock);
+
+    return size;
+}
+
+static bool LftpJournalFinished(LftpWorker* w, const LftpJob& job, struct stat* st)
+{
+    LftpInfo* p = w->info;
+    LftpJournalEntry entry;
+
+    // transcoded copies are new files every time
+    if (p->journal.fd < 0 || job.temp || stat(LftpExpandPath(job.file_path).c_str(), st) != 0) {
+        return false;
+    }
+
+    return LftpJournalLookup(&p->journal, LftpJournalKey(p, job), st->st_size, LftpFileMtime(*st), &entry)
+        && entry.done;
+}
+
+static bool LftpRemoteFinished(LftpWorker* w, const LftpJob& job, struct stat* st)
+{
+    LftpInfo* p = w->info;
+    long long remote_size;
+
+    // the remuxed output has no size to compare
+    if (job.remux || stat(LftpExpandPath(job.file_path).c_str(), st) != 0 || !st->st_size
+        || LftpFileLive(p, *st)) {
+        return false;
+    }
+
+    return LftpRemoteLookup(p, LftpRemoteName(job), &remote_size) && remote_size == st->st_size;
+}
+
+static void LftpUploadSkip(LftpWorker* w, unsigned long long size)
+{
+    w->pos = size;
+    w->status.transferred_bytes = size;
+    w->status.transferred_progress = 100;
+    w->status.remaining_time = 0;
+    w->status.transfer_state = LFTP_STATE_TRANSFERRED;
+    LftpStatusEnqueue(w);
+}
+
+// with lock held, a file or a part of a split file the workers are done with
+static void LftpFilesDone(LftpInfo* p, const LftpJob& job)
+{
+    if (!job.parts) {
+        p->files.finished++;
+        p->files.finished_bytes += p->files.sizes[job.index];
+        return;
+    }
+
+    p->files.finished_bytes += job.part_size;
+    if (--p->files.split[job.index].left == 0) {
+        p->files.finished++;
+    }
+}
+
+static void LftpSplitStatus(LftpWorker* w, const LftpJob& job)
+{
+    w->status.file_part = job.part;
+    w->status.file_parts = job.parts;
+    w->status.file_size = job.part_size;
+}
+
+/*
+ * A big ts file goes up as parts on the next free workers, each part on its own
+ * connection to its own remote file <name>.partNNN. job becomes the first part.
+ */
+static void LftpSplitJob(LftpWorker* w, LftpJob& job)
+{
+    LftpInfo* p = w->info;
+    unsigned long long size = LftpFileSize(p, job.index);
+    int parts = std::min(p->param.split_parts, p->param.workers > 0 ? p->param.workers : 1);
+    struct stat st;
+
+    // the lftp engine sends whole files, a followed file is still growing
+    if (std::min(parts, LFTP_SPLIT_PARTS_MAX) < 2 || p->param.engine != LFTP_ENGINE_NATIVE || job.remux
+        || size < p->param.split_min_bytes || stat(LftpExpandPath(job.file_path).c_str(), &st) != 0
+        || LftpFileLive(p, st)) {
+        return;
+    }
+    parts = std::min(parts, LFTP_SPLIT_PARTS_MAX);
+
+    // whole ts packets in every part, the last one takes the rest
+    unsigned long long packets = (size + LFTP_TS_PACKET_SIZE - 1) / LFTP_TS_PACKET_SIZE;
+    unsigned long long part_size = (packets + parts - 1) / parts * LFTP_TS_PACKET_SIZE;
+    parts = (size + part_size - 1) / part_size;
+    if (parts < 2) {
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (w->canceled || !p->sender.running) {
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+    // right behind the file in the queue, the next free workers take them
+    LftpQueueKey key = p->files.keys[job.index];
+    for (int i = 1; i < parts; i++) {
+        LftpJob part = job;
+        part.part = i;
+        part.parts = parts;
+        part.part_offset = i * part_size;
+        part.part_size = std::min(part_size, size - part.part_offset);
+        key.part = i;
+        p->files.ready[key] = part;
+    }
+    LftpSplit& split = p->files.split[job.index];
+    split.left = parts;
+    split.sent.clear();
+    split.size = size;
+    split.part_size = part_size;
+    pthread_cond_broadcast(&p->files.cond);
+    pthread_mutex_unlock(&p->lock);
+
+    job.part = 0;
+    job.parts = parts;
+    job.part_offset = 0;
+    job.part_size = part_size;
+    LftpSplitStatus(w, job);
+
+    LFTP_LOG("upload split [%d/%d]: %s in %d parts of %llu bytes", job.index, w->id, w->status.file_name, parts,
+        part_size);
+}
+
+static int LftpSpawnUpload(LftpWorker* w, const LftpJob& job)
+{
+    LftpInfo* p = w->info;
+    char base[1024] = { 0 };
+    char limit[64] = { 0 };
+    struct stat st;
+
+    // lftp limits per connection, split the share between the workers
+    unsigned long long share = LftpRateShare(&p->rate);
+    if (share) {
+        int workers = p->workers.size() ? p->workers.size() : 1;
+        snprintf(limit, sizeof(limit), "set net:limit-rate %llu; ", share / workers ? share / workers : 1);
+    }
+
+    snprintf(base, sizeof(base),
+        "lftp -e '%sopen -u %s,%s ftp://%s:%s; cd %s; ",
+        limit,
+        p->param.username.c_str(),
+        p->param.password.c_str(),
+        p->param.server.c_str(),
+        p->param.port.c_str(),
+        p->param.remote_path.c_str());
+
+    string cmd = string("unbuffer ") + base + " mput -c " + job.file_path + ";exit' 2>&1";
+    LFTP_LOG("upload cmd %d: %s", job.index, cmd.c_str());
+
+    unsigned long long start_ns = LftpNowNs();
+    int ret = LftpExecCmd(cmd, w);
+    LftpPhaseDone(p, w->status, LFTP_PHASE_TRANSFER, start_ns);
+
+    // sent only if lftp exited 0, anything else may have left nothing on the server
+    bool sent = ret == 0 && stat(LftpExpandPath(job.file_path).c_str(), &st) == 0;
+    if (sent) {
+        LftpRemoteUpdate(p, LftpRemoteName(job), (long long)st.st_size);
+        // lftp resumes with `mput -c` on its own, only finished files are journaled
+        if (p->journal.fd >= 0 && !job.temp) {
+            LftpJournalComplete(&p->journal, LftpJournalKey(p, job), st.st_size, LftpFileMtime(st));
+        }
+    } else {
+        // a later file or try asks the server again instead of skipping on a listed size
+        LftpRemoteUpdate(p, LftpRemoteName(job), -1);
+    }
+
+    // lftp reports a lost connection as no route, the next `mput -c` continues
+    w->transient = ret != 0 && p->sender.running && w->status.transfer_state == LFTP_STATE_NO_ROUTE_TO_HOST;
+
+    return ret;
+}
+
+// new status for the file, 1 if it needs no upload: finished by an earlier run or on the server
+static int LftpUploadBegin(LftpWorker* w, LftpJob& job)
+{
+    LftpInfo* p = w->info;
+
+    LftpStatusClear(w->status);
+
+    w->pos = 0;
+    w->status.file_index = job.index;
+    w->status.file_size = LftpFileSize(p, job.index);
+    LftpStatusSetFileName(w->status, job.file_name);
+    // the transcoder already put it in the histogram
+    w->status.phase_ms[LFTP_PHASE_TRANSCODE] = job.transcode_ns / 1e6;
+
+    // a part is checked by the upload, the one that finishes the file also sends the manifest
+    if (job.parts) {
+        LftpSplitStatus(w, job);
+        LFTP_LOG("upload start [%d/%d]: %s part %d/%d", job.index, w->id, w->status.file_name, job.part + 1,
+            job.parts);
+        return 0;
+    }
+
+    LFTP_LOG("upload start [%d/%d]: %s", job.index, w->id, w->status.file_name);
+
+    // finished by an earlier run, no need to ask the server
+    struct stat st;
+    if (LftpJournalFinished(w, job, &st)) {
+        LFTP_LOG("upload skip [%d/%d]: %s finished in journal", job.index, w->id, w->status.file_name);
+        LftpUploadSkip(w, st.st_size);
+        return 1;
+    }
+
+    if (LftpRemoteFinished(w, job, &st)) {
+        LFTP_LOG("upload skip [%d/%d]: %s already on the server", job.index, w->id, w->status.file_name);
+        LftpUploadSkip(w, st.st_size);
+        if (job.temp) {
+            unlink(LftpExpandPath(job.file_path).c_str());
+        }
+        return 1;
+    }
+
+    LftpSplitJob(w, job);
+
+    return 0;
+}
+
+// after a transient failure, report the wait before the next try
+static void LftpUploadRetry(LftpWorker* w, const LftpJob& job, int attempt)
+{
+    w->status.retries = attempt + 1;
+    w->status.retry_delay_ms = LftpRetryDelay(w->info, attempt);
+    w->status.transfer_state = LFTP_STATE_RETRYING;
+    LFTP_LOG("upload retry [%d/%d]: %s, try %d in %d ms", job.index, w->id, w->status.file_name,
+        attempt + 2, w->status.retry_delay_ms);
+    LftpStatusEnqueue(w);
+}
+
+// a stop or a cancel ended the wait
+static void LftpUploadRetryStopped(LftpWorker* w)
+{
+    w->status.retry_delay_ms = 0;
+    w->status.transfer_state = w->info->sender.running ? LFTP_STATE_CANCELED : LFTP_STATE_ABORT;
+    LftpStatusEnqueue(w);
+}
+
+// temp copies go, a cancel does not fail the batch
+static int LftpUploadEnd(LftpWorker* w, const LftpJob& job, int ret)
+{
+    LftpInfo* p = w->info;
+
+    if (job.temp) {
+        LFTP_LOG("remove %s", job.file_path.c_str());
+        unlink(LftpExpandPath(job.file_path).c_str());
+    }
+
+    // the batch goes on without it
+    if (ret != 0 && w->canceled && p->sender.running) {
+        LFTP_LOG("upload cancel [%d/%d]: %s", job.index, w->id, w->status.file_name);
+        return 0;
+    }
+
+    if (ret != 0) {
+        LFTP_LOG("upload abort [%d/%d]: %s", job.index, w->id, w->status.file_name);
+        return -1;
+    }
+
+    LFTP_LOG("upload finish [%d/%d]: %s", job.index, w->id, w->status.file_name);
+
+    return 0;
+}
+
+static int LftpUploadFile(LftpWorker* w, LftpJob& job)
+{
+    LftpInfo* p = w->info;
+
+    if (LftpUploadBegin(w, job)) {
+        return 0;
+    }
+
+    int ret = 0;
+    for (int attempt = 0;; attempt++) {
+        w->transient = false;
+        if (p->param.engine == LFTP_ENGINE_NATIVE) {
+            ret = LftpNativeUpload(w, job);
+        } else {
+            ret = LftpSpawnUpload(w, job);
+        }
+
+        if (ret == 0 || !w->transient || w->canceled || attempt >= p->param.retries) {
+            break;
+        }
+
+        // both engines continue from what the server has on the next try
+        LftpUploadRetry(w, job, attempt);
+
+        if (LftpRetryWait(p, w->status.retry_delay_ms, &w->canceled) != 0) {
+            LftpUploadRetryStopped(w);
+            break;
+        }
+        w->status.retry_delay_ms = 0;
+    }
+
+    return LftpUploadEnd(w, job, ret);
+}
+
+static int LftpTranscodeFile(LftpWorker* t, int i, LftpJob& job)
+{
+    LftpInfo* p = t->info;
+
+    string file_name = LftpFileName(p, i);
+    string ts_file_path = LftpLocalFilePath(p, file_name);
+    string mp4_file_path = LftpMakeMp4Filename(ts_file_path);
+    if (!mp4_file_path.size()) {
+        LFTP_LOG("file_path invalid");
+        return -1;
+    }
+
+    LftpStatusClear(t->status);
+    t->status.file_index = i;
+    t->status.file_size = LftpFileSize(p, i);
+    LftpStatusSetFileName(t->status, LftpMakeMp4Filename(file_name));
+    t->status.transfer_state = LFTP_STATE_TRANSCODING;
+    LftpStatusEnqueue(t);
+
+    string cmd = string("ffmpeg -y -i ") + ts_file_path + " -c copy " + mp4_file_path + " -loglevel quiet 2>&1";
+    LFTP_LOG("transcode: %s", cmd.c_str());
+
+    unsigned long long start_ns = LftpNowNs();
+
+    LftpProc proc;
+    if (LftpProcSpawn(&proc, cmd.c_str()) != 0) {
+        return -1;
+    }
+
+    const char* line;
+    size_t len;
+    LFTP_PROC_READ rd;
+    while ((rd = LftpProcReadLine(&proc, p->sender.stop_fd, &line, &len)) == LFTP_PROC_READ_LINE) {
+        LFTP_LOG("ffmpeg: %.*s", (int)len, line);
+        if (t->canceled) {
+            break;
+        }
+    }
+
+    if (rd == LFTP_PROC_READ_STOP || rd == LFTP_PROC_READ_LINE) {
+        LftpProcKill(&proc);
+    }
+
+    int ret = LftpProcWait(&proc);
+    unsigned long long transcode_ns = LftpNowNs() - start_ns;
+    LftpPhaseAdd(p, t->status, LFTP_PHASE_TRANSCODE, transcode_ns);
+
+    if (ret != 0) {
+        LFTP_LOG("transcode %s failed", ts_file_path.c_str());
+        unlink(LftpExpandPath(mp4_file_path).c_str());
+        return -1;
+    }
+
+    job.index = i;
+    job.file_name = LftpMakeMp4Filename(file_name);
+    job.file_path = mp4_file_path;
+    job.temp = true;
+    job.remux = false;
+    job.transcode_ns = transcode_ns;
+    job.part = job.parts = 0;
+    job.part_offset = job.part_size = 0;
+
+    return 0;
+}
+
+static int LftpTranscoders(const LftpParam& param)
+{
+    return param.transcode_workers > 0 ? param.transcode_workers : 1;
+}
+
+// set on the transcoder thread, the ffmpeg it forks inherits them
+static void LftpTranscodePriority(LftpInfo* p)
+{
+    pid_t tid = syscall(SYS_gettid);
+
+    if (p->param.transcode_cpus.size()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (size_t i = 0; i < p->param.transcode_cpus.size(); i++) {
+            int cpu = p->param.transcode_cpus[i];
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        if (sched_setaffinity(tid, sizeof(cpus), &cpus) != 0) {
+            LFTP_LOG("transcode affinity failed: %s", strerror(errno));
+        }
+    }
+
+    if (p->param.transcode_nice) {
+        errno = 0;
+        int nice = getpriority(PRIO_PROCESS, tid);
+        if (errno || setpriority(PRIO_PROCESS, tid, nice + p->param.transcode_nice) != 0) {
+            LFTP_LOG("transcode nice failed: %s", strerror(errno));
+        }
+    }
+
+    if (p->param.transcode_io_class) {
+        int level = p->param.transcode_io_class == LFTP_IOPRIO_CLASS_IDLE ? 0 : p->param.transcode_io_level;
+        int ioprio = (p->param.transcode_io_class << LFTP_IOPRIO_CLASS_SHIFT) | level;
+        if (syscall(SYS_ioprio_set, LFTP_IOPRIO_WHO_PROCESS, tid, ioprio) != 0) {
+            LFTP_LOG("transcode ionice failed: %s", strerror(errno));
+        }
+    }
+}
+
+static void* LftpTranscodeThread(void* arg)
+{
+    LftpWorker* t = (LftpWorker*)arg;
+    LftpInfo* p = t->info;
+
+    LftpTranscodePriority(p);
+
+    while (p->sender.running) {
+        pthread_mutex_lock(&p->lock);
+        // remux ahead of the uploaders, but only a bounded number of files
+        while (p->sender.running && !p->files.failed
+            && ((int)p->files.ready.size() >= p->param.transcode_lookahead
+                || (p->files.pending.empty() && p->files.watching))) {
+            pthread_cond_wait(&p->files.cond, &p->lock);
+        }
+        if (!p->sender.running || p->files.failed || p->files.pending.empty()) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        int i = p->files.pending.begin()->index;
+        p->files.pending.erase(p->files.pending.begin());
+        t->file_index = i;
+        t->canceled = false;
+        pthread_mutex_unlock(&p->lock);
+
+        LftpJob job;
+        int ret = LftpTranscodeFile(t, i, job);
+
+        pthread_mutex_lock(&p->lock);
+        bool canceled = t->canceled;
+        bool failed = ret != 0 && !canceled;
+        if (canceled) {
+            p->files.finished++;
+            p->files.finished_bytes += p->files.sizes[i];
+        } else if (failed) {
+            // a stop kills ffmpeg too, that is the abort of the batch and no failure
+            t->status.file_index = i;
+            t->status.transfer_state = p->sender.running ? LFTP_STATE_TRANSCODE_FAILED : LFTP_STATE_ABORT;
+            if (p->sender.running && !p->files.failed) {
+                p->files.failed = true;
+                p->status = t->status;
+                pthread_cond_broadcast(&p->files.cond);
+            }
+        } else {
+            p->files.ready[p->files.keys[i]] = job;
+            pthread_cond_broadcast(&p->files.cond);
+        }
+        t->file_index = -1;
+        pthread_mutex_unlock(&p->lock);
+
+        if (canceled) {
+            LFTP_LOG("transcode cancel [%d]", i);
+            if (ret == 0) {
+                unlink(LftpExpandPath(job.file_path).c_str());
+            }
+            t->status.transfer_state = LFTP_STATE_CANCELED;
+            LftpStatusEnqueue(t);
+        } else if (failed) {
+            LftpStatusEnqueue(t);
+        }
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->files.producing--;
+    pthread_cond_broadcast(&p->files.cond);
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief next file of the ready queue for the worker
+ *
+ * @param wait block until a file is ready or none can come any more
+ * @return int 1 taken, 0 none ready yet (only without wait), -1 no more files,
+ * the worker no longer counts in files.takers
+ */
+static int LftpWorkerTake(LftpWorker* w, LftpJob& job, bool wait)
+{
+    LftpInfo* p = w->info;
+
+    pthread_mutex_lock(&p->lock);
+    while (wait && p->sender.running && !p->files.failed
+        && p->files.ready.empty() && (p->files.producing || p->files.watching)) {
+        pthread_cond_wait(&p->files.cond, &p->lock);
+    }
+    if (!p->sender.running || p->files.failed
+        || (p->files.ready.empty() && !p->files.producing && !p->files.watching)) {
+        // same lock as the check, LftpSessionEnqueue can not queue a file nobody takes
+        p->files.takers--;
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    } else if (p->files.ready.empty()) {
+        pthread_mutex_unlock(&p->lock);
+        return 0;
+    }
+    job = p->files.ready.begin()->second;
+    p->files.ready.erase(p->files.ready.begin());
+    w->file_index = job.index;
+    w->canceled = false;
+    pthread_cond_broadcast(&p->files.cond);
+    pthread_mutex_unlock(&p->lock);
+
+    return 1;
+}
+
+// account a file the worker is done with, ret of LftpUploadFile
+static void LftpWorkerDone(LftpWorker* w, const LftpJob& job, int ret, unsigned long long start_ns)
+{
+    LftpInfo* p = w->info;
+
+    LftpPhaseDone(p, w->status, LFTP_PHASE_FILE, start_ns);
+
+    if (p->param.stats_file.size()) {
+        LftpTimingsWrite(&p->timings, LftpExpandPath(p->param.stats_file), p->param.stats_format, false);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (ret != 0) {
+        // let the files in flight finish, but hand out no new ones
+        if (!p->files.failed) {
+            p->files.failed = true;
+            p->status = w->status;
+            pthread_cond_broadcast(&p->files.cond);
+        }
+    } else {
+        LftpFilesDone(p, job);
+        p->status = w->status;
+    }
+    w->pos = w->bytes = 0;
+    w->file_index = -1;
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void* LftpWorkerThread(void* arg)
+{
+    LftpWorker* w = (LftpWorker*)arg;
+    LftpInfo* p = w->info;
+
+    LftpJob job;
+    int taken;
+    while ((taken = LftpWorkerTake(w, job, true)) > 0) {
+        unsigned long long start_ns = LftpNowNs();
+        int ret = LftpUploadFile(w, job);
+        LftpWorkerDone(w, job, ret, start_ns);
+
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    // a failed file ends the batch, the last worker out closes it for LftpSessionEnqueue
+    if (taken > 0) {
+        pthread_mutex_lock(&p->lock);
+        p->files.takers--;
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    LftpNativeSessionClose(w, p->sender.running);
+
+    return NULL;
+}
+
+/*
+ * uring engine: one thread drives the uploads of all workers. Every worker is
+ * a state machine that waits for one thing at a time, a connect, a command and
+ * its reply or a read→send chain of the file, and the ops of all workers go to
+ * the kernel together with one io_uring_enter per round.
+ */
+typedef enum _LFTP_URING_STEP {
+    LFTP_URING_STEP_IDLE = 0,   // no file, waiting for one
+    LFTP_URING_STEP_CONNECT,    // control connection
+    LFTP_URING_STEP_GREETING,
+    LFTP_URING_STEP_USER,
+    LFTP_URING_STEP_PASS,
+    LFTP_URING_STEP_TYPE,
+    LFTP_URING_STEP_CWD,
+    LFTP_URING_STEP_SIZE,
+    LFTP_URING_STEP_EPSV,
+    LFTP_URING_STEP_PASV,
+    LFTP_URING_STEP_DATA,       // data connection
+    LFTP_URING_STEP_REST,
+    LFTP_URING_STEP_STOR,
+    LFTP_URING_STEP_SEND,       // read→send chains up to the end of the file
+    LFTP_URING_STEP_STOR_END,   // transfer complete reply after the data connection closed
+    LFTP_URING_STEP_RETRY,      // backoff before the next try
+    LFTP_URING_STEP_QUIT,
+    LFTP_URING_STEP_DONE,       // no more files
+} LFTP_URING_STEP;
+
+typedef enum _LFTP_URING_OP {
+    LFTP_URING_OP_CONNECT = 0,
+    LFTP_URING_OP_CMD,          // command on the control connection
+    LFTP_URING_OP_REPLY,        // recv of its reply
+    LFTP_URING_OP_READ,         // file into the registered buffer
+    LFTP_URING_OP_SEND,         // buffer to the data connection
+    LFTP_URING_OP_TIMEOUT,      // link timeout of the op before it
+    LFTP_URING_OP_TICK,
+    LFTP_URING_OP_STOP,         // poll of stop_fd
+    LFTP_URING_OP_CANCEL,
+    LFTP_URING_OP_RATE,         // timeout of a rate limit wait before the next chunk
+} LFTP_URING_OP;
+
+typedef struct _LftpUringSlot {
+    LftpWorker* w;              // status, channel, and ftp for sockets, reply, code and err
+    LFTP_URING_STEP step;
+    char multi[4];              // "211 " ends the multi line reply being read, "" none
+    char cmd[LFTP_FTP_REPLY_MAX];
+    struct sockaddr_storage addr; // of the connect in flight
+    int sock;                   // socket of the connect in flight, -1 none
+
+    char* buf;                  // registered buffer, buf_index is the worker id
+    size_t chunk;               // bytes of the chain in flight
+    size_t chunk_sent;
+    int chunk_read;             // result of its read
+    bool rate_wait;             // the chunk waits for the share of the session
+    struct __kernel_timespec rate_ts; // of that wait
+
+    LftpJob job;
+    int attempt;
+    bool reused;                // the try started on a kept session
+    bool timed;                 // the transfer phase was added
+    int fd;                     // local file, -1 none
+    struct stat st;
+    string remote_name;
+    string key;                 // journal key, empty while off
+    LftpJournalEntry entry;
+    bool journaled;
+    unsigned long long size;
+    unsigned long long offset;
+    unsigned long long bytes;
+    unsigned long long mark;    // start of the readahead step
+    unsigned long long file_ns;
+    unsigned long long phase_ns; // start of the connect or the login
+    unsigned long long transfer_ns;
+    unsigned long long start_ms;
+    unsigned long long report_ms;
+    unsigned long long retry_ms; // CLOCK_MONOTONIC of the next try
+} LftpUringSlot;
+
+typedef struct _LftpUringLoop {
+    LftpInfo* p;
+    LftpUring ring;
+    vector<LftpUringSlot> slots;
+    char* bufs;
+    bool fixed;                 // bufs are registered, READ_FIXED
+    unsigned int inflight;      // sqes without their cqe yet
+    size_t done;                // slots in LFTP_URING_STEP_DONE
+    size_t takers;              // slots still counted in files.takers
+    bool canceling;             // the stop poll and the tick are being canceled
+    struct sockaddr_storage peer; // of the mkdir session
+    socklen_t peer_len;
+    unsigned long long sent;    // bytes sent by the loop
+    unsigned long long sent_mark; // sent at the last cpu accounting
+    unsigned long long cpu_ns;
+    unsigned long long start_cpu_ns;
+} LftpUringLoop;
+
+static const struct __kernel_timespec lftpUringTimeout = { LFTP_FTP_TIMEOUT_MS / 1000, 0 };
+static const struct __kernel_timespec lftpUringTick = { 0, LFTP_URING_TICK_MS * 1000000LL };
+
+static void LftpUringStep(LftpUringLoop* u, LftpUringSlot* s);
+static void LftpUringFail(LftpUringLoop* u, LftpUringSlot* s);
+static void LftpUringNext(LftpUringLoop* u, LftpUringSlot* s);
+
+static unsigned long long LftpUringData(LftpUringSlot* s, LFTP_URING_OP op)
+{
+    return ((unsigned long long)(s ? s->w->id : 0) << LFTP_URING_OP_BITS) | op;
+}
+
+// room for a chain of n sqes, a chain is never cut
+static int LftpUringRoom(LftpUringLoop* u, unsigned int n)
+{
+    if (LftpUringSpace(&u->ring) < n) {
+        LftpUringSubmit(&u->ring, 0);
+    }
+    if (LftpUringSpace(&u->ring) < n) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct io_uring_sqe* LftpUringQueue(LftpUringLoop* u, LftpUringSlot* s, LFTP_URING_OP op, int opcode,
+    int fd, const void* addr, unsigned int len, unsigned long long off)
+{
+    u->inflight++;
+
+    return LftpUringSqe(&u->ring, opcode, fd, addr, len, off, LftpUringData(s, op));
+}
+
+// the op queued before fails with -ECANCELED after LFTP_FTP_TIMEOUT_MS
+static void LftpUringLinkTimeout(LftpUringLoop* u, LftpUringSlot* s, struct io_uring_sqe* sqe)
+{
+    sqe->flags |= IOSQE_IO_LINK;
+    LftpUringQueue(u, s, LFTP_URING_OP_TIMEOUT, IORING_OP_LINK_TIMEOUT, -1, &lftpUringTimeout, 1, 0);
+}
+
+// a failed op, into err and code like LftpFtp reports it
+static void LftpUringOpError(LftpUringLoop* u, LftpUringSlot* s, int res, int code)
+{
+    LftpFtp* ftp = &s->w->ftp;
+
+    ftp->code = code;
+    if (!u->p->sender.running) {
+        ftp->err = ECANCELED;
+    } else if (res == -ECANCELED) {
+        // the link timeout fired, or the command before the recv failed
+        ftp->err = ftp->err ? ftp->err : ETIMEDOUT;
+    } else {
+        ftp->err = res < 0 ? -res : ECONNRESET;
+    }
+}
+
+static void LftpUringClose(LftpUringSlot* s)
+{
+    if (s->sock >= 0) {
+        close(s->sock);
+        s->sock = -1;
+    }
+    LftpFtpAbort(&s->w->ftp);
+    s->w->connected = false;
+    s->multi[0] = 0;
+}
+
+static int LftpUringConnect(LftpUringLoop* u, LftpUringSlot* s, LFTP_URING_STEP step, int port)
+{
+    LftpFtp* ftp = &s->w->ftp;
+
+    s->step = step;
+    ftp->err = 0;
+
+    memcpy(&s->addr, &u->peer, u->peer_len);
+    if (port && s->addr.ss_family == AF_INET) {
+        ((struct sockaddr_in*)&s->addr)->sin_port = htons(port);
+    } else if (port) {
+        ((struct sockaddr_in6*)&s->addr)->sin6_port = htons(port);
+    }
+
+    // blocking socket, io_uring waits for it without a thread
+    if (LftpUringRoom(u, 2) != 0 || (s->sock = socket(s->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        ftp->err = errno;
+        return -1;
+    }
+
+    struct io_uring_sqe* sqe = LftpUringQueue(u, s, LFTP_URING_OP_CONNECT, IORING_OP_CONNECT, s->sock, &s->addr,
+        0, u->peer_len);
+    LftpUringLinkTimeout(u, s, sqe);
+
+    return 0;
+}
+
+static int LftpUringRecv(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpFtp* ftp = &s->w->ftp;
+
+    if (LftpUringRoom(u, 2) != 0) {
+        ftp->err = errno;
+        return -1;
+    }
+
+    struct io_uring_sqe* sqe = LftpUringQueue(u, s, LFTP_URING_OP_REPLY, IORING_OP_RECV, ftp->ctrl,
+        ftp->rbuf + ftp->rlen, sizeof(ftp->rbuf) - ftp->rlen, 0);
+    LftpUringLinkTimeout(u, s, sqe);
+
+    return 0;
+}
+
+// the command and the recv of its reply go out linked, one round for both
+static int LftpUringCmd(LftpUringLoop* u, LftpUringSlot* s, LFTP_URING_STEP step, const char* format, ...)
+{
+    LftpFtp* ftp = &s->w->ftp;
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(s->cmd, sizeof(s->cmd) - 2, format, args);
+    va_end(args);
+
+    s->step = step;
+    ftp->err = 0;
+
+    if (len < 0 || len >= (int)sizeof(s->cmd) - 2) {
+        ftp->code = -1;
+        return -1;
+    }
+
+    LFTP_LOG("-> %s", strncmp(s->cmd, "PASS ", 5) ? s->cmd : "PASS ****");
+
+    s->cmd[len++] = '\r';
+    s->cmd[len++] = '\n';
+
+    if (LftpUringRoom(u, 3) != 0) {
+        ftp->err = errno;
+        ftp->code = -1;
+        return -1;
+    }
+
+    struct io_uring_sqe* sqe = LftpUringQueue(u, s, LFTP_URING_OP_CMD, IORING_OP_SEND, ftp->ctrl, s->cmd, len, 0);
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->flags |= IOSQE_IO_LINK;
+
+    sqe = LftpUringQueue(u, s, LFTP_URING_OP_REPLY, IORING_OP_RECV, ftp->ctrl, ftp->rbuf + ftp->rlen,
+        sizeof(ftp->rbuf) - ftp->rlen, 0);
+    LftpUringLinkTimeout(u, s, sqe);
+
+    return 0;
+}
+
+// a whole reply out of rbuf into reply and code, false while more bytes are needed
+static bool LftpUringReply(LftpUringSlot* s)
+{
+    LftpFtp* ftp = &s->w->ftp;
+    char* eol;
+
+    while ((eol = (char*)memchr(ftp->rbuf, '\n', ftp->rlen))) {
+        size_t n = eol - ftp->rbuf + 1;
+        size_t len = n;
+        while (len && (ftp->rbuf[len - 1] == '\n' || ftp->rbuf[len - 1] == '\r')) {
+            len--;
+        }
+        string line(ftp->rbuf, len);
+        memmove(ftp->rbuf, ftp->rbuf + n, ftp->rlen - n);
+        ftp->rlen -= n;
+
+        if (s->multi[0] && line.compare(0, 4, s->multi, 4) != 0) {
+            continue;
+        } else if (!s->multi[0]) {
+            snprintf(ftp->reply, sizeof(ftp->reply), "%s", line.c_str());
+            // multi line reply: "211-..." up to a line starting with "211 "
+            if (line.size() >= 4 && line[3] == '-') {
+                memcpy(s->multi, line.c_str(), 3);
+                s->multi[3] = ' ';
+                continue;
+            }
+        }
+
+        s->multi[0] = 0;
+        ftp->code = atoi(ftp->reply);
+        LFTP_LOG("<- %s", ftp->reply);
+
+        return true;
+    }
+
+    if (ftp->rlen == sizeof(ftp->rbuf)) {
+        // overlong line, nothing we wait for
+        ftp->rlen = 0;
+    }
+
+    return false;
+}
+
+static void LftpUringReplyWait(LftpUringLoop* u, LftpUringSlot* s, LFTP_URING_STEP step)
+{
+    s->step = step;
+
+    if (LftpUringReply(s)) {
+        LftpUringStep(u, s);
+    } else if (LftpUringRecv(u, s) != 0) {
+        LftpUringFail(u, s);
+    }
+}
+
+static void LftpUringLogin(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpFtpInit(&s->w->ftp, u->p->sender.stop_fd);
+
+    s->phase_ns = LftpNowNs();
+    if (LftpUringConnect(u, s, LFTP_URING_STEP_CONNECT, 0) != 0) {
+        LftpUringFail(u, s);
+    }
+}
+
+// the cpu of the loop is not told apart by file, it goes to the worker reporting
+static void LftpUringCpu(LftpUringLoop* u, LftpWorker* w)
+{
+    unsigned long long now_ns = LftpThreadCpuNs();
+
+    pthread_mutex_lock(&u->p->lock);
+    w->cpu_ns += now_ns - u->cpu_ns;
+    w->sent += u->sent - u->sent_mark;
+    pthread_mutex_unlock(&u->p->lock);
+
+    u->cpu_ns = now_ns;
+    u->sent_mark = u->sent;
+    w->status.cpu_per_gb = u->sent ? (double)(now_ns - u->start_cpu_ns) / u->sent : 0;
+}
+
+// open the file for a try, -1 if it is gone
+static int LftpUringOpen(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpInfo* p = u->p;
+    string local_path = LftpExpandPath(s->job.file_path);
+
+    s->fd = open(local_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (s->fd < 0 || fstat(s->fd, &s->st) != 0) {
+        LFTP_LOG("open %s failed: %s", local_path.c_str(), strerror(errno));
+        if (s->fd >= 0) {
+            close(s->fd);
+            s->fd = -1;
+        }
+        return -1;
+    }
+
+    s->remote_name = LftpRemoteName(s->job);
+    s->size = s->st.st_size;
+    s->offset = s->bytes = s->mark = 0;
+    s->reused = s->w->connected;
+    s->timed = false;
+    s->transfer_ns = LftpNowNs();
+    s->w->transient = false;
+    s->w->remux_send_ns = 0;
+
+    s->key = p->journal.fd >= 0 ? LftpJournalKey(p, s->job) : string();
+    s->journaled = s->key.size()
+        && LftpJournalLookup(&p->journal, s->key, s->size, LftpFileMtime(s->st), &s->entry);
+
+    pthread_mutex_lock(&p->lock);
+    p->files.uploads++;
+    pthread_mutex_unlock(&p->lock);
+
+    return 0;
+}
+
+static void LftpUringFileEnd(LftpUringLoop* u, LftpUringSlot* s, int ret)
+{
+    ret = LftpUploadEnd(s->w, s->job, ret);
+    LftpWorkerDone(s->w, s->job, ret, s->file_ns);
+
+    // a failed batch hands out no more files, the slot quits
+    LftpUringNext(u, s);
+}
+
+// end of a try, a transient failure waits in LFTP_URING_STEP_RETRY for the next one
+static void LftpUringAttemptEnd(LftpUringLoop* u, LftpUringSlot* s, int ret)
+{
+    LftpInfo* p = u->p;
+    LftpWorker* w = s->w;
+
+    if (s->fd >= 0) {
+        if (p->param.drop_cache && s->bytes > s->offset) {
+            posix_fadvise(s->fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        close(s->fd);
+        s->fd = -1;
+    }
+
+    if (ret != 0 && w->transient && !w->canceled && s->attempt < p->param.retries) {
+        LftpUploadRetry(w, s->job, s->attempt);
+        s->attempt++;
+        s->retry_ms = LftpNowMs() + w->status.retry_delay_ms;
+        s->step = LFTP_URING_STEP_RETRY;
+        return;
+    }
+
+    LftpUringFileEnd(u, s, ret);
+}
+
+static void LftpUringAttempt(LftpUringLoop* u, LftpUringSlot* s)
+{
+    if (s->w->connected) {
+        s->step = LFTP_URING_STEP_CWD;
+        s->w->ftp.code = 250;
+        LftpUringStep(u, s);
+    } else {
+        LftpUringLogin(u, s);
+    }
+}
+
+static void LftpUringQuit(LftpUringLoop* u, LftpUringSlot* s)
+{
+    if (s->w->connected && u->p->sender.running && s->w->ftp.data < 0
+        && LftpUringCmd(u, s, LFTP_URING_STEP_QUIT, "QUIT") == 0) {
+        return;
+    }
+
+    LftpUringClose(s);
+    s->step = LFTP_URING_STEP_DONE;
+    u->done++;
+}
+
+// take files until one needs an upload, skipped and missing ones are done at once
+static void LftpUringNext(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpWorker* w = s->w;
+
+    while (true) {
+        int taken = LftpWorkerTake(w, s->job, false);
+        if (taken == 0) {
+            s->step = LFTP_URING_STEP_IDLE;
+            return;
+        } else if (taken < 0) {
+            // LftpWorkerTake took the slot out of files.takers
+            u->takers--;
+            LftpUringQuit(u, s);
+            return;
+        }
+
+        s->file_ns = LftpNowNs();
+        s->attempt = 0;
+        if (LftpUploadBegin(w, s->job)) {
+            LftpWorkerDone(w, s->job, 0, s->file_ns);
+        } else if (LftpUringOpen(u, s) != 0) {
+            // like lftp, a missing local file does not stop the batch
+            LftpWorkerDone(w, s->job, LftpUploadEnd(w, s->job, 0), s->file_ns);
+        } else {
+            break;
+        }
+    }
+
+    LftpUringAttempt(u, s);
+}
+
+// read→send chain of the chunk
+static void LftpUringChunkQueue(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpFtp* ftp = &s->w->ftp;
+
+    if (LftpUringRoom(u, 3) != 0) {
+        ftp->err = errno;
+        LftpUringFail(u, s);
+        return;
+    }
+
+    s->chunk_sent = 0;
+    s->chunk_read = s->chunk;
+
+    // a short read fails the link, the send then completes with -ECANCELED
+    struct io_uring_sqe* sqe = LftpUringQueue(u, s, LFTP_URING_OP_READ,
+        u->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, s->fd, s->buf, s->chunk, s->bytes);
+    sqe->buf_index = s->w->id;
+    sqe->flags |= IOSQE_IO_LINK;
+
+    sqe = LftpUringQueue(u, s, LFTP_URING_OP_SEND, IORING_OP_SEND, ftp->data, s->buf, s->chunk, 0);
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    LftpUringLinkTimeout(u, s, sqe);
+}
+
+static void LftpUringChunk(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpInfo* p = u->p;
+    LftpFtp* ftp = &s->w->ftp;
+
+    if (!p->sender.running) {
+        ftp->err = ECANCELED;
+        LftpUringFail(u, s);
+        return;
+    }
+
+    if (s->w->canceled) {
+        LftpUringFail(u, s);
+        return;
+    }
+
+    if (s->bytes >= s->size) {
+        close(ftp->data);
+        ftp->data = -1;
+        LftpUringReplyWait(u, s, LFTP_URING_STEP_STOR_END);
+        return;
+    }
+
+    // under a rate limit small chunks keep it smooth
+    size_t chunk = LftpRateShare(&p->rate) > 0 ? LFTP_URING_RATE_CHUNK : LFTP_URING_CHUNK;
+    if (s->size - s->bytes < chunk) {
+        chunk = s->size - s->bytes;
+    }
+    s->chunk = chunk;
+
+    // the slot waits for the share of the session in its own timeout, the others go on
+    int wait_ms = LftpRateReserve(&p->rate, chunk);
+    if (!wait_ms) {
+        LftpUringChunkQueue(u, s);
+        return;
+    }
+
+    if (LftpUringRoom(u, 1) != 0) {
+        ftp->err = errno;
+        LftpUringFail(u, s);
+        return;
+    }
+
+    s->rate_wait = true;
+    s->rate_ts.tv_sec = wait_ms / 1000;
+    s->rate_ts.tv_nsec = (wait_ms % 1000) * 1000000LL;
+    LftpUringQueue(u, s, LFTP_URING_OP_RATE, IORING_OP_TIMEOUT, -1, &s->rate_ts, 1, 0);
+}
+
+// rest of the chunk after a short send or a short read
+static void LftpUringSendRest(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpFtp* ftp = &s->w->ftp;
+
+    if (LftpUringRoom(u, 2) != 0) {
+        ftp->err = errno;
+        LftpUringFail(u, s);
+        return;
+    }
+
+    struct io_uring_sqe* sqe = LftpUringQueue(u, s, LFTP_URING_OP_SEND, IORING_OP_SEND, ftp->data,
+        s->buf + s->chunk_sent, s->chunk - s->chunk_sent, 0);
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    LftpUringLinkTimeout(u, s, sqe);
+}
+
+static void LftpUringSent(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpInfo* p = u->p;
+    LftpWorker* w = s->w;
+
+    LftpNativeReadahead(p, s->fd, &s->mark, s->bytes);
+
+    // lftp refreshes its progress line about twice a second
+    unsigned long long now_ms = LftpNowMs();
+    if (now_ms - s->report_ms >= 500) {
+        s->report_ms = now_ms;
+        LftpNativeProgress(w, s->bytes, s->offset, s->size, s->start_ms);
+        LftpUringCpu(u, w);
+        LftpStatusEnqueue(w);
+        if (s->key.size()) {
+            LftpJournalCheckpoint(&p->journal, s->key, s->size, LftpFileMtime(s->st), s->bytes);
+        }
+    }
+
+    LftpUringChunk(u, s);
+}
+
+// same as `mput -c`: continue a shorter remote file, restart a longer one
+static void LftpUringResume(LftpUringLoop* u, LftpUringSlot* s, long long remote_size)
+{
+    LftpInfo* p = u->p;
+    LftpWorker* w = s->w;
+    LftpFtp* ftp = &w->ftp;
+
+    s->offset = 0;
+    if (remote_size > 0 && (unsigned long long)remote_size <= s->size) {
+        s->offset = remote_size;
+    }
+    // bytes past the last checkpoint may never have reached the disk of the server
+    if (s->journaled && s->entry.offset < s->offset) {
+        s->offset = s->entry.offset;
+    }
+    s->bytes = s->mark = s->offset;
+
+    w->status.transfer_state = LFTP_STATE_TRANSFERRING;
+
+    if (s->offset == s->size && s->size) {
+        LftpNativeTransferDone(w, s->transfer_ns, 0, false);
+        s->timed = true;
+        LftpNativeProgress(w, s->size, s->size, s->size, LftpNowMs());
+        w->status.remaining_time = 0;
+        w->status.transfer_state = LFTP_STATE_TRANSFERRED;
+        LftpStatusEnqueue(w);
+        if (s->key.size()) {
+            LftpJournalComplete(&p->journal, s->key, s->size, LftpFileMtime(s->st));
+        }
+        LftpUringAttemptEnd(u, s, 0);
+        return;
+    }
+
+    int ret;
+    if (!ftp->epsv_failed) {
+        ret = LftpUringCmd(u, s, LFTP_URING_STEP_EPSV, "EPSV");
+    } else if (u->peer.ss_family == AF_INET) {
+        ret = LftpUringCmd(u, s, LFTP_URING_STEP_PASV, "PASV");
+    } else {
+        LFTP_LOG("no usable passive port: %s", ftp->reply);
+        ret = -1;
+    }
+
+    if (ret != 0) {
+        LftpUringFail(u, s);
+    }
+}
+
+static void LftpUringSendStart(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpWorker* w = s->w;
+
+    posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(s->fd, s->offset, LFTP_NATIVE_READAHEAD, POSIX_FADV_WILLNEED);
+
+    s->step = LFTP_URING_STEP_SEND;
+    s->start_ms = LftpNowMs();
+    s->report_ms = 0;
+
+    LftpNativeProgress(w, s->bytes, s->offset, s->size, s->start_ms);
+    LftpStatusEnqueue(w);
+
+    LftpUringChunk(u, s);
+}
+
+static void LftpUringSendDone(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpInfo* p = u->p;
+    LftpWorker* w = s->w;
+
+    LftpNativeTransferDone(w, s->transfer_ns, 0, false);
+    s->timed = true;
+
+    LftpNativeProgress(w, s->bytes, s->offset, s->bytes, s->start_ms);
+    LftpUringCpu(u, w);
+    w->status.transferred_progress = 100;
+    w->status.remaining_time = 0;
+    w->status.transfer_state = LFTP_STATE_TRANSFERRED;
+    LftpStatusEnqueue(w);
+    if (s->key.size()) {
+        LftpJournalComplete(&p->journal, s->key, s->size, LftpFileMtime(s->st));
+    }
+    LftpRemoteUpdate(p, s->remote_name, (long long)s->bytes);
+
+    LftpUringAttemptEnd(u, s, 0);
+}
+
+// the op or the reply step waited for is there
+static void LftpUringStep(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpInfo* p = u->p;
+    LftpWorker* w = s->w;
+    LftpFtp* ftp = &w->ftp;
+    int code = ftp->code;
+    int ret = -1;
+    int one = 1;
+    int port = -1;
+    long long remote_size;
+
+    switch (s->step) {
+    case LFTP_URING_STEP_CONNECT:
+        ftp->ctrl = s->sock;
+        s->sock = -1;
+        setsockopt(ftp->ctrl, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        LftpUringReplyWait(u, s, LFTP_URING_STEP_GREETING);
+        return;
+
+    case LFTP_URING_STEP_GREETING:
+        if (code == 220) {
+            s->phase_ns = LftpNowNs();
+            ret = LftpUringCmd(u, s, LFTP_URING_STEP_USER, "USER %s", p->param.username.c_str());
+        }
+        break;
+
+    case LFTP_URING_STEP_USER:
+    case LFTP_URING_STEP_PASS:
+        if (code == 331 && s->step == LFTP_URING_STEP_USER) {
+            ret = LftpUringCmd(u, s, LFTP_URING_STEP_PASS, "PASS %s", p->param.password.c_str());
+        } else if (code == 230 || code == 202) {
+            ret = LftpUringCmd(u, s, LFTP_URING_STEP_TYPE, "TYPE I");
+        }
+        break;
+
+    case LFTP_URING_STEP_TYPE:
+        LftpPhaseDone(p, w->status, LFTP_PHASE_LOGIN, s->phase_ns);
+        if (code == 200) {
+            pthread_mutex_lock(&p->lock);
+            p->files.sessions++;
+            pthread_mutex_unlock(&p->lock);
+            ret = LftpUringCmd(u, s, LFTP_URING_STEP_CWD, "CWD %s", p->param.remote_path.c_str());
+        }
+        break;
+
+    case LFTP_URING_STEP_CWD:
+        if (code != 250) {
+            break;
+        }
+        w->connected = true;
+        s->transfer_ns = LftpNowNs();
+        if (LftpRemoteLookup(p, s->remote_name, &remote_size)) {
+            LftpUringResume(u, s, remote_size);
+            return;
+        }
+        ret = LftpUringCmd(u, s, LFTP_URING_STEP_SIZE, "SIZE %s", s->remote_name.c_str());
+        break;
+
+    case LFTP_URING_STEP_SIZE:
+        // a lost session fails here, the rest only means the size is unknown
+        if (code < 0 || code == 421) {
+            break;
+        }
+        LftpUringResume(u, s, code == 213 ? atoll(ftp->reply + 4) : -1);
+        return;
+
+    case LFTP_URING_STEP_EPSV:
+        if (code == 229) {
+            // 229 Entering Extended Passive Mode (|||6446|)
+            const char* d = strchr(ftp->reply, '(');
+            if (d && d[1] && d[2] == d[1] && d[3] == d[1]) {
+                port = atoi(d + 4);
+            }
+        } else if (code > 0 && code != 421) {
+            ftp->epsv_failed = true;
+            LftpUringResume(u, s, s->offset);
+            return;
+        }
+        if (port <= 0 || port > 65535) {
+            LFTP_LOG("no usable passive port: %s", ftp->reply);
+            break;
+        }
+        ret = LftpUringConnect(u, s, LFTP_URING_STEP_DATA, port);
+        break;
+
+    case LFTP_URING_STEP_PASV:
+        if (code == 227) {
+            // 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2), the host is ignored like LftpFtp does
+            unsigned int h[4], pp[2];
+            const char* d = strchr(ftp->reply, '(');
+            if (d && sscanf(d, "(%u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3], &pp[0], &pp[1]) == 6) {
+                port = (pp[0] << 8) | pp[1];
+            }
+        }
+        if (port <= 0 || port > 65535) {
+            LFTP_LOG("no usable passive port: %s", ftp->reply);
+            break;
+        }
+        ret = LftpUringConnect(u, s, LFTP_URING_STEP_DATA, port);
+        break;
+
+    case LFTP_URING_STEP_DATA:
+        ftp->data = s->sock;
+        s->sock = -1;
+        if (s->offset) {
+            ret = LftpUringCmd(u, s, LFTP_URING_STEP_REST, "REST %llu", s->offset);
+        } else {
+            ret = LftpUringCmd(u, s, LFTP_URING_STEP_STOR, "STOR %s", s->remote_name.c_str());
+        }
+        break;
+
+    case LFTP_URING_STEP_REST:
+        if (code == 350) {
+            ret = LftpUringCmd(u, s, LFTP_URING_STEP_STOR, "STOR %s", s->remote_name.c_str());
+        }
+        break;
+
+    case LFTP_URING_STEP_STOR:
+        if (code == 150 || code == 125) {
+            LftpUringSendStart(u, s);
+            return;
+        }
+        break;
+
+    case LFTP_URING_STEP_STOR_END:
+        if (code == 226 || code == 250) {
+            LftpUringSendDone(u, s);
+            return;
+        }
+        break;
+
+    case LFTP_URING_STEP_QUIT:
+        LftpUringClose(s);
+        s->step = LFTP_URING_STEP_DONE;
+        u->done++;
+        return;
+
+    default:
+        break;
+    }
+
+    if (ret != 0) {
+        LftpUringFail(u, s);
+    }
+}
+
+static void LftpUringFail(LftpUringLoop* u, LftpUringSlot* s)
+{
+    LftpInfo* p = u->p;
+    LftpWorker* w = s->w;
+    LftpFtp* ftp = &w->ftp;
+
+    if (s->step == LFTP_URING_STEP_QUIT) {
+        LftpUringClose(s);
+        s->step = LFTP_URING_STEP_DONE;
+        u->done++;
+        return;
+    }
+
+    // the server may drop a session that idled between two files, reopen it once
+    if (s->reused && s->step >= LFTP_URING_STEP_SIZE && s->step <= LFTP_URING_STEP_STOR
+        && (ftp->code == -1 || ftp->code == 421) && ftp->err != ECANCELED && p->sender.running) {
+        s->reused = false;
+        LFTP_LOG("session %d lost (%d), reconnect", w->id, ftp->code);
+        LftpUringClose(s);
+        LftpUringLogin(u, s);
+        return;
+    }
+
+    if (s->step >= LFTP_URING_STEP_EPSV && s->step <= LFTP_URING_STEP_STOR) {
+        LFTP_LOG("stor %s failed: %s", s->remote_name.c_str(), ftp->reply);
+    }
+
+    w->status.transfer_state = LftpNativeErrorState(ftp);
+    if (s->step >= LFTP_URING_STEP_SIZE) {
+        if (!s->timed) {
+            LftpNativeTransferDone(w, s->transfer_ns, 0, false);
+        }
+        LftpRemoteUpdate(p, s->remote_name, -1);
+    }
+
+    if (!p->sender.running) {
+        w->status.transfer_state = LFTP_STATE_ABORT;
+    } else if (w->canceled) {
+        w->status.transfer_state = LFTP_STATE_CANCELED;
+    }
+
+    w->transient = p->sender.running && LftpNativeTransient(ftp);
+    LftpStatusEnqueue(w);
+    LftpUringClose(s);
+
+    LftpUringAttemptEnd(u, s, -1);
+}
+
+// transfers waiting for a file or a retry, a stop ends them at once
+static void LftpUringTick(LftpUringLoop* u)
+{
+    LftpInfo* p = u->p;
+    unsigned long long now_ms = LftpNowMs();
+
+    for (size_t i = 0; i < u->slots.size(); i++) {
+        LftpUringSlot* s = &u->slots[i];
+
+        if (s->step == LFTP_URING_STEP_IDLE) {
+            LftpUringNext(u, s);
+        } else if (s->step == LFTP_URING_STEP_RETRY && (!p->sender.running || s->w->canceled)) {
+            LftpUploadRetryStopped(s->w);
+            LftpUringFileEnd(u, s, -1);
+        } else if (s->step == LFTP_URING_STEP_RETRY && now_ms >= s->retry_ms) {
+            // the next try continues from what the server has
+            s->w->status.retry_delay_ms = 0;
+            if (LftpUringOpen(u, s) != 0) {
+                LftpUringFileEnd(u, s, 0);
+            } else {
+                LftpUringAttempt(u, s);
+            }
+        }
+    }
+}
+
+// cancel an op of the loop by its user_data
+static void LftpUringCancelOp(LftpUringLoop* u, LftpUringSlot* s, LFTP_URING_OP op)
+{
+    struct io_uring_sqe* sqe = LftpUringQueue(u, NULL, LFTP_URING_OP_CANCEL, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0);
+    sqe->addr = LftpUringData(s, op);
+}
+
+// the stop poll and the tick, after a stop also the rate waits, the shutdowns end the rest
+static void LftpUringCancel(LftpUringLoop* u)
+{
+    if (u->canceling || LftpUringRoom(u, 2) != 0) {
+        return;
+    }
+    u->canceling = true;
+
+    for (size_t i = 0; !u->p->sender.running && i < u->slots.size(); i++) {
+        LftpUringSlot* s = &u->slots[i];
+        if (s->sock >= 0) {
+            shutdown(s->sock, SHUT_RDWR);
+        }
+        if (s->w->ftp.data >= 0) {
+            shutdown(s->w->ftp.data, SHUT_RDWR);
+        }
+        if (s->w->ftp.ctrl >= 0) {
+            shutdown(s->w->ftp.ctrl, SHUT_RDWR);
+        }
+    }
+
+    // by user_data, IORING_ASYNC_CANCEL_ANY would need 5.19 and end one op only without _ALL
+    LftpUringCancelOp(u, NULL, LFTP_URING_OP_STOP);
+    LftpUringCancelOp(u, NULL, LFTP_URING_OP_TICK);
+    for (size_t i = 0; !u->p->sender.running && i < u->slots.size(); i++) {
+        if (u->slots[i].rate_wait && LftpUringRoom(u, 1) == 0) {
+            LftpUringCancelOp(u, &u->slots[i], LFTP_URING_OP_RATE);
+        }
+    }
+}
+
+static void LftpUringComplete(LftpUringLoop* u, const struct io_uring_cqe* cqe)
+{
+    LFTP_URING_OP op = (LFTP_URING_OP)(cqe->user_data & ((1 << LFTP_URING_OP_BITS) - 1));
+    LftpUringSlot* s = &u->slots[cqe->user_data >> LFTP_URING_OP_BITS];
+    LftpFtp* ftp = &s->w->ftp;
+    int res = cqe->res;
+
+    u->inflight--;
+
+    switch (op) {
+    case LFTP_URING_OP_TIMEOUT:
+        break;
+
+    case LFTP_URING_OP_CANCEL:
+        break;
+
+    case LFTP_URING_OP_RATE:
+        // -ETIME once the wait is over, -ECANCELED after a stop
+        s->rate_wait = false;
+        if (!u->p->sender.running || s->w->canceled) {
+            LftpUringChunk(u, s);
+        } else {
+            LftpUringChunkQueue(u, s);
+        }
+        break;
+
+    case LFTP_URING_OP_STOP:
+        if (res > 0) {
+            LftpUringCancel(u);
+            LftpUringTick(u);
+        }
+        break;
+
+    case LFTP_URING_OP_TICK:
+        LftpUringTick(u);
+        if (!u->canceling && LftpUringRoom(u, 1) == 0) {
+            LftpUringQueue(u, NULL, LFTP_URING_OP_TICK, IORING_OP_TIMEOUT, -1, &lftpUringTick, 1, 0);
+        }
+        break;
+
+    case LFTP_URING_OP_CMD:
+        // the linked recv fails with -ECANCELED and reports it
+        if (res < 0) {
+            ftp->err = -res;
+        }
+        break;
+
+    case LFTP_URING_OP_CONNECT:
+        if (s->step == LFTP_URING_STEP_CONNECT) {
+            LftpPhaseDone(u->p, s->w->status, LFTP_PHASE_CONNECT, s->phase_ns);
+        }
+        if (res < 0) {
+            LftpUringOpError(u, s, res, ftp->code);
+            LftpUringFail(u, s);
+        } else {
+            LftpUringStep(u, s);
+        }
+        break;
+
+    case LFTP_URING_OP_REPLY:
+        if (res <= 0) {
+            LftpUringOpError(u, s, res, -1);
+            LftpUringFail(u, s);
+            break;
+        }
+        ftp->rlen += res;
+        if (LftpUringReply(s)) {
+            LftpUringStep(u, s);
+        } else if (LftpUringRecv(u, s) != 0) {
+            LftpUringFail(u, s);
+        }
+        break;
+
+    case LFTP_URING_OP_READ:
+        s->chunk_read = res;
+        break;
+
+    case LFTP_URING_OP_SEND:
+        if (res > 0) {
+            s->chunk_sent += res;
+            s->bytes += res;
+            u->sent += res;
+            if (s->chunk_sent < s->chunk) {
+                LftpUringSendRest(u, s);
+            } else {
+                LftpUringSent(u, s);
+            }
+        } else if (res == -ECANCELED && s->chunk_read >= 0 && (size_t)s->chunk_read < s->chunk
+            && u->p->sender.running) {
+            // file shrank under us, send what we have
+            if (!s->chunk_read) {
+                s->size = s->bytes;
+                LftpUringChunk(u, s);
+            } else {
+                s->chunk = s->chunk_read;
+                LftpUringSendRest(u, s);
+            }
+        } else if (s->chunk_read < 0) {
+            LFTP_LOG("read %s failed: %s", s->job.file_path.c_str(), strerror(-s->chunk_read));
+            ftp->err = -s->chunk_read;
+            LftpUringFail(u, s);
+        } else {
+            LftpUringOpError(u, s, res, ftp->code);
+            LftpUringFail(u, s);
+        }
+        break;
+    }
+}
+
+/*
+ * The uring engine in place of the worker threads, the workers are its
+ * transfers. The first one takes over the session of the mkdir.
+ */
+static void* LftpUringThread(void* arg)
+{
+    LftpInfo* p = (LftpInfo*)arg;
+    LftpUringLoop u;
+    size_t count = p->workers.size();
+    struct io_uring_cqe cqe;
+
+    u.p = p;
+    u.bufs = NULL;
+    u.fixed = false;
+    u.inflight = 0;
+    u.done = 0;
+    u.takers = count;
+    u.canceling = false;
+    u.peer = p->sender.ftp.peer;
+    u.peer_len = p->sender.ftp.peer_len;
+    u.sent = u.sent_mark = 0;
+    u.start_cpu_ns = u.cpu_ns = LftpThreadCpuNs();
+
+    // a connect, a command or a read→send chain per transfer, with its link timeout
+    if (LftpUringInit(&u.ring, count * 3 + 4) != 0
+        || posix_memalign((void**)&u.bufs, LFTP_NATIVE_DIRECT_ALIGN, count * LFTP_URING_CHUNK) != 0) {
+        LFTP_LOG("io_uring setup failed: %s", strerror(errno));
+        u.bufs = NULL;
+        pthread_mutex_lock(&p->lock);
+        if (!p->files.failed) {
+            p->files.failed = true;
+            p->status.transfer_state = LFTP_STATE_ABORT;
+        }
+        pthread_mutex_unlock(&p->lock);
+        goto uring_exit;
+    }
+
+    {
+        // pinned once, the reads skip mapping the pages of the buffer every time
+        vector<struct iovec> iov(count);
+        for (size_t i = 0; i < count; i++) {
+            iov[i].iov_base = u.bufs + i * LFTP_URING_CHUNK;
+            iov[i].iov_len = LFTP_URING_CHUNK;
+        }
+        u.fixed = LftpUringRegisterBuffers(&u.ring, iov.data(), count) == 0;
+        if (!u.fixed) {
+            LFTP_LOG("io_uring register buffers failed: %s, plain reads", strerror(errno));
+        }
+    }
+
+    u.slots.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        LftpUringSlot* s = &u.slots[i];
+        s->w = &p->workers[i];
+        s->step = LFTP_URING_STEP_IDLE;
+        s->multi[0] = 0;
+        s->sock = -1;
+        s->fd = -1;
+        s->buf = u.bufs + i * LFTP_URING_CHUNK;
+        s->rate_wait = false;
+
+        if (s->w->connected) {
+            // LftpFtp waits with poll, io_uring needs a blocking socket
+            fcntl(s->w->ftp.ctrl, F_SETFL, fcntl(s->w->ftp.ctrl, F_GETFL) & ~O_NONBLOCK);
+        } else {
+            LftpFtpInit(&s->w->ftp, p->sender.stop_fd);
+        }
+    }
+
+    {
+        struct io_uring_sqe* sqe = LftpUringQueue(&u, NULL, LFTP_URING_OP_STOP, IORING_OP_POLL_ADD,
+            p->sender.stop_fd, NULL, 0, 0);
+        sqe->poll32_events = POLLIN;
+        LftpUringQueue(&u, NULL, LFTP_URING_OP_TICK, IORING_OP_TIMEOUT, -1, &lftpUringTick, 1, 0);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        LftpUringNext(&u, &u.slots[i]);
+    }
+
+    while (u.inflight) {
+        if (u.done == count) {
+            LftpUringCancel(&u);
+        }
+
+        // everything queued this round goes in one syscall
+        if (LftpUringSubmit(&u.ring, 1) != 0) {
+            LFTP_LOG("io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+
+        while (LftpUringCqe(&u.ring, &cqe)) {
+            LftpUringComplete(&u, &cqe);
+        }
+    }
+
+    for (size_t i = 0; i < u.slots.size(); i++) {
+        LftpUringClose(&u.slots[i]);
+        if (u.slots[i].fd >= 0) {
+            close(u.slots[i].fd);
+        }
+    }
+
+uring_exit:
+    LftpUringExit(&u.ring);
+    free(u.bufs);
+
+    // slots that never ran out of files, the loop failed
+    pthread_mutex_lock(&p->lock);
+    p->files.takers -= u.takers;
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static long long LftpQueueDeadline(int deadline_ms)
+{
+    return deadline_ms > 0 ? (long long)(LftpNowMs() + deadline_ms) : LLONG_MAX;
+}
+
+// queue file i of param.files, with lock held once the threads run
+static void LftpFilesQueue(LftpInfo* p, int i, int priority, int deadline_ms)
+{
+    bool mp4 = p->param.export_format == LFTP_EXP_FMT_MP4;
+    // the native engine remuxes on the fly, ffmpeg is only needed for lftp
+    bool remux = mp4 && p->param.engine == LFTP_ENGINE_NATIVE;
+
+    LFTP_LOG("file[%2d]    : %s", i, p->param.files[i].c_str());
+
+    struct stat st;
+    string path = LftpLocalFilePath(p, p->param.files[i]);
+    bool found = stat(LftpExpandPath(path).c_str(), &st) == 0;
+    unsigned long long size = found ? st.st_size : 0;
+    p->files.sizes.push_back(size);
+    p->files.total_bytes += size;
+
+    LftpQueueKey key;
+    key.priority = priority;
+    key.deadline_ms = LftpQueueDeadline(deadline_ms);
+    key.order = 0;
+    if (p->param.queue_order == LFTP_QUEUE_NEWEST) {
+        key.order = found ? -LftpFileMtime(st) : 0;
+    } else if (p->param.queue_order == LFTP_QUEUE_SMALLEST) {
+        key.order = size;
+    }
+    key.index = i;
+    key.part = 0;
+    p->files.keys.push_back(key);
+
+    if (mp4 && !remux) {
+        p->files.pending.insert(key);
+    } else {
+        LftpJob job;
+        job.index = i;
+        job.file_name = p->param.files[i];
+        if (remux) {
+            string mp4_name = LftpMakeMp4Filename(job.file_name);
+            job.file_name = mp4_name.size() ? mp4_name : job.file_name + ".mp4";
+        }
+        job.file_path = path;
+        job.temp = false;
+        job.remux = remux;
+        job.transcode_ns = 0;
+        job.part = job.parts = 0;
+        job.part_offset = job.part_size = 0;
+        p->files.ready[key] = job;
+    }
+}
+
+static void LftpFilesInit(LftpInfo* p)
+{
+    bool mp4 = p->param.export_format == LFTP_EXP_FMT_MP4;
+
+    p->files.pending.clear();
+    p->files.ready.clear();
+    p->files.keys.clear();
+    p->files.takers = -1;
+    p->files.producing = mp4 && p->param.engine != LFTP_ENGINE_NATIVE ? LftpTranscoders(p->param) : 0;
+    p->files.watching = p->param.watch;
+    p->files.finished = 0;
+    p->files.failed = false;
+    p->files.sizes.clear();
+    p->files.total_bytes = 0;
+    p->files.finished_bytes = 0;
+    p->files.sessions = 0;
+    p->files.uploads = 0;
+    p->files.split.clear();
+
+    for (size_t i = 0; i < p->param.files.size(); i++) {
+        LftpFilesQueue(p, i, 0, 0);
+    }
+}
+
+static bool LftpWatchName(const string& name)
+{
+    // our own mp4 copies and half written temp names are not recordings
+    return name.size() > 3 && name.compare(name.size() - 3, 3, ".ts") == 0;
+}
+
+/*
+ * watch mode: queue ts files closed in or moved into path until the batch is
+ * stopped or fails, files of a burst are queued together after watch_batch_ms
+ */
+static void LftpWatchDirectory(LftpInfo* p)
+{
+    string dir = LftpExpandPath(p->param.path);
+    int notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify < 0 || inotify_add_watch(notify, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+        LFTP_LOG("watch %s failed: %s", dir.c_str(), strerror(errno));
+        goto watch_exit;
+    }
+
+    LFTP_LOG("watch %s", dir.c_str());
+
+    {
+        vector<string> names;
+        set<string> queued;         // names of the batch, a recorder closes a file again on append
+        size_t seen = 0;            // param.files in queued
+        unsigned long long flush_ms = 0;
+
+        while (p->sender.running) {
+            // workers set failed under the lock
+            pthread_mutex_lock(&p->lock);
+            bool failed = p->files.failed;
+            pthread_mutex_unlock(&p->lock);
+            if (failed) {
+                break;
+            }
+
+            int timeout = LFTP_WATCH_POLL_MS;
+            if (names.size()) {
+                unsigned long long now_ms = LftpNowMs();
+                timeout = now_ms < flush_ms ? (int)(flush_ms - now_ms) : 0;
+            }
+
+            struct pollfd pfd[2];
+            pfd[0].fd = p->sender.stop_fd;
+            pfd[0].events = POLLIN;
+            pfd[1].fd = notify;
+            pfd[1].events = POLLIN;
+
+            int ret = poll(pfd, 2, timeout);
+            if (ret < 0 && errno != EINTR) {
+                LFTP_LOG("watch poll failed: %s", strerror(errno));
+                break;
+            } else if (ret > 0 && (pfd[0].revents & POLLIN)) {
+                break;
+            } else if (ret > 0 && (pfd[1].revents & POLLIN)) {
+                char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+                ssize_t n;
+                while ((n = read(notify, buf, sizeof(buf))) > 0) {
+                    for (char* e = buf; e < buf + n; e += sizeof(struct inotify_event) + ((struct inotify_event*)e)->len) {
+                        struct inotify_event* event = (struct inotify_event*)e;
+                        if (!event->len || (event->mask & IN_ISDIR) || !LftpWatchName(event->name)) {
+                            continue;
+                        }
+                        if (std::find(names.begin(), names.end(), event->name) != names.end()) {
+                            continue;
+                        }
+                        if (names.empty()) {
+                            flush_ms = LftpNowMs() + p->param.watch_batch_ms;
+                        }
+                        names.push_back(event->name);
+                    }
+                }
+            }
+
+            if (names.empty() || LftpNowMs() < flush_ms) {
+                continue;
+            }
+
+            pthread_mutex_lock(&p->lock);
+            // also the files of the start and of LftpSessionEnqueue
+            for (; seen < p->param.files.size(); seen++) {
+                queued.insert(p->param.files[seen]);
+            }
+            for (size_t i = 0; i < names.size(); i++) {
+                if (!queued.insert(names[i]).second) {
+                    LFTP_LOG("watch %s already queued", names[i].c_str());
+                    continue;
+                }
+                p->param.files.push_back(names[i]);
+                LftpFilesQueue(p, p->param.files.size() - 1, 0, 0);
+            }
+            seen = p->param.files.size();
+            pthread_cond_broadcast(&p->files.cond);
+            pthread_mutex_unlock(&p->lock);
+
+            names.clear();
+        }
+    }
+
+watch_exit:
+    if (notify >= 0) {
+        close(notify);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->files.watching = false;
+    pthread_cond_broadcast(&p->files.cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void LftpFilesCleanup(LftpInfo* p)
+{
+    // transcoded files nobody uploaded after a stop or failure
+    map<LftpQueueKey, LftpJob>::iterator it;
+    for (it = p->files.ready.begin(); it != p->files.ready.end(); ++it) {
+        if (it->second.temp) {
+            unlink(LftpExpandPath(it->second.file_path).c_str());
+        }
+    }
+    p->files.ready.clear();
+}
+
+static void* LftpSenderThread(void* arg)
+{
+    LftpInfo* p = (LftpInfo*)arg;
+    size_t files, workers, transcoders;
+
+    LFTP_LOG("transfer start");
+    LFTP_LOG("ip          : %s", p->param.server.c_str());
+    LFTP_LOG("port        : %s", p->param.port.c_str());
+    LFTP_LOG("remote dir  : %s", p->param.remote_path.c_str());
+    LFTP_LOG("username    : %s", p->param.username.c_str());
+    LFTP_LOG("password    : %s", p->param.password.c_str());
+    LFTP_LOG("local dir   : %s", p->param.path.c_str());
+    LFTP_LOG("workers     : %d", p->param.workers);
+
+    // init params, the files were queued by LftpSessionStart
+    LftpStatusClear(p->status);
+    LftpRateJoin(&p->rate);
+
+    p->journal.fd = -1;
+    if (p->param.journal.size() && LftpJournalOpen(&p->journal, LftpExpandPath(p->param.journal)) != 0) {
+        LftpJournalClose(&p->journal);
+    }
+
+    p->manifest = NULL;
+    if (p->param.manifest.size() && !(p->manifest = fopen(LftpExpandPath(p->param.manifest).c_str(), "ae"))) {
+        LFTP_LOG("open manifest %s failed: %s", p->param.manifest.c_str(), strerror(errno));
+    }
+    // LftpSessionCancel looks at the workers
+    pthread_mutex_lock(&p->lock);
+    p->workers.clear();
+    pthread_mutex_unlock(&p->lock);
+    p->sender.connected = false;
+
+    for (int attempt = 0; 0 != LftpCreateRemoteDirectory(p); attempt++) {
+        bool transient = p->sender.running && (p->param.engine != LFTP_ENGINE_LFTP
+            ? LftpNativeTransient(&p->sender.ftp)
+            : p->status.transfer_state == LFTP_STATE_NO_ROUTE_TO_HOST);
+        if (!transient || attempt >= p->param.retries) {
+            LFTP_LOG("create dir failed, exit");
+            goto lftp_exit;
+        }
+
+        p->status.retries = attempt + 1;
+        p->status.retry_delay_ms = LftpRetryDelay(p, attempt);
+        p->status.transfer_state = LFTP_STATE_RETRYING;
+        LFTP_LOG("create dir retry, try %d in %d ms", attempt + 2, p->status.retry_delay_ms);
+        LftpStatusPush(p, &p->channels[LFTP_CHANNEL_SENDER], p->status);
+
+        if (LftpRetryWait(p, p->status.retry_delay_ms, NULL) != 0) {
+            p->status.retry_delay_ms = 0;
+            p->status.transfer_state = LFTP_STATE_ABORT;
+            LftpStatusPush(p, &p->channels[LFTP_CHANNEL_SENDER], p->status);
+            goto lftp_exit;
+        }
+        p->status.retry_delay_ms = 0;
+    }
+    LftpRemoteList(p);
+
+    pthread_mutex_lock(&p->lock);
+    files = p->param.files.size();
+    workers = p->param.workers > 0 ? p->param.workers : 1;
+    // the parts of a split file need their own workers
+    if (workers > files && !p->files.watching && p->param.split_parts < 2) {
+        workers = files;
+    }
+    p->files.takers = workers;
+    transcoders = workers ? p->files.producing : 0;
+    pthread_mutex_unlock(&p->lock);
+
+    if (workers) {
+        pthread_mutex_lock(&p->lock);
+        p->transcoders.resize(transcoders);
+        pthread_mutex_unlock(&p->lock);
+        for (size_t i = 0; i < transcoders; i++) {
+            LftpWorker* t = &p->transcoders[i];
+            t->info = p;
+            t->id = i;
+            t->tid = 0;
+            t->pos = t->bytes = 0;
+            t->connected = false;
+            t->file_index = -1;
+            t->canceled = false;
+            t->channel = &p->channels[LFTP_CHANNEL_TRANSCODERS + i];
+
+            if (0 != pthread_create(&t->tid, NULL, LftpTranscodeThread, (void*)t)) {
+                LFTP_LOG("create LftpTranscodeThread %d failed", (int)i);
+                t->tid = 0;
+                pthread_mutex_lock(&p->lock);
+                p->files.producing--;
+                pthread_cond_broadcast(&p->files.cond);
+                pthread_mutex_unlock(&p->lock);
+            }
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->workers.resize(workers);
+        pthread_mutex_unlock(&p->lock);
+        for (size_t i = 0; i < workers; i++) {
+            LftpWorker* w = &p->workers[i];
+            w->info = p;
+            w->id = i;
+            w->channel = &p->channels[LFTP_CHANNEL_TRANSCODERS + LftpTranscoders(p->param) + i];
+            w->pos = w->bytes = 0;
+            w->cpu_ns = w->sent = 0;
+            w->connected = false;
+            w->file_index = -1;
+            w->canceled = false;
+            LftpStatusClear(w->status);
+
+            if (i == 0 && p->sender.connected) {
+                w->ftp = p->sender.ftp;
+                w->connected = true;
+                p->sender.connected = false;
+            }
+
+            w->tid = 0;
+            if (p->param.engine == LFTP_ENGINE_URING) {
+                continue;
+            }
+
+            if (0 != pthread_create(&w->tid, NULL, LftpWorkerThread, (void*)w)) {
+                LFTP_LOG("create LftpWorkerThread %d failed", (int)i);
+                w->tid = 0;
+                pthread_mutex_lock(&p->lock);
+                p->files.takers--;
+                pthread_mutex_unlock(&p->lock);
+            }
+        }
+
+        // the uring thread is joined through the first worker
+        if (p->param.engine == LFTP_ENGINE_URING
+            && 0 != pthread_create(&p->workers[0].tid, NULL, LftpUringThread, (void*)p)) {
+            LFTP_LOG("create LftpUringThread failed");
+            p->workers[0].tid = 0;
+            pthread_mutex_lock(&p->lock);
+            p->files.takers -= workers;
+            pthread_mutex_unlock(&p->lock);
+        }
+
+        if (p->files.watching) {
+            LftpWatchDirectory(p);
+        }
+
+        for (size_t i = 0; i < workers; i++) {
+            if (p->workers[i].tid) {
+                pthread_join(p->workers[i].tid, NULL);
+            } else {
+                LftpNativeSessionClose(&p->workers[i], false);
+            }
+        }
+
+        for (size_t i = 0; i < transcoders; i++) {
+            if (p->transcoders[i].tid) {
+                pthread_join(p->transcoders[i].tid, NULL);
+            }
+        }
+
+        LftpFilesCleanup(p);
+
+        // stop is the normal end of watch mode, an abort only if files were left
+        if (!p->sender.running && !p->files.failed
+            && (!p->param.watch || p->files.finished < (int)p->param.files.size())) {
+            p->status.transfer_state = LFTP_STATE_ABORT;
+        }
+    }
+
+lftp_exit:
+    pthread_mutex_lock(&p->lock);
+    p->files.takers = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    LftpRateLeave(&p->rate);
+    if (p->journal.fd >= 0) {
+        LftpJournalClose(&p->journal);
+    }
+    if (p->manifest) {
+        fclose(p->manifest);
+        p->manifest = NULL;
+    }
+
+    if (p->sender.connected) {
+        LftpFtpClose(&p->sender.ftp);
+        p->sender.connected = false;
+    }
+
+    if (p->param.stats_file.size()) {
+        LftpTimingsWrite(&p->timings, LftpExpandPath(p->param.stats_file), p->param.stats_format, true);
+    }
+
+    p->sender.running = false;
+
+    if (p->status.transfer_state == LFTP_STATE_TRANSFERRING) {
+        p->status.transfer_state = LFTP_STATE_TRANSFERRED;
+    }
+    p->status.all_finish = true;
+    LftpStatusPush(p, &p->channels[LFTP_CHANNEL_SENDER], p->status);
+
+    LFTP_LOG("transfer finish");
+
+    return NULL;
+}
+
+LftpSession* LftpSessionCreate(void)
+{
+    LftpInfo* p = new LftpInfo();
+
+    p->sender.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    p->notify.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (p->sender.stop_fd < 0 || p->notify.fd < 0) {
+        LFTP_LOG("eventfd failed: %s", strerror(errno));
+        close(p->sender.stop_fd);
+        close(p->notify.fd);
+        delete p;
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&p->lock, NULL) != 0 || pthread_cond_init(&p->files.cond, NULL) != 0
+        || LftpTimingsInit(&p->timings) != 0) {
+        LFTP_LOG("pthread init failed");
+        close(p->sender.stop_fd);
+        close(p->notify.fd);
+        delete p;
+        return NULL;
+    }
+
+    LftpStatusClear(p->status);
+    LftpRateFlowInit(&p->rate, 1);
+    p->journal.fd = -1;
+
+    return p;
+}
+
+static void LftpSessionJoin(LftpSession* p)
+{
+    if (p->sender.joinable) {
+        pthread_join(p->sender.tid, NULL);
+        p->sender.joinable = false;
+    }
+}
+
+int LftpSessionStart(LftpSession* p, LftpParam& param)
+{
+    if (!p) {
+        return -1;
+    }
+
+    // the old batch has to see the stop before it is reset
+    if (p->sender.joinable) {
+        LftpSessionStop(p);
+        LftpSessionJoin(p);
+    }
+
+    eventfd_t count;
+    eventfd_read(p->sender.stop_fd, &count);
+    eventfd_read(p->notify.fd, &count);
+
+    p->param = param;
+    // the transcoders wait while this many files are ready, 0 would never start one
+    if (p->param.transcode_lookahead < 1) {
+        p->param.transcode_lookahead = 1;
+    }
+    // the uring loop only has the plain read→send path
+    if (p->param.engine == LFTP_ENGINE_URING
+        && (p->param.follow || p->param.checksum || p->param.direct_io || p->param.split_parts > 1
+            || !LftpUringSupported())) {
+        LFTP_LOG("uring engine not usable here, native engine instead");
+        p->param.engine = LFTP_ENGINE_NATIVE;
+    }
+    LftpFilesInit(p);
+
+    // statuses of the previous batch nobody read are dropped
+    LftpStatusChannelsReset(p, LFTP_CHANNEL_TRANSCODERS + LftpTranscoders(param) + (param.workers > 0 ? param.workers : 1));
+
+    // set before the thread runs, a stop right after start is not lost
+    pthread_mutex_lock(&p->lock);
+    p->sender.running = true;
+    pthread_mutex_unlock(&p->lock);
+
+    if (0 != pthread_create(&p->sender.tid, NULL, LftpSenderThread, (void*)p)) {
+        LFTP_LOG("create LftpSenderThread failed");
+        p->sender.running = false;
+        return -1;
+    }
+    p->sender.joinable = true;
+
+    return 0;
+}
+
+bool LftpSessionStatus(LftpSession* p, LftpStatus& status)
+{
+    if (!p) {
+        return false;
+    }
+
+    if (LftpStatusDequeue(p, status)) {
+        return true;
+    }
+
+    // empty, make the fd unreadable; a status published meanwhile makes it readable again
+    eventfd_t count;
+    eventfd_read(p->notify.fd, &count);
+    if (LftpStatusDequeue(p, status)) {
+        eventfd_write(p->notify.fd, 1);
+        return true;
+    }
+
+    return false;
+}
+
+int LftpSessionEnqueue(LftpSession* p, const char* file, int priority, int deadline_ms)
+{
+    if (!p || !file || !*file) {
+        return -1;
+    }
+
+    // the lftp engine needs its transcoders for mp4, they end once they ran out of files
+    bool transcode = p->param.export_format == LFTP_EXP_FMT_MP4 && p->param.engine != LFTP_ENGINE_NATIVE;
+    int index = -1;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->sender.running && !p->files.failed && p->files.takers != 0 && (!transcode || p->files.producing > 0)) {
+        index = p->param.files.size();
+        p->param.files.push_back(file);
+        LftpFilesQueue(p, index, priority, deadline_ms);
+        pthread_cond_broadcast(&p->files.cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return index;
+}
+
+int LftpSessionCancel(LftpSession* p, int file_index)
+{
+    if (!p) {
+        return -1;
+    }
+
+    int ret = -1;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->sender.running && file_index >= 0 && file_index < (int)p->files.keys.size()) {
+        const LftpQueueKey& key = p->files.keys[file_index];
+        // the file, or the parts of a split file no worker took yet
+        map<LftpQueueKey, LftpJob>::iterator it = p->files.ready.lower_bound(key);
+        bool split = false;
+
+        if (p->files.pending.erase(key)) {
+            p->files.finished++;
+            p->files.finished_bytes += p->files.sizes[file_index];
+            ret = 0;
+        }
+        while (it != p->files.ready.end() && it->first.index == file_index) {
+            if (it->second.temp) {
+                unlink(LftpExpandPath(it->second.file_path).c_str());
+            }
+            split = split || it->second.parts;
+            LftpFilesDone(p, it->second);
+            p->files.ready.erase(it++);
+            ret = 0;
+        }
+
+        if (ret == 0) {
+            LFTP_LOG("cancel [%d]: queued", file_index);
+        }
+        if (ret != 0 || split) {
+            for (size_t i = 0; i < p->transcoders.size(); i++) {
+                if (p->transcoders[i].file_index == file_index) {
+                    LFTP_LOG("cancel [%d]: transcoding on %d", file_index, (int)i);
+                    p->transcoders[i].canceled = true;
+                    ret = 0;
+                }
+            }
+            for (size_t i = 0; i < p->workers.size(); i++) {
+                if (p->workers[i].file_index == file_index) {
+                    LFTP_LOG("cancel [%d]: uploading on %d", file_index, (int)i);
+                    p->workers[i].canceled = true;
+                    ret = 0;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return ret;
+}
+
+int LftpSessionReprioritize(LftpSession* p, int file_index, int priority, int deadline_ms)
+{
+    if (!p) {
+        return -1;
+    }
+
+    int ret = -1;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->sender.running && file_index >= 0 && file_index < (int)p->files.keys.size()) {
+        LftpQueueKey key = p->files.keys[file_index];
+        LftpQueueKey moved = key;
+        moved.priority = priority;
+        moved.deadline_ms = LftpQueueDeadline(deadline_ms);
+
+        map<LftpQueueKey, LftpJob>::iterator it = p->files.ready.lower_bound(key);
+        if (p->files.pending.erase(key)) {
+            p->files.pending.insert(moved);
+            p->files.keys[file_index] = moved;
+            ret = 0;
+        }
+        // the parts of a split file move together
+        vector<LftpJob> jobs;
+        while (it != p->files.ready.end() && it->first.index == file_index) {
+            jobs.push_back(it->second);
+            p->files.ready.erase(it++);
+        }
+        for (size_t i = 0; i < jobs.size(); i++) {
+            moved.part = jobs[i].part;
+            p->files.ready[moved] = jobs[i];
+            ret = 0;
+        }
+        if (jobs.size()) {
+            moved.part = 0;
+            p->files.keys[file_index] = moved;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return ret;
+}
+
+int LftpSessionStatusFd(LftpSession* p)
+{
+    return p ? p->notify.fd : -1;
+}
+
+int LftpSessionSetNotify(LftpSession* p, LftpStatusNotify callback, void* ctx)
+{
+    if (!p) {
+        return -1;
+    }
+
+    // same lock as LftpSessionStart sets running with, the threads never see half a pair
+    pthread_mutex_lock(&p->lock);
+    bool running = p->sender.running;
+    if (!running) {
+        p->notify.callback = callback;
+        p->notify.ctx = ctx;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return running ? -1 : 0;
+}
+
+int LftpSessionStop(LftpSession* p)
+{
+    if (!p) {
+        return -1;
+    }
+
+    if (p->sender.running) {
+        LFTP_LOG("transfer abort");
+        pthread_mutex_lock(&p->lock);
+        p->sender.running = false;
+        pthread_cond_broadcast(&p->files.cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    // wakes every worker blocked on a socket or a child's output at once
+    eventfd_write(p->sender.stop_fd, 1);
+
+    return 0;
+}
+
+int LftpSessionSetRateWeight(LftpSession* p, unsigned int weight)
+{
+    if (!p) {
+        return -1;
+    }
+
+    LftpRateSetWeight(&p->rate, weight);
+
+    return 0;
+}
+
+int LftpSetRateLimit(unsigned long long bytes_per_second)
+{
+    LftpRateSetLimit(bytes_per_second);
+
+    return 0;
+}
+
+int LftpSessionStats(LftpSession* p, LftpStats& stats)
+{
+    if (!p) {
+        return -1;
+    }
+
+    LftpTimingsGet(&p->timings, stats);
+
+    return 0;
+}
+
+int LftpSessionStatsWrite(LftpSession* p, const char* path, LFTP_STATS_FORMAT format)
+{
+    if (!p || !path) {
+        return -1;
+    }
+
+    return LftpTimingsWrite(&p->timings, LftpExpandPath(path), format, true);
+}
+
+int LftpSessionDestroy(LftpSession* p)
+{
+    if (!p) {
+        return 0;
+    }
+
+    LftpSessionStop(p);
+    LftpSessionJoin(p);
+
+    LftpStatusChannelsReset(p, 0);
+    LftpTimingsDestroy(&p->timings);
+    pthread_cond_destroy(&p->files.cond);
+    pthread_mutex_destroy(&p->lock);
+    close(p->sender.stop_fd);
+    close(p->notify.fd);
+
+    delete p;
+
+    return 0;
+}
+
+static LftpSession* LftpDefaultSession(void)
+{
+    if (!lftpDefault) {
+        lftpDefault = LftpSessionCreate();
+    }
+
+    return lftpDefault;
+}
+
+int LftpUploadFilesStart(LftpParam& param)
+{
+    return LftpSessionStart(LftpDefaultSession(), param);
+}
+
+bool LftpUploadFilesStatus(LftpStatus& status)
+{
+    return LftpSessionStatus(lftpDefault, status);
+}
+
+int LftpUploadFilesStatusFd(void)
+{
+    return LftpSessionStatusFd(LftpDefaultSession());
+}
+
+int LftpUploadFilesSetNotify(LftpStatusNotify callback, void* ctx)
+{
+    return LftpSessionSetNotify(LftpDefaultSession(), callback, ctx);
+}
+
+int LftpUploadFilesStop(void)
+{
+    return lftpDefault ? LftpSessionStop(lftpDefault) : 0;
+}
+
+int LftpUploadFilesDestroy(void)
+{
+    LftpSessionDestroy(lftpDefault);
+    lftpDefault = NULL;
+
+    return 0;
+}
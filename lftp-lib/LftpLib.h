@@ -29,6 +29,10 @@ typedef enum _LFTP_STATE {
     LFTP_STATE_TRANSCODING,
     LFTP_STATE_TRANSFERRING,
     LFTP_STATE_TRANSFERRED,
+    LFTP_STATE_CHECKSUM_MISMATCH,
+    LFTP_STATE_RETRYING,        // a transient error, the file is tried again after retry_delay_ms
+    LFTP_STATE_CANCELED,        // LftpSessionCancel during the upload, the batch goes on
+    LFTP_STATE_TRANSCODE_FAILED,    // ffmpeg failed on the file, no new files are uploaded
     LFTP_STATE_MAX
 } LFTP_STATE;
 
@@ -38,32 +42,305 @@ typedef enum _LFTP_EXP_FMT {
     LFTP_EXP_FMT_MAX
 } LFTP_EXP_FMT;
 
+typedef enum _LFTP_ENGINE {
+    LFTP_ENGINE_NATIVE = 0,     // built-in ftp client, no external binaries
+    LFTP_ENGINE_LFTP,           // spawn `unbuffer lftp` for every file
+    LFTP_ENGINE_URING,          // one thread drives the uploads of all workers over io_uring
+    LFTP_ENGINE_MAX
+} LFTP_ENGINE;
+
+/*
+ * Where the time of an upload goes. The native engine times every phase, the
+ * lftp engine only mkdir (a whole lftp run), transcode (ffmpeg) and transfer
+ * (the lftp run of the file, its connect and login included).
+ */
+typedef enum _LFTP_PHASE {
+    LFTP_PHASE_CONNECT = 0,     // tcp connect and the greeting of the server
+    LFTP_PHASE_LOGIN,           // USER, PASS, TYPE
+    LFTP_PHASE_MKDIR,           // LftpCreateRemoteDirectory, once per batch
+    LFTP_PHASE_TRANSCODE,       // ffmpeg, or the native remux without its sends
+    LFTP_PHASE_TRANSFER,        // SIZE to the reply of the STOR
+    LFTP_PHASE_CHECKSUM,        // XCRC/HASH after the STOR
+    LFTP_PHASE_FILE,            // a file from the worker taking it until it is done
+    LFTP_PHASE_MAX
+} LFTP_PHASE;
+
+typedef enum _LFTP_QUEUE_ORDER {
+    LFTP_QUEUE_FIFO = 0,        // files in the order of param.files, then as enqueued
+    LFTP_QUEUE_NEWEST,          // latest mtime first
+    LFTP_QUEUE_SMALLEST,        // smallest file first
+    LFTP_QUEUE_MAX
+} LFTP_QUEUE_ORDER;
+
+typedef enum _LFTP_STATS_FORMAT {
+    LFTP_STATS_PROMETHEUS = 0,  // text exposition format, for the textfile collector
+    LFTP_STATS_JSON,
+    LFTP_STATS_MAX
+} LFTP_STATS_FORMAT;
+
 typedef struct _LftpParam {
     vector<string> files;
     string path;
     LFTP_EXP_FMT export_format;
+    LFTP_ENGINE engine = LFTP_ENGINE_NATIVE;
 
     string server;
     string port;
     string username;
     string password;
     string remote_path;
+
+    int workers = 1;            // parallel uploads, each on its own connection
+    int transcode_lookahead = 2; // mp4 files remuxed ahead of the upload (lftp engine), at least 1
+    int transcode_workers = 1;  // ffmpeg runs in parallel (lftp engine)
+    vector<int> transcode_cpus; // cpus the ffmpeg runs are pinned to, empty for any
+    int transcode_nice = 10;    // added to the nice value of ffmpeg, 0 keeps it
+    int transcode_io_class = 2; // ionice class of ffmpeg: 0 keeps it, 2 best-effort, 3 idle
+    int transcode_io_level = 7; // best-effort level of ffmpeg, 0 highest to 7 lowest
+    string journal;             // resume journal file, empty for none
+    bool zero_copy = true;      // native engine, sendfile/splice instead of read/write
+    bool drop_cache = true;     // native and uring engine, sent parts of a file are dropped from the page cache
+    bool direct_io = false;     // native engine, read with O_DIRECT past the page cache, no zero copy
+    bool follow = false;        // native engine, keep sending files that are still being written
+    int follow_idle_ms = 10000; // a followed file is finished after this long without a write
+    bool watch = false;         // run until stopped, upload new ts files of path as they appear
+    int watch_batch_ms = 1000;  // new files of a burst are queued together after this long
+    int split_parts = 1;        // native engine, a big ts file goes up as this many parts at once, one per worker
+    unsigned long long split_min_bytes = 1024ULL * 1024 * 1024; // smaller files are not split
+    bool checksum = false;      // native engine, CRC32C and CRC32 while sending, checked with XCRC/HASH
+    string manifest;            // checksums of the sent files are appended here, empty for none
+    string stats_file;          // phase timings of the session are written here, empty for none
+    LFTP_STATS_FORMAT stats_format = LFTP_STATS_PROMETHEUS;
+    int retries = 8;            // tries after a transient error (lost connection, 4xx reply), 0 none
+    int retry_base_ms = 1000;   // backoff before the first retry, doubled for each next one
+    int retry_max_ms = 60000;   // backoff limit, the jitter takes up to half of it off
+    LFTP_QUEUE_ORDER queue_order = LFTP_QUEUE_FIFO; // among queued files of the same priority and deadline
 } LftpParam;
 
+typedef enum _LFTP_CHECKSUM {
+    LFTP_CHECKSUM_NONE = 0,     // not computed
+    LFTP_CHECKSUM_LOCAL,        // computed while sending, the server can not check it
+    LFTP_CHECKSUM_VERIFIED,     // the server has the same CRC32
+    LFTP_CHECKSUM_MISMATCH,
+} LFTP_CHECKSUM;
+
+#define LFTP_FILE_NAME_MAX 256
+
 typedef struct _LftpStatus {
-    string file_name;
-    string transferred_bytes;
-    string transferred_progress;
-    string transfer_rate;
-    string remaining_time;
-    string transferred_time;
-    string transfer_state_str;
+    char file_name[LFTP_FILE_NAME_MAX];
+    unsigned long long file_size;
+    unsigned long long transferred_bytes;
+    int transferred_progress;   // percent
+    double transfer_rate;       // bytes per second
+    long long remaining_time;   // seconds, -1 unknown
+    unsigned long long transferred_time; // seconds
+    const char* transfer_state_str;
     LFTP_STATE transfer_state;
+
+    unsigned long long sequence;     // increases with every status of a batch
+    unsigned long long timestamp_ms; // CLOCK_MONOTONIC when the status was made
+
+    int file_index;             // index in LftpParam.files, -1 for batch status
+    int file_part;              // part of a split file, file_size and the bytes are of the part
+    int file_parts;             // parts the file is split into, 0 for a whole file
+    int files_total;
+    int files_finished;
+    unsigned long long all_transferred_bytes;
+    int all_progress;           // percent
+    int saved_round_trips;      // native engine, compared to a login per file
+    double rate_limit;          // bytes per second the session may use now, 0 unlimited
+    double cpu_per_gb;          // native engine, cpu seconds per GB (10^9 bytes) sent, this file
+    double all_cpu_per_gb;      // same over the batch
+    unsigned int crc32c;        // of the file as sent, with param.checksum
+    unsigned int crc32;
+    LFTP_CHECKSUM checksum;
+    double phase_ms[LFTP_PHASE_MAX]; // time of this file in each phase so far
+    int retries;                // failed tries of this file that were retried
+    int retry_delay_ms;         // wait before the next try, with LFTP_STATE_RETRYING
     bool all_finish;
 } LftpStatus;
 
+typedef struct _LftpPhaseStats {
+    unsigned long long count;   // times the phase ran
+    double total_ms;
+    double p50_ms;              // quantiles are within 6.25%
+    double p99_ms;
+    double max_ms;
+} LftpPhaseStats;
+
+typedef struct _LftpStats {
+    LftpPhaseStats phases[LFTP_PHASE_MAX];
+} LftpStats;
+
+/*
+ * One session uploads one batch at a time with its own threads, queues and 
+ * status, sessions run independently of each other. A session handle is used 
+ * from one thread, the one that reads its status.
+ */
+typedef struct _LftpInfo LftpSession;
+
+/**
+ * @brief called on an upload thread right after a status was queued, keep it 
+ * short and do not block, read the status with LftpSessionStatus 
+ */
+typedef void (*LftpStatusNotify)(LftpSession* session, void* ctx);
+
 /**
- * @brief lftp start transfer 
+ * @brief create an idle session 
+ * 
+ * @return LftpSession* NULL on failure
+ */
+LftpSession* LftpSessionCreate(void);
+
+/**
+ * @brief start a batch, a batch still running on the session is stopped first 
+ * 
+ * @param session 
+ * @param param 
+ * @return int 0 success, -1 fail
+ */
+int LftpSessionStart(LftpSession* session, LftpParam& param);
+
+/**
+ * @brief get the next status of the session, see LftpUploadFilesStatus 
+ * 
+ * @param session 
+ * @param status 
+ * @return true success
+ * @return false no new status
+ */
+bool LftpSessionStatus(LftpSession* session, LftpStatus& status);
+
+/**
+ * @brief add a file to the running batch 
+ * 
+ * Queued files go by priority, the higher first, then by deadline, the 
+ * earlier first, then by param.queue_order. Files being uploaded are not 
+ * interrupted. 
+ * 
+ * @param session 
+ * @param file name in param.path, like the names of param.files 
+ * @param priority files of param.files and of watch mode have 0 
+ * @param deadline_ms wanted on the server within this many ms, 0 none 
+ * @return int file_index of the file in the statuses, -1 fail: no batch 
+ * running, or it failed or takes no more files 
+ */
+int LftpSessionEnqueue(LftpSession* session, const char* file, int priority, int deadline_ms);
+
+/**
+ * @brief drop a file of the running batch 
+ * 
+ * A queued file is removed without a status of its own. A file being 
+ * uploaded or transcoded stops at its next chunk or output line and reports 
+ * LFTP_STATE_CANCELED. Either way it counts as finished and the batch goes on. 
+ * 
+ * @param session 
+ * @param file_index 
+ * @return int 0 success, -1 the file is not queued or in flight 
+ */
+int LftpSessionCancel(LftpSession* session, int file_index);
+
+/**
+ * @brief move a queued file, see LftpSessionEnqueue 
+ * 
+ * @param session 
+ * @param file_index 
+ * @param priority 
+ * @param deadline_ms from now, 0 none 
+ * @return int 0 success, -1 the file is not queued any more 
+ */
+int LftpSessionReprioritize(LftpSession* session, int file_index, int priority, int deadline_ms);
+
+/**
+ * @brief eventfd that is readable while statuses are waiting, for poll/epoll 
+ * 
+ * Read statuses until LftpSessionStatus returns false, that makes the fd 
+ * unreadable again. Do not read or close the fd yourself. 
+ * 
+ * @param session 
+ * @return int fd, -1 fail
+ */
+int LftpSessionStatusFd(LftpSession* session);
+
+/**
+ * @brief register a callback for new statuses, only while no batch runs 
+ * 
+ * @param session 
+ * @param callback NULL to remove
+ * @param ctx passed to callback
+ * @return int 0 success, -1 fail
+ */
+int LftpSessionSetNotify(LftpSession* session, LftpStatusNotify callback, void* ctx);
+
+/**
+ * @brief ask the batch to stop, returns at once, the last status has all_finish set 
+ * 
+ * @param session 
+ * @return int 
+ */
+int LftpSessionStop(LftpSession* session);
+
+/**
+ * @brief weight of the session in the global rate limit, 1 by default, applies at once 
+ * 
+ * Running sessions share the limit in proportion to their weights. 
+ * 
+ * @param session 
+ * @param weight 
+ * @return int 
+ */
+int LftpSessionSetRateWeight(LftpSession* session, unsigned int weight);
+
+/**
+ * @brief upload rate limit of all sessions together, 0 unlimited, applies at once 
+ * 
+ * The lftp engine picks up a change with the next file. 
+ * 
+ * @param bytes_per_second 
+ * @return int 
+ */
+int LftpSetRateLimit(unsigned long long bytes_per_second);
+
+/**
+ * @brief phase timings of all batches since the session was created 
+ * 
+ * @param session 
+ * @param stats 
+ * @return int 0 success, -1 fail
+ */
+int LftpSessionStats(LftpSession* session, LftpStats& stats);
+
+/**
+ * @brief write the phase timings to path, replaced atomically 
+ * 
+ * With param.stats_file set the session does this on its own, at most once 
+ * a second while files finish and at the end of every batch. 
+ * 
+ * @param session 
+ * @param path 
+ * @param format 
+ * @return int 0 success, -1 fail
+ */
+int LftpSessionStatsWrite(LftpSession* session, const char* path, LFTP_STATS_FORMAT format);
+
+/**
+ * @brief "connect", "login", "mkdir", "transcode", "transfer", "checksum" or "file" 
+ * 
+ * @param phase 
+ * @return const char* 
+ */
+const char* LftpPhaseName(LFTP_PHASE phase);
+
+/**
+ * @brief stop, wait for the threads and free the session 
+ * 
+ * @param session 
+ * @return int 
+ */
+int LftpSessionDestroy(LftpSession* session);
+
+/**
+ * @brief lftp start transfer on the default session 
  * 
  * @param param 
  * @return int 
@@ -73,12 +350,29 @@ int LftpUploadFilesStart(LftpParam& param);
 /**
  * @brief get lftp transfer status 
  * 
+ * State changes are reported one by one and in order, progress updates of 
+ * one file are merged, a slow caller only gets the latest.
+ * 
  * @param status 
  * @return true success
  * @return false fail 
  */
 bool LftpUploadFilesStatus(LftpStatus& status);
 
+/**
+ * @brief status fd of the default session, see LftpSessionStatusFd 
+ * 
+ * @return int 
+ */
+int LftpUploadFilesStatusFd(void);
+
+/**
+ * @brief status callback of the default session, see LftpSessionSetNotify 
+ * 
+ * @return int 
+ */
+int LftpUploadFilesSetNotify(LftpStatusNotify callback, void* ctx);
+
 /**
  * @brief lftp stop transfer 
  * 
@@ -87,7 +381,7 @@ bool LftpUploadFilesStatus(LftpStatus& status);
 int LftpUploadFilesStop(void);
 
 /**
- * @brief release resources 
+ * @brief stop the transfer and release the default session 
  * 
  * @return int 
  */
@@ -0,0 +1,31 @@
+/**
+ * @file LftpLog.h
+ * @author fox
+ * @brief log macros shared by lftp lib sources
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPLOG_H
+#define LFTPLOG_H
+
+#include <stdio.h>
+
+#define LFTP_DEBUG
+
+#ifdef LFTP_DEBUG
+#define DEBUG(format, ...) printf(format, ##__VA_ARGS__)
+#else
+#define DEBUG(format, ...)
+#endif
+
+#define LFTP_LOG(format, ...)                   \
+    do {                                        \
+        DEBUG("[%s:%d] Lftp-> " format "\n",    \
+            __func__, __LINE__, ##__VA_ARGS__); \
+    } while (0)
+
+#endif
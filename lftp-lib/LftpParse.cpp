@@ -0,0 +1,277 @@
+/**
+ * @file LftpParse.cpp
+ * @author fox
+ * @brief single pass parser for the lftp progress lines, no heap allocation
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <string.h>
+
+#include "LftpParse.h"
+
+#define LFTP_LIT(s) (s), (sizeof(s) - 1)
+
+static inline bool LftpIsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline bool LftpIsWord(char c)
+{
+    return LftpIsDigit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+// match literal at *pos, advance on success
+static inline bool LftpEat(const char* line, size_t len, size_t* pos, const char* lit, size_t lit_len)
+{
+    if (len - *pos < lit_len || memcmp(line + *pos, lit, lit_len) != 0) {
+        return false;
+    }
+
+    *pos += lit_len;
+    return true;
+}
+
+// one or more digits at *pos
+static inline bool LftpEatNumber(const char* line, size_t len, size_t* pos, unsigned long long* value)
+{
+    size_t start = *pos;
+    unsigned long long v = 0;
+
+    while (*pos < len && LftpIsDigit(line[*pos])) {
+        v = v * 10 + (line[*pos] - '0');
+        (*pos)++;
+    }
+
+    *value = v;
+    return *pos > start;
+}
+
+bool LftpSpanContains(const char* line, size_t len, const char* needle)
+{
+    return memmem(line, len, needle, strlen(needle)) != NULL;
+}
+
+// `name' at 1013275648 (83%) [11.18M/s eta:18s ]
+static bool LftpParseSending(const char* line, size_t len, LftpProgressLine* out)
+{
+    const char* tick = (const char*)memchr(line, '`', len);
+    if (!tick) {
+        return false;
+    }
+
+    size_t name_start = tick - line + 1;
+    size_t search = name_start;
+
+    // the name ends at the first "' at <n> (<n>%) " that parses, like the lazy `(.*?)'
+    while (search < len) {
+        const char* q = (const char*)memmem(line + search, len - search, LFTP_LIT("' at "));
+        if (!q) {
+            return false;
+        }
+
+        size_t pos = q - line + 5;
+        unsigned long long bytes = 0;
+        unsigned long long percent = 0;
+
+        search = q - line + 1;
+
+        if (!LftpEatNumber(line, len, &pos, &bytes)
+            || !LftpEat(line, len, &pos, LFTP_LIT(" ("))
+            || !LftpEatNumber(line, len, &pos, &percent)
+            || !LftpEat(line, len, &pos, LFTP_LIT("%) "))) {
+            continue;
+        }
+
+        out->file_name.ptr = line + name_start;
+        out->file_name.len = q - line - name_start;
+        out->bytes = bytes;
+        out->percent = (int)percent;
+
+        // optional "<d>.<d><w>/s eta:<w> "
+        size_t rate_start = pos;
+        size_t frac_start = 0;
+        unsigned long long ignore = 0;
+        if (LftpEatNumber(line, len, &pos, &ignore)
+            && LftpEat(line, len, &pos, LFTP_LIT("."))
+            && (frac_start = pos, LftpEatNumber(line, len, &pos, &ignore))
+            && pos < len
+            && (LftpIsWord(line[pos]) ? ++pos : pos - frac_start >= 2) // "11.18/s": the unit is a digit
+            && LftpEat(line, len, &pos, LFTP_LIT("/s"))) {
+            size_t rate_end = pos;
+
+            if (LftpEat(line, len, &pos, LFTP_LIT(" eta:"))) {
+                size_t eta_start = pos;
+                while (pos < len && LftpIsWord(line[pos])) {
+                    pos++;
+                }
+
+                if (pos > eta_start && pos < len && line[pos] == ' ') {
+                    out->detailed = true;
+                    out->rate.ptr = line + rate_start;
+                    out->rate.len = rate_end - rate_start;
+                    out->eta.ptr = line + eta_start;
+                    out->eta.len = pos - eta_start;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+// <n> bytes transferred[ in <n> second[s] (<rate>)]
+static bool LftpParseTransferred(const char* line, size_t len, LftpProgressLine* out)
+{
+    size_t search = 0;
+
+    while (search < len) {
+        const char* q = (const char*)memmem(line + search, len - search, LFTP_LIT(" bytes transferred"));
+        if (!q) {
+            return false;
+        }
+
+        size_t end = q - line;
+        size_t start = end;
+        search = end + 1;
+
+        while (start > 0 && LftpIsDigit(line[start - 1])) {
+            start--;
+        }
+        if (start == end) {
+            continue;
+        }
+
+        size_t pos = start;
+        LftpEatNumber(line, len, &pos, &out->bytes);
+        pos = end + sizeof(" bytes transferred") - 1;
+
+        unsigned long long seconds = 0;
+        if (LftpEat(line, len, &pos, LFTP_LIT(" in "))
+            && LftpEatNumber(line, len, &pos, &seconds)
+            && LftpEat(line, len, &pos, LFTP_LIT(" second"))) {
+            LftpEat(line, len, &pos, LFTP_LIT("s"));
+
+            if (LftpEat(line, len, &pos, LFTP_LIT(" ("))) {
+                const char* close = (const char*)memchr(line + pos, ')', len - pos);
+                if (close && close > line + pos) {
+                    out->detailed = true;
+                    out->seconds = seconds;
+                    out->rate.ptr = line + pos;
+                    out->rate.len = close - line - pos;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+int LftpParseProgressLine(const char* line, size_t len, LftpProgressLine* out)
+{
+    memset(out, 0, sizeof(*out));
+
+    if (LftpSpanContains(line, len, "Sending")) {
+        out->type = LFTP_LINE_SENDING;
+        return LftpParseSending(line, len, out) ? 0 : -1;
+    } else if (LftpSpanContains(line, len, "transferred")) {
+        out->type = LFTP_LINE_TRANSFERRED;
+        return LftpParseTransferred(line, len, out) ? 0 : -1;
+    }
+
+    out->type = LFTP_LINE_OTHER;
+    return 0;
+}
+
+double LftpParseRate(LftpSpan rate)
+{
+    const char* p = rate.ptr;
+    const char* end = rate.ptr + rate.len;
+    double value = 0;
+    double scale = 0;
+
+    if (p == end || !LftpIsDigit(*p)) {
+        return -1;
+    }
+    while (p < end && LftpIsDigit(*p)) {
+        value = value * 10 + (*p++ - '0');
+    }
+    if (p < end && *p == '.') {
+        for (p++, scale = 0.1; p < end && LftpIsDigit(*p); p++, scale /= 10) {
+            value += (*p - '0') * scale;
+        }
+    }
+    while (p < end && *p == ' ') {
+        p++;
+    }
+
+    // lftp scales by 1024, "K/s" and "KiB/s" alike
+    double unit = 1;
+    if (p < end) {
+        switch (*p) {
+        case 'K': case 'k':
+            unit = 1024.0;
+            break;
+        case 'M':
+            unit = 1024.0 * 1024;
+            break;
+        case 'G':
+            unit = 1024.0 * 1024 * 1024;
+            break;
+        case 'b': case 'B': case '/':
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return value * unit;
+}
+
+long long LftpParseDuration(LftpSpan duration)
+{
+    const char* p = duration.ptr;
+    const char* end = duration.ptr + duration.len;
+    long long seconds = 0;
+
+    if (p == end) {
+        return -1;
+    }
+
+    while (p < end) {
+        long long v = 0;
+        const char* start = p;
+        while (p < end && LftpIsDigit(*p)) {
+            v = v * 10 + (*p++ - '0');
+        }
+        if (p == start || p == end) {
+            return -1;
+        }
+
+        switch (*p++) {
+        case 'd':
+            seconds += v * 24 * 60 * 60;
+            break;
+        case 'h':
+            seconds += v * 60 * 60;
+            break;
+        case 'm':
+            seconds += v * 60;
+            break;
+        case 's':
+            seconds += v;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return seconds;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file LftpParse.h
+ * @author fox
+ * @brief single pass parser for the lftp progress lines, no heap allocation
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPPARSE_H
+#define LFTPPARSE_H
+
+#include <stddef.h>
+
+// view into the parsed line, not NUL terminated
+typedef struct _LftpSpan {
+    const char* ptr;
+    size_t len;
+} LftpSpan;
+
+typedef enum _LFTP_LINE {
+    LFTP_LINE_OTHER = 0,
+    LFTP_LINE_SENDING,
+    LFTP_LINE_TRANSFERRED,
+    LFTP_LINE_MAX
+} LFTP_LINE;
+
+typedef struct _LftpProgressLine {
+    LFTP_LINE type;
+    bool detailed;              // rate/eta (sending) or time/rate (transferred) present
+
+    LftpSpan file_name;         // sending only, full remote path as printed
+    unsigned long long bytes;
+    int percent;                // sending only
+    LftpSpan rate;              // "11.18M/s" or "11.20 MiB/s"
+    LftpSpan eta;               // sending only, "18s"
+    unsigned long long seconds; // transferred only
+} LftpProgressLine;
+
+/**
+ * @brief find needle in line
+ *
+ * @return true found
+ */
+bool LftpSpanContains(const char* line, size_t len, const char* needle);
+
+/**
+ * @brief parse one line of lftp output
+ *
+ * Sending:     `.../20240321160232.ts' at 1013275648 (83%) 11.18M/s eta:18s [Sending data]
+ *              `.../20240228140912_5191_HDMI.ts' at 81003344 (72%) [Sending data]
+ * Transferred: 1219759412 bytes transferred in 104 seconds (11.20 MiB/s)
+ *              14661659 bytes transferred
+ *
+ * @param line
+ * @param len
+ * @param out spans point into line
+ * @return int 0 success or not a progress line (type LFTP_LINE_OTHER),
+ *             -1 the line looks like progress but does not parse
+ */
+int LftpParseProgressLine(const char* line, size_t len, LftpProgressLine* out);
+
+/**
+ * @brief rate span in bytes per second, "11.18M/s", "11.20 MiB/s", "512b/s"
+ *
+ * @return double -1 if the span is not a rate
+ */
+double LftpParseRate(LftpSpan rate);
+
+/**
+ * @brief eta span in seconds, "18s", "1m41s", "2h5m"
+ *
+ * @return long long -1 if the span is not a duration
+ */
+long long LftpParseDuration(LftpSpan duration);
+
+#endif
@@ -0,0 +1,231 @@
+/**
+ * @file LftpProc.cpp
+ * @author fox
+ * @brief child process with a poll driven line reader on its output
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <vector>
+
+using std::vector;
+
+#include "LftpLog.h"
+#include "LftpProc.h"
+
+int LftpProcSpawn(LftpProc* proc, const char* cmd)
+{
+    int fds[2];
+
+    proc->pid = -1;
+    proc->fd = -1;
+    proc->start = 0;
+    proc->len = 0;
+
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        LFTP_LOG("pipe failed: %s", strerror(errno));
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LFTP_LOG("fork failed: %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        setpgid(0, 0);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+        _exit(127);
+    }
+
+    setpgid(pid, pid);
+    close(fds[1]);
+
+    proc->pid = pid;
+    proc->fd = fds[0];
+
+    return 0;
+}
+
+LFTP_PROC_READ LftpProcReadLine(LftpProc* proc, int stop_fd, const char** line, size_t* len)
+{
+    while (true) {
+        // hand out the next complete line already in the buffer
+        while (proc->len) {
+            char* begin = proc->buf + proc->start;
+            char* end = begin;
+            char* limit = begin + proc->len;
+
+            while (end < limit && *end != '\r' && *end != '\n') {
+                end++;
+            }
+            if (end == limit) {
+                break;
+            }
+
+            size_t n = end - begin;
+            proc->start += n + 1;
+            proc->len -= n + 1;
+
+            if (n) {
+                *line = begin;
+                *len = n;
+                return LFTP_PROC_READ_LINE;
+            }
+        }
+
+        // compact, a line longer than the buffer is handed out in pieces
+        if (proc->start) {
+            memmove(proc->buf, proc->buf + proc->start, proc->len);
+            proc->start = 0;
+        }
+        if (proc->len == sizeof(proc->buf)) {
+            *line = proc->buf;
+            *len = proc->len;
+            proc->len = 0;
+            return LFTP_PROC_READ_LINE;
+        }
+
+        struct pollfd pfd[2];
+        pfd[0].fd = proc->fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = stop_fd;
+        pfd[1].events = POLLIN;
+
+        int ret = poll(pfd, stop_fd >= 0 ? 2 : 1, -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return LFTP_PROC_READ_ERROR;
+        }
+
+        if (stop_fd >= 0 && (pfd[1].revents & POLLIN)) {
+            return LFTP_PROC_READ_STOP;
+        }
+
+        ssize_t n = read(proc->fd, proc->buf + proc->len, sizeof(proc->buf) - proc->len);
+        if (n > 0) {
+            proc->len += n;
+        } else if (n == 0) {
+            // last line without a newline
+            if (proc->len) {
+                *line = proc->buf;
+                *len = proc->len;
+                proc->len = 0;
+                return LFTP_PROC_READ_LINE;
+            }
+            return LFTP_PROC_READ_EOF;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            return LFTP_PROC_READ_ERROR;
+        }
+    }
+}
+
+static pid_t LftpProcParent(pid_t pid)
+{
+    char path[64];
+    char stat[512];
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, stat, sizeof(stat) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    stat[n] = 0;
+
+    // pid (comm) state ppid ..., comm may contain spaces and parentheses
+    char* p = strrchr(stat, ')');
+    if (!p) {
+        return -1;
+    }
+
+    char state;
+    int ppid;
+    if (sscanf(p + 1, " %c %d", &state, &ppid) != 2) {
+        return -1;
+    }
+
+    return ppid;
+}
+
+void LftpProcKill(LftpProc* proc)
+{
+    if (proc->pid <= 0) {
+        return;
+    }
+
+    // unbuffer runs lftp in a session of its own, collect the whole subtree
+    vector<pid_t> tree(1, proc->pid);
+    DIR* dir = opendir("/proc");
+    if (dir) {
+        vector<std::pair<pid_t, pid_t> > all;
+        struct dirent* e;
+        while ((e = readdir(dir)) != NULL) {
+            pid_t pid = atoi(e->d_name);
+            if (pid > 0) {
+                all.push_back(std::make_pair(pid, LftpProcParent(pid)));
+            }
+        }
+        closedir(dir);
+
+        for (size_t i = 0; i < tree.size(); i++) {
+            for (size_t j = 0; j < all.size(); j++) {
+                if (all[j].second == tree[i]) {
+                    tree.push_back(all[j].first);
+                }
+            }
+        }
+    }
+
+    kill(-proc->pid, SIGKILL);
+    for (size_t i = 0; i < tree.size(); i++) {
+        kill(tree[i], SIGKILL);
+    }
+
+    LFTP_LOG("killed pid %d and %d descendants", (int)proc->pid, (int)tree.size() - 1);
+}
+
+int LftpProcWait(LftpProc* proc)
+{
+    int status = 0;
+
+    if (proc->fd >= 0) {
+        close(proc->fd);
+        proc->fd = -1;
+    }
+
+    if (proc->pid <= 0) {
+        return -1;
+    }
+
+    while (waitpid(proc->pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    proc->pid = -1;
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
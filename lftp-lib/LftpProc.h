@@ -0,0 +1,64 @@
+/**
+ * @file LftpProc.h
+ * @author fox
+ * @brief child process with a poll driven line reader on its output
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPPROC_H
+#define LFTPPROC_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define LFTP_PROC_LINE_MAX 4096
+
+typedef struct _LftpProc {
+    pid_t pid;
+    int fd;                     // read end of the child's stdout and stderr
+
+    char buf[LFTP_PROC_LINE_MAX];
+    size_t start;
+    size_t len;
+} LftpProc;
+
+typedef enum _LFTP_PROC_READ {
+    LFTP_PROC_READ_ERROR = -1,
+    LFTP_PROC_READ_EOF = 0,
+    LFTP_PROC_READ_LINE,
+    LFTP_PROC_READ_STOP,
+} LFTP_PROC_READ;
+
+/**
+ * @brief run `/bin/sh -c cmd` in its own process group, output goes to proc->fd
+ *
+ * @return int 0 success, -1 fail
+ */
+int LftpProcSpawn(LftpProc* proc, const char* cmd);
+
+/**
+ * @brief wait for the next line of output, '\r' and '\n' both end a line
+ *
+ * @param stop_fd readable fd (eventfd) aborts the wait, -1 for none
+ * @param line valid until the next call
+ * @return LFTP_PROC_READ
+ */
+LFTP_PROC_READ LftpProcReadLine(LftpProc* proc, int stop_fd, const char** line, size_t* len);
+
+/**
+ * @brief SIGKILL the child and everything it started, other processes are untouched
+ */
+void LftpProcKill(LftpProc* proc);
+
+/**
+ * @brief close the pipe and reap the child
+ *
+ * @return int exit status, -1 if killed or unknown
+ */
+int LftpProcWait(LftpProc* proc);
+
+#endif
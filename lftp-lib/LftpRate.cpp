@@ -0,0 +1,169 @@
+/**
+ * @file LftpRate.cpp
+ * @author fox
+ * @brief process wide upload rate limit shared by weight between sessions
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "LftpRate.h"
+
+// largest burst after an idle time
+#define LFTP_RATE_BURST_MS 100
+#define LFTP_RATE_BURST_MIN (64 * 1024)
+
+static struct {
+    pthread_mutex_t lock;
+    unsigned long long limit;
+    unsigned long long weights; // sum over the active flows
+} lftpRate = { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+
+static unsigned long long LftpRateNowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// with lock held
+static double LftpRateShareLocked(LftpRateFlow* flow)
+{
+    if (!lftpRate.limit) {
+        return 0;
+    }
+
+    unsigned long long weights = lftpRate.weights;
+    if (!flow->active) {
+        weights += flow->weight;
+    }
+
+    return (double)lftpRate.limit * flow->weight / weights;
+}
+
+void LftpRateFlowInit(LftpRateFlow* flow, unsigned int weight)
+{
+    flow->weight = weight ? weight : 1;
+    flow->active = false;
+    flow->tokens = 0;
+    flow->last_ns = 0;
+}
+
+void LftpRateJoin(LftpRateFlow* flow)
+{
+    pthread_mutex_lock(&lftpRate.lock);
+    if (!flow->active) {
+        flow->active = true;
+        flow->tokens = 0;
+        flow->last_ns = LftpRateNowNs();
+        lftpRate.weights += flow->weight;
+    }
+    pthread_mutex_unlock(&lftpRate.lock);
+}
+
+void LftpRateLeave(LftpRateFlow* flow)
+{
+    pthread_mutex_lock(&lftpRate.lock);
+    if (flow->active) {
+        flow->active = false;
+        lftpRate.weights -= flow->weight;
+    }
+    pthread_mutex_unlock(&lftpRate.lock);
+}
+
+void LftpRateSetLimit(unsigned long long bytes_per_second)
+{
+    pthread_mutex_lock(&lftpRate.lock);
+    lftpRate.limit = bytes_per_second;
+    pthread_mutex_unlock(&lftpRate.lock);
+}
+
+unsigned long long LftpRateGetLimit(void)
+{
+    pthread_mutex_lock(&lftpRate.lock);
+    unsigned long long limit = lftpRate.limit;
+    pthread_mutex_unlock(&lftpRate.lock);
+
+    return limit;
+}
+
+void LftpRateSetWeight(LftpRateFlow* flow, unsigned int weight)
+{
+    if (!weight) {
+        weight = 1;
+    }
+
+    pthread_mutex_lock(&lftpRate.lock);
+    if (flow->active) {
+        lftpRate.weights = lftpRate.weights - flow->weight + weight;
+    }
+    flow->weight = weight;
+    pthread_mutex_unlock(&lftpRate.lock);
+}
+
+double LftpRateShare(LftpRateFlow* flow)
+{
+    pthread_mutex_lock(&lftpRate.lock);
+    double share = LftpRateShareLocked(flow);
+    pthread_mutex_unlock(&lftpRate.lock);
+
+    return share;
+}
+
+int LftpRateReserve(LftpRateFlow* flow, size_t bytes)
+{
+    pthread_mutex_lock(&lftpRate.lock);
+
+    double share = LftpRateShareLocked(flow);
+    if (share <= 0) {
+        pthread_mutex_unlock(&lftpRate.lock);
+        return 0;
+    }
+
+    unsigned long long now = LftpRateNowNs();
+    double burst = share * LFTP_RATE_BURST_MS / 1000;
+    if (burst < LFTP_RATE_BURST_MIN) {
+        burst = LFTP_RATE_BURST_MIN;
+    }
+
+    flow->tokens += share * (now - flow->last_ns) / 1e9;
+    if (flow->tokens > burst) {
+        flow->tokens = burst;
+    }
+    flow->last_ns = now;
+
+    // send now if the flow is not in debt, else wait off the debt of the bytes sent
+    // before, workers of one flow queue up behind each other
+    double debt = -flow->tokens;
+    flow->tokens -= bytes;
+
+    pthread_mutex_unlock(&lftpRate.lock);
+
+    return debt > 0 ? (int)(debt * 1000 / share) + 1 : 0;
+}
+
+int LftpRateAcquire(LftpRateFlow* flow, size_t bytes, int stop_fd)
+{
+    int wait_ms = LftpRateReserve(flow, bytes);
+    if (!wait_ms) {
+        return 0;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = stop_fd;
+    pfd.events = POLLIN;
+
+    // a limit or weight change applies from the next call on
+    int ret;
+    while ((ret = poll(&pfd, stop_fd >= 0 ? 1 : 0, wait_ms)) < 0 && errno == EINTR) {
+    }
+
+    return ret > 0 ? -1 : 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * @file LftpRate.h
+ * @author fox
+ * @brief process wide upload rate limit shared by weight between sessions
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPRATE_H
+#define LFTPRATE_H
+
+#include <stddef.h>
+
+/*
+ * One token bucket per flow (session). While a limit is set every active flow
+ * refills at limit * weight / sum of the active weights, an idle session does
+ * not hold back bandwidth of the others.
+ */
+typedef struct _LftpRateFlow {
+    unsigned int weight;
+    bool active;
+    double tokens;              // bytes, negative while in debt
+    unsigned long long last_ns;
+} LftpRateFlow;
+
+void LftpRateFlowInit(LftpRateFlow* flow, unsigned int weight);
+
+/**
+ * @brief take part in the sharing while a batch runs
+ */
+void LftpRateJoin(LftpRateFlow* flow);
+void LftpRateLeave(LftpRateFlow* flow);
+
+/**
+ * @brief global limit in bytes per second, 0 unlimited, applies at once
+ */
+void LftpRateSetLimit(unsigned long long bytes_per_second);
+unsigned long long LftpRateGetLimit(void);
+
+void LftpRateSetWeight(LftpRateFlow* flow, unsigned int weight);
+
+/**
+ * @brief current share of the flow in bytes per second, 0 unlimited
+ */
+double LftpRateShare(LftpRateFlow* flow);
+
+/**
+ * @brief account bytes about to be sent without sleeping
+ *
+ * @return int ms to wait before they go out, 0 at once
+ */
+int LftpRateReserve(LftpRateFlow* flow, size_t bytes);
+
+/**
+ * @brief account bytes about to be sent, sleeps while the flow is over its share
+ *
+ * @param stop_fd readable fd aborts the wait, -1 for none
+ * @return int 0 go on, -1 stopped
+ */
+int LftpRateAcquire(LftpRateFlow* flow, size_t bytes, int stop_fd);
+
+#endif
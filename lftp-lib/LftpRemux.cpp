@@ -0,0 +1,1029 @@
+/**
+ * @file LftpRemux.cpp
+ * @author fox
+ * @brief streaming mpeg-ts to fragmented mp4 remuxer (h.264 + aac)
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <string.h>
+
+#include <vector>
+
+using std::vector;
+
+#include "LftpLog.h"
+#include "LftpRemux.h"
+
+#define LFTP_TS_PACKET 188
+#define LFTP_TS_SYNC 0x47
+
+#define LFTP_TS_STREAM_AAC 0x0f
+#define LFTP_TS_STREAM_H264 0x1b
+
+#define LFTP_TS_CLOCK 90000
+#define LFTP_TS_MASK ((1LL << 33) - 1)
+
+// give up waiting for the audio config after this much video
+#define LFTP_REMUX_AUDIO_WAIT (10 * LFTP_TS_CLOCK)
+
+typedef struct _LftpRemuxSample {
+    unsigned long long dts;
+    int cts;                    // pts - dts
+    unsigned int duration;
+    bool sync;
+    unsigned int size;
+} LftpRemuxSample;
+
+typedef struct _LftpRemuxTrack {
+    int pid;                    // -1 if the program has no such stream
+    int id;                     // mp4 track_ID
+    unsigned int timescale;
+
+    vector<unsigned char> pes;
+
+    bool have_ts;
+    long long last_ts;          // unwrapped 33 bit clock
+
+    bool configured;
+    vector<unsigned char> sps;
+    vector<unsigned char> pps;
+    int width;
+    int height;
+    unsigned char asc[2];
+    int channels;
+    int sample_rate;
+
+    // samples of the fragment being built
+    vector<LftpRemuxSample> samples;
+    vector<unsigned char> data;
+    unsigned long long base_time; // tfdt of the pending fragment
+    bool base_set;
+} LftpRemuxTrack;
+
+struct _LftpRemux {
+    LftpRemuxOutput output;
+    void* ctx;
+
+    unsigned char pkt[LFTP_TS_PACKET];
+    size_t pkt_len;
+
+    int pmt_pid;
+    LftpRemuxTrack video;
+    LftpRemuxTrack audio;
+
+    bool started;
+    long long start;            // dts of the first video key frame
+    bool init_written;
+    unsigned int sequence;
+    bool failed;
+
+    vector<unsigned char> out;
+};
+
+/* ---------------------------------------------------------------------- */
+/* bit reader for the sps                                                  */
+
+typedef struct _LftpBits {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;                 // in bits
+} LftpBits;
+
+static unsigned int LftpBitsRead(LftpBits* b, int n)
+{
+    unsigned int v = 0;
+
+    while (n--) {
+        v <<= 1;
+        if (b->pos < b->size * 8) {
+            v |= (b->data[b->pos / 8] >> (7 - b->pos % 8)) & 1;
+        }
+        b->pos++;
+    }
+
+    return v;
+}
+
+static unsigned int LftpBitsUe(LftpBits* b)
+{
+    int zeros = 0;
+
+    while (zeros < 32 && LftpBitsRead(b, 1) == 0 && b->pos < b->size * 8) {
+        zeros++;
+    }
+
+    return ((1u << zeros) - 1) + LftpBitsRead(b, zeros);
+}
+
+static int LftpBitsSe(LftpBits* b)
+{
+    unsigned int v = LftpBitsUe(b);
+
+    return (v & 1) ? (int)((v + 1) / 2) : -(int)(v / 2);
+}
+
+static void LftpSpsSize(const vector<unsigned char>& nal, int* width, int* height)
+{
+    // drop the emulation prevention bytes
+    vector<unsigned char> rbsp;
+    for (size_t i = 1; i < nal.size(); i++) {
+        if (i + 2 < nal.size() && nal[i] == 0 && nal[i + 1] == 0 && nal[i + 2] == 3) {
+            rbsp.push_back(0);
+            rbsp.push_back(0);
+            i += 2;
+        } else {
+            rbsp.push_back(nal[i]);
+        }
+    }
+
+    LftpBits b = { rbsp.data(), rbsp.size(), 0 };
+
+    unsigned int profile = LftpBitsRead(&b, 8);
+    LftpBitsRead(&b, 16); // constraint flags, level
+    LftpBitsUe(&b);       // seq_parameter_set_id
+
+    unsigned int chroma = 1;
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44
+        || profile == 83 || profile == 86 || profile == 118 || profile == 128 || profile == 138
+        || profile == 139 || profile == 134 || profile == 135) {
+        chroma = LftpBitsUe(&b);
+        if (chroma == 3) {
+            LftpBitsRead(&b, 1);
+        }
+        LftpBitsUe(&b); // bit_depth_luma_minus8
+        LftpBitsUe(&b); // bit_depth_chroma_minus8
+        LftpBitsRead(&b, 1);
+        if (LftpBitsRead(&b, 1)) {
+            for (int i = 0; i < (chroma == 3 ? 12 : 8); i++) {
+                if (!LftpBitsRead(&b, 1)) {
+                    continue;
+                }
+                int last = 8, next = 8;
+                for (int j = 0; j < (i < 6 ? 16 : 64); j++) {
+                    if (next) {
+                        next = (last + LftpBitsSe(&b) + 256) % 256;
+                    }
+                    last = next ? next : last;
+                }
+            }
+        }
+    }
+
+    LftpBitsUe(&b); // log2_max_frame_num_minus4
+    unsigned int poc_type = LftpBitsUe(&b);
+    if (poc_type == 0) {
+        LftpBitsUe(&b);
+    } else if (poc_type == 1) {
+        LftpBitsRead(&b, 1);
+        LftpBitsSe(&b);
+        LftpBitsSe(&b);
+        unsigned int n = LftpBitsUe(&b);
+        for (unsigned int i = 0; i < n && i < 256; i++) {
+            LftpBitsSe(&b);
+        }
+    }
+    LftpBitsUe(&b);       // max_num_ref_frames
+    LftpBitsRead(&b, 1);  // gaps_in_frame_num_value_allowed_flag
+
+    unsigned int mbs_w = LftpBitsUe(&b) + 1;
+    unsigned int map_h = LftpBitsUe(&b) + 1;
+    unsigned int frame_mbs_only = LftpBitsRead(&b, 1);
+    if (!frame_mbs_only) {
+        LftpBitsRead(&b, 1);
+    }
+    LftpBitsRead(&b, 1);  // direct_8x8_inference_flag
+
+    unsigned int crop_l = 0, crop_r = 0, crop_t = 0, crop_b = 0;
+    if (LftpBitsRead(&b, 1)) {
+        crop_l = LftpBitsUe(&b);
+        crop_r = LftpBitsUe(&b);
+        crop_t = LftpBitsUe(&b);
+        crop_b = LftpBitsUe(&b);
+    }
+
+    unsigned int unit_x = (chroma == 1 || chroma == 2) ? 2 : 1;
+    unsigned int unit_y = (chroma == 1 ? 2 : 1) * (2 - frame_mbs_only);
+
+    *width = mbs_w * 16 - unit_x * (crop_l + crop_r);
+    *height = (2 - frame_mbs_only) * map_h * 16 - unit_y * (crop_t + crop_b);
+}
+
+/* ---------------------------------------------------------------------- */
+/* mp4 box writer                                                          */
+
+static void LftpPut8(vector<unsigned char>& v, unsigned int x)
+{
+    v.push_back(x & 0xff);
+}
+
+static void LftpPut16(vector<unsigned char>& v, unsigned int x)
+{
+    LftpPut8(v, x >> 8);
+    LftpPut8(v, x);
+}
+
+static void LftpPut32(vector<unsigned char>& v, unsigned int x)
+{
+    LftpPut16(v, x >> 16);
+    LftpPut16(v, x);
+}
+
+static void LftpPut64(vector<unsigned char>& v, unsigned long long x)
+{
+    LftpPut32(v, x >> 32);
+    LftpPut32(v, x);
+}
+
+static void LftpPutZero(vector<unsigned char>& v, size_t n)
+{
+    v.insert(v.end(), n, 0);
+}
+
+static void LftpPutBytes(vector<unsigned char>& v, const unsigned char* p, size_t n)
+{
+    v.insert(v.end(), p, p + n);
+}
+
+static void LftpSet32(vector<unsigned char>& v, size_t at, unsigned int x)
+{
+    v[at] = x >> 24;
+    v[at + 1] = x >> 16;
+    v[at + 2] = x >> 8;
+    v[at + 3] = x;
+}
+
+static size_t LftpBoxBegin(vector<unsigned char>& v, const char* type)
+{
+    size_t at = v.size();
+    LftpPut32(v, 0);
+    LftpPutBytes(v, (const unsigned char*)type, 4);
+    return at;
+}
+
+static size_t LftpFullBoxBegin(vector<unsigned char>& v, const char* type, int version, unsigned int flags)
+{
+    size_t at = LftpBoxBegin(v, type);
+    LftpPut32(v, (version << 24) | flags);
+    return at;
+}
+
+static void LftpBoxEnd(vector<unsigned char>& v, size_t at)
+{
+    LftpSet32(v, at, v.size() - at);
+}
+
+static void LftpPutMatrix(vector<unsigned char>& v)
+{
+    static const unsigned int matrix[9] = { 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000 };
+    for (int i = 0; i < 9; i++) {
+        LftpPut32(v, matrix[i]);
+    }
+}
+
+static void LftpPutVideoEntry(vector<unsigned char>& v, LftpRemuxTrack* t)
+{
+    size_t avc1 = LftpBoxBegin(v, "avc1");
+    LftpPutZero(v, 6);
+    LftpPut16(v, 1);            // data_reference_index
+    LftpPutZero(v, 16);
+    LftpPut16(v, t->width);
+    LftpPut16(v, t->height);
+    LftpPut32(v, 0x00480000);   // 72 dpi
+    LftpPut32(v, 0x00480000);
+    LftpPut32(v, 0);
+    LftpPut16(v, 1);            // frame_count
+    LftpPutZero(v, 32);         // compressorname
+    LftpPut16(v, 0x0018);
+    LftpPut16(v, 0xffff);
+
+    size_t avcc = LftpBoxBegin(v, "avcC");
+    LftpPut8(v, 1);
+    LftpPut8(v, t->sps[1]);     // profile, compatibility, level
+    LftpPut8(v, t->sps[2]);
+    LftpPut8(v, t->sps[3]);
+    LftpPut8(v, 0xff);          // 4 byte nal lengths
+    LftpPut8(v, 0xe1);
+    LftpPut16(v, t->sps.size());
+    LftpPutBytes(v, t->sps.data(), t->sps.size());
+    LftpPut8(v, 1);
+    LftpPut16(v, t->pps.size());
+    LftpPutBytes(v, t->pps.data(), t->pps.size());
+    LftpBoxEnd(v, avcc);
+
+    LftpBoxEnd(v, avc1);
+}
+
+static void LftpPutAudioEntry(vector<unsigned char>& v, LftpRemuxTrack* t)
+{
+    size_t mp4a = LftpBoxBegin(v, "mp4a");
+    LftpPutZero(v, 6);
+    LftpPut16(v, 1);            // data_reference_index
+    LftpPutZero(v, 8);
+    LftpPut16(v, t->channels);
+    LftpPut16(v, 16);
+    LftpPutZero(v, 4);
+    LftpPut32(v, (t->sample_rate & 0xffff) << 16);
+
+    // ES_Descriptor > DecoderConfigDescriptor > DecoderSpecificInfo, SLConfigDescriptor
+    size_t esds = LftpFullBoxBegin(v, "esds", 0, 0);
+    LftpPut8(v, 0x03);
+    LftpPut8(v, 3 + 2 + 13 + 2 + 2 + 3);
+    LftpPut16(v, 0);            // ES_ID
+    LftpPut8(v, 0);
+    LftpPut8(v, 0x04);
+    LftpPut8(v, 13 + 2 + 2);
+    LftpPut8(v, 0x40);          // mpeg-4 audio
+    LftpPut8(v, 0x15);          // audio stream
+    LftpPutZero(v, 3 + 4 + 4);  // buffer size, max and avg bitrate
+    LftpPut8(v, 0x05);
+    LftpPut8(v, 2);
+    LftpPutBytes(v, t->asc, 2);
+    LftpPut8(v, 0x06);
+    LftpPut8(v, 1);
+    LftpPut8(v, 0x02);
+    LftpBoxEnd(v, esds);
+
+    LftpBoxEnd(v, mp4a);
+}
+
+static void LftpPutTrak(vector<unsigned char>& v, LftpRemuxTrack* t, bool video)
+{
+    size_t trak = LftpBoxBegin(v, "trak");
+
+    size_t tkhd = LftpFullBoxBegin(v, "tkhd", 0, 3);
+    LftpPutZero(v, 8);          // creation and modification time
+    LftpPut32(v, t->id);
+    LftpPutZero(v, 4 + 4 + 8);  // reserved, duration, reserved
+    LftpPut16(v, 0);            // layer
+    LftpPut16(v, 0);            // alternate_group
+    LftpPut16(v, video ? 0 : 0x0100);
+    LftpPut16(v, 0);
+    LftpPutMatrix(v);
+    LftpPut32(v, video ? t->width << 16 : 0);
+    LftpPut32(v, video ? t->height << 16 : 0);
+    LftpBoxEnd(v, tkhd);
+
+    size_t mdia = LftpBoxBegin(v, "mdia");
+
+    size_t mdhd = LftpFullBoxBegin(v, "mdhd", 0, 0);
+    LftpPutZero(v, 8);
+    LftpPut32(v, t->timescale);
+    LftpPut32(v, 0);
+    LftpPut16(v, 0x55c4);       // "und"
+    LftpPut16(v, 0);
+    LftpBoxEnd(v, mdhd);
+
+    size_t hdlr = LftpFullBoxBegin(v, "hdlr", 0, 0);
+    LftpPut32(v, 0);
+    LftpPutBytes(v, (const unsigned char*)(video ? "vide" : "soun"), 4);
+    LftpPutZero(v, 12);
+    const char* name = video ? "VideoHandler" : "SoundHandler";
+    LftpPutBytes(v, (const unsigned char*)name, strlen(name) + 1);
+    LftpBoxEnd(v, hdlr);
+
+    size_t minf = LftpBoxBegin(v, "minf");
+    if (video) {
+        size_t vmhd = LftpFullBoxBegin(v, "vmhd", 0, 1);
+        LftpPutZero(v, 8);
+        LftpBoxEnd(v, vmhd);
+    } else {
+        size_t smhd = LftpFullBoxBegin(v, "smhd", 0, 0);
+        LftpPutZero(v, 4);
+        LftpBoxEnd(v, smhd);
+    }
+
+    size_t dinf = LftpBoxBegin(v, "dinf");
+    size_t dref = LftpFullBoxBegin(v, "dref", 0, 0);
+    LftpPut32(v, 1);
+    size_t url = LftpFullBoxBegin(v, "url ", 0, 1);
+    LftpBoxEnd(v, url);
+    LftpBoxEnd(v, dref);
+    LftpBoxEnd(v, dinf);
+
+    size_t stbl = LftpBoxBegin(v, "stbl");
+    size_t stsd = LftpFullBoxBegin(v, "stsd", 0, 0);
+    LftpPut32(v, 1);
+    if (video) {
+        LftpPutVideoEntry(v, t);
+    } else {
+        LftpPutAudioEntry(v, t);
+    }
+    LftpBoxEnd(v, stsd);
+
+    // sample tables are empty, samples live in the fragments
+    const char* empty[] = { "stts", "stsc", "stco" };
+    for (int i = 0; i < 3; i++) {
+        size_t box = LftpFullBoxBegin(v, empty[i], 0, 0);
+        LftpPut32(v, 0);
+        LftpBoxEnd(v, box);
+    }
+    size_t stsz = LftpFullBoxBegin(v, "stsz", 0, 0);
+    LftpPut32(v, 0);
+    LftpPut32(v, 0);
+    LftpBoxEnd(v, stsz);
+    LftpBoxEnd(v, stbl);
+
+    LftpBoxEnd(v, minf);
+    LftpBoxEnd(v, mdia);
+    LftpBoxEnd(v, trak);
+}
+
+/* ---------------------------------------------------------------------- */
+/* fragments                                                               */
+
+static int LftpRemuxEmit(LftpRemux* r)
+{
+    int ret = r->output(r->ctx, r->out.data(), r->out.size());
+
+    r->out.clear();
+    if (ret != 0) {
+        r->failed = true;
+    }
+
+    return ret;
+}
+
+static bool LftpRemuxHasVideo(LftpRemux* r)
+{
+    return r->video.pid >= 0;
+}
+
+static bool LftpRemuxHasAudio(LftpRemux* r)
+{
+    return r->audio.pid >= 0;
+}
+
+static int LftpRemuxWriteInit(LftpRemux* r)
+{
+    vector<unsigned char>& v = r->out;
+
+    size_t ftyp = LftpBoxBegin(v, "ftyp");
+    LftpPutBytes(v, (const unsigned char*)"isom", 4);
+    LftpPut32(v, 0x200);
+    LftpPutBytes(v, (const unsigned char*)"isomiso6avc1mp41", 16);
+    LftpBoxEnd(v, ftyp);
+
+    size_t moov = LftpBoxBegin(v, "moov");
+
+    size_t mvhd = LftpFullBoxBegin(v, "mvhd", 0, 0);
+    LftpPutZero(v, 8);
+    LftpPut32(v, 1000);
+    LftpPut32(v, 0);
+    LftpPut32(v, 0x00010000);   // rate 1.0
+    LftpPut16(v, 0x0100);       // volume 1.0
+    LftpPutZero(v, 10);
+    LftpPutMatrix(v);
+    LftpPutZero(v, 24);
+    LftpPut32(v, 3);            // next_track_ID
+    LftpBoxEnd(v, mvhd);
+
+    if (LftpRemuxHasVideo(r)) {
+        LftpPutTrak(v, &r->video, true);
+    }
+    if (LftpRemuxHasAudio(r)) {
+        LftpPutTrak(v, &r->audio, false);
+    }
+
+    size_t mvex = LftpBoxBegin(v, "mvex");
+    LftpRemuxTrack* tracks[2] = { &r->video, &r->audio };
+    for (int i = 0; i < 2; i++) {
+        if (tracks[i]->pid < 0) {
+            continue;
+        }
+        size_t trex = LftpFullBoxBegin(v, "trex", 0, 0);
+        LftpPut32(v, tracks[i]->id);
+        LftpPut32(v, 1);
+        LftpPutZero(v, 12);
+        LftpBoxEnd(v, trex);
+    }
+    LftpBoxEnd(v, mvex);
+
+    LftpBoxEnd(v, moov);
+
+    r->init_written = true;
+
+    return LftpRemuxEmit(r);
+}
+
+static int LftpRemuxFlush(LftpRemux* r)
+{
+    if (!r->init_written) {
+        if (LftpRemuxHasVideo(r) && !r->video.configured) {
+            return 0;
+        }
+        if (LftpRemuxHasAudio(r) && !r->audio.configured) {
+            unsigned long long pending = 0;
+            for (size_t i = 0; i < r->video.samples.size(); i++) {
+                pending += r->video.samples[i].duration;
+            }
+            if (pending < LFTP_REMUX_AUDIO_WAIT) {
+                return 0;
+            }
+            LFTP_LOG("no aac config found, remux video only");
+            r->audio.pid = -1;
+        }
+        if (LftpRemuxWriteInit(r) != 0) {
+            return -1;
+        }
+    }
+
+    LftpRemuxTrack* tracks[2] = { &r->video, &r->audio };
+    vector<unsigned char>& v = r->out;
+    size_t offsets[2] = { 0, 0 };
+    size_t data_size = 0;
+
+    if (r->video.samples.empty() && r->audio.samples.empty()) {
+        return 0;
+    }
+
+    size_t moof = LftpBoxBegin(v, "moof");
+    size_t mfhd = LftpFullBoxBegin(v, "mfhd", 0, 0);
+    LftpPut32(v, ++r->sequence);
+    LftpBoxEnd(v, mfhd);
+
+    for (int i = 0; i < 2; i++) {
+        LftpRemuxTrack* t = tracks[i];
+        bool video = (t == &r->video);
+        if (t->pid < 0 || t->samples.empty()) {
+            continue;
+        }
+
+        size_t traf = LftpBoxBegin(v, "traf");
+
+        size_t tfhd = LftpFullBoxBegin(v, "tfhd", 0, 0x020000); // default-base-is-moof
+        LftpPut32(v, t->id);
+        LftpBoxEnd(v, tfhd);
+
+        size_t tfdt = LftpFullBoxBegin(v, "tfdt", 1, 0);
+        LftpPut64(v, t->base_time);
+        LftpBoxEnd(v, tfdt);
+
+        // data offset, duration, size, flags, composition time offset
+        size_t trun = LftpFullBoxBegin(v, "trun", 1, video ? 0x000f01 : 0x000301);
+        LftpPut32(v, t->samples.size());
+        offsets[i] = v.size();
+        LftpPut32(v, data_size);
+        for (size_t j = 0; j < t->samples.size(); j++) {
+            LftpRemuxSample& s = t->samples[j];
+            LftpPut32(v, s.duration);
+            LftpPut32(v, s.size);
+            if (video) {
+                LftpPut32(v, s.sync ? 0x02000000 : 0x01010000);
+                LftpPut32(v, (unsigned int)s.cts);
+            }
+            t->base_time += s.duration;
+        }
+        LftpBoxEnd(v, trun);
+
+        LftpBoxEnd(v, traf);
+
+        data_size += t->data.size();
+    }
+    LftpBoxEnd(v, moof);
+
+    // data offsets are relative to the moof, past the mdat header
+    size_t moof_size = v.size() - moof;
+    for (int i = 0; i < 2; i++) {
+        if (offsets[i]) {
+            unsigned int rel = (v[offsets[i]] << 24) | (v[offsets[i] + 1] << 16)
+                | (v[offsets[i] + 2] << 8) | v[offsets[i] + 3];
+            LftpSet32(v, offsets[i], moof_size + 8 + rel);
+        }
+    }
+
+    LftpPut32(v, 8 + data_size);
+    LftpPutBytes(v, (const unsigned char*)"mdat", 4);
+    for (int i = 0; i < 2; i++) {
+        LftpRemuxTrack* t = tracks[i];
+        if (t->pid >= 0 && t->samples.size()) {
+            LftpPutBytes(v, t->data.data(), t->data.size());
+        }
+        t->samples.clear();
+        t->data.clear();
+    }
+
+    return LftpRemuxEmit(r);
+}
+
+/* ---------------------------------------------------------------------- */
+/* elementary streams                                                      */
+
+static long long LftpRemuxUnwrap(LftpRemuxTrack* t, long long ts)
+{
+    if (!t->have_ts) {
+        t->have_ts = true;
+        t->last_ts = ts;
+        return ts;
+    }
+
+    long long diff = (ts - t->last_ts) & LFTP_TS_MASK;
+    if (diff >= (1LL << 32)) {
+        diff -= (1LL << 33);
+    }
+    t->last_ts += diff;
+
+    return t->last_ts;
+}
+
+static void LftpRemuxVideo(LftpRemux* r, long long pts, long long dts, const unsigned char* p, size_t n)
+{
+    LftpRemuxTrack* t = &r->video;
+    vector<unsigned char> au;
+    bool sync = false;
+
+    dts = LftpRemuxUnwrap(t, dts);
+
+    // annex b to 4 byte length prefixed nal units
+    size_t i = 0;
+    while (i + 3 <= n && !(p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1)) {
+        i++;
+    }
+    while (i + 3 <= n) {
+        size_t begin = i + 3;
+        size_t end = begin;
+        while (end + 3 <= n && !(p[end] == 0 && p[end + 1] == 0 && p[end + 2] == 1)) {
+            end++;
+        }
+        if (end + 3 > n) {
+            end = n;
+        }
+        size_t next = end;
+        while (end > begin && p[end - 1] == 0) {
+            end--;
+        }
+        i = next;
+
+        if (end <= begin) {
+            continue;
+        }
+
+        int type = p[begin] & 0x1f;
+        if (type == 7) {
+            t->sps.assign(p + begin, p + end);
+        } else if (type == 8) {
+            t->pps.assign(p + begin, p + end);
+        } else if (type != 9) {
+            // parameter sets go to avcC, access unit delimiters are dropped
+            if (type == 5) {
+                sync = true;
+            }
+            LftpPut32(au, end - begin);
+            LftpPutBytes(au, p + begin, end - begin);
+        }
+    }
+
+    if (au.empty()) {
+        return;
+    }
+
+    if (!t->configured) {
+        if (!sync || t->sps.size() < 4 || t->pps.empty()) {
+            return;
+        }
+        LftpSpsSize(t->sps, &t->width, &t->height);
+        t->configured = true;
+        r->started = true;
+        r->start = dts;
+        LFTP_LOG("remux video %dx%d", t->width, t->height);
+    }
+
+    if (t->samples.size()) {
+        LftpRemuxSample& last = t->samples.back();
+        last.duration = dts > (long long)last.dts ? dts - last.dts : 1;
+    }
+
+    // a fragment per gop, the key frame starts the next one
+    if (sync && t->samples.size() && LftpRemuxFlush(r) != 0) {
+        return;
+    }
+
+    if (!t->base_set) {
+        t->base_set = true;
+        t->base_time = dts - r->start;
+    }
+
+    LftpRemuxSample s;
+    s.dts = dts;
+    s.cts = (int)(((pts - dts) & LFTP_TS_MASK) >= (1LL << 32) ? 0 : (pts - dts) & LFTP_TS_MASK);
+    s.duration = t->samples.size() ? t->samples.back().duration : LFTP_TS_CLOCK / 25;
+    s.sync = sync;
+    s.size = au.size();
+
+    t->samples.push_back(s);
+    t->data.insert(t->data.end(), au.begin(), au.end());
+}
+
+static void LftpRemuxAudio(LftpRemux* r, long long pts, const unsigned char* p, size_t n)
+{
+    static const int rates[16] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+        16000, 12000, 11025, 8000, 7350, 0, 0, 0 };
+    LftpRemuxTrack* t = &r->audio;
+
+    pts = LftpRemuxUnwrap(t, pts);
+
+    if (LftpRemuxHasVideo(r) && (!r->started || pts < r->start)) {
+        return;
+    }
+
+    size_t i = 0;
+    while (i + 7 <= n) {
+        if (p[i] != 0xff || (p[i + 1] & 0xf0) != 0xf0) {
+            i++;
+            continue;
+        }
+
+        size_t header = (p[i + 1] & 0x01) ? 7 : 9;
+        size_t frame = ((p[i + 3] & 0x03) << 11) | (p[i + 4] << 3) | (p[i + 5] >> 5);
+        if (frame < header || i + frame > n) {
+            break;
+        }
+
+        int profile = p[i + 2] >> 6;
+        int rate_index = (p[i + 2] >> 2) & 0x0f;
+        int channels = ((p[i + 2] & 0x01) << 2) | (p[i + 3] >> 6);
+
+        if (!t->configured) {
+            if (!rates[rate_index]) {
+                return;
+            }
+            t->sample_rate = rates[rate_index];
+            t->channels = channels;
+            t->timescale = t->sample_rate;
+            t->asc[0] = ((profile + 1) << 3) | (rate_index >> 1);
+            t->asc[1] = ((rate_index & 1) << 7) | (channels << 3);
+            t->configured = true;
+            if (!r->started) {
+                r->started = true;
+                r->start = pts;
+            }
+            LFTP_LOG("remux aac %d Hz %d ch", t->sample_rate, t->channels);
+        }
+
+        if (!t->base_set) {
+            t->base_set = true;
+            t->base_time = (pts - r->start) * t->sample_rate / LFTP_TS_CLOCK;
+        }
+
+        LftpRemuxSample s;
+        s.dts = 0;
+        s.cts = 0;
+        s.duration = 1024;
+        s.sync = true;
+        s.size = frame - header;
+
+        t->samples.push_back(s);
+        t->data.insert(t->data.end(), p + i + header, p + i + frame);
+
+        i += frame;
+    }
+
+    // audio only streams are cut about once a second
+    if (!LftpRemuxHasVideo(r) && t->samples.size() * 1024 >= (size_t)t->sample_rate) {
+        LftpRemuxFlush(r);
+    }
+}
+
+static void LftpRemuxPes(LftpRemux* r, LftpRemuxTrack* t)
+{
+    vector<unsigned char>& pes = t->pes;
+
+    if (pes.size() < 9 || pes[0] != 0 || pes[1] != 0 || pes[2] != 1) {
+        pes.clear();
+        return;
+    }
+
+    int flags = pes[7] >> 6;
+    size_t header = 9 + pes[8];
+    if (!(flags & 2) || header > pes.size() || pes.size() < 14) {
+        pes.clear();
+        return;
+    }
+
+    const unsigned char* b = &pes[9];
+    long long pts = ((long long)(b[0] & 0x0e) << 29) | (b[1] << 22) | ((b[2] & 0xfe) << 14)
+        | (b[3] << 7) | (b[4] >> 1);
+    long long dts = pts;
+    if (flags == 3 && pes.size() >= 19) {
+        b = &pes[14];
+        dts = ((long long)(b[0] & 0x0e) << 29) | (b[1] << 22) | ((b[2] & 0xfe) << 14)
+            | (b[3] << 7) | (b[4] >> 1);
+    }
+
+    if (t == &r->video) {
+        LftpRemuxVideo(r, pts, dts, &pes[header], pes.size() - header);
+    } else {
+        LftpRemuxAudio(r, pts, &pes[header], pes.size() - header);
+    }
+
+    pes.clear();
+}
+
+static void LftpRemuxSection(LftpRemux* r, int pid, const unsigned char* p, size_t n)
+{
+    // pointer_field, then table_id and the 12 bit section_length
+    if (n < 1 || (size_t)p[0] + 1 + 3 > n) {
+        return;
+    }
+    size_t skip = 1 + p[0];
+    p += skip;
+    n -= skip;
+
+    size_t len = ((p[1] & 0x0f) << 8) | p[2];
+    if (len < 9 || len + 3 > n) {
+        return;
+    }
+    const unsigned char* end = p + 3 + len - 4; // without crc
+
+    if (pid == 0 && p[0] == 0x00) {
+        for (const unsigned char* e = p + 8; e + 4 <= end; e += 4) {
+            int program = (e[0] << 8) | e[1];
+            if (program) {
+                r->pmt_pid = ((e[2] & 0x1f) << 8) | e[3];
+                break;
+            }
+        }
+    } else if (pid == r->pmt_pid && p[0] == 0x02 && r->video.pid < 0 && r->audio.pid < 0) {
+        size_t info = ((p[10] & 0x0f) << 8) | p[11];
+        for (const unsigned char* e = p + 12 + info; e + 5 <= end;) {
+            int type = e[0];
+            int es_pid = ((e[1] & 0x1f) << 8) | e[2];
+            size_t es_info = ((e[3] & 0x0f) << 8) | e[4];
+
+            if (type == LFTP_TS_STREAM_H264 && r->video.pid < 0) {
+                r->video.pid = es_pid;
+            } else if (type == LFTP_TS_STREAM_AAC && r->audio.pid < 0) {
+                r->audio.pid = es_pid;
+            } else {
+                LFTP_LOG("remux skips stream type 0x%02x pid %d", type, es_pid);
+            }
+            e += 5 + es_info;
+        }
+
+        if (r->video.pid < 0 && r->audio.pid < 0) {
+            LFTP_LOG("no h.264 or aac stream to remux");
+            r->failed = true;
+        }
+        r->video.id = 1;
+        r->audio.id = r->video.pid >= 0 ? 2 : 1;
+    }
+}
+
+static void LftpRemuxPacket(LftpRemux* r, const unsigned char* pkt)
+{
+    int pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+    bool start = pkt[1] & 0x40;
+    int afc = (pkt[3] >> 4) & 0x03;
+    size_t pos = 4;
+
+    if (!(afc & 1)) {
+        return;
+    }
+    if (afc & 2) {
+        pos += 1 + pkt[4];
+        if (pos >= LFTP_TS_PACKET) {
+            return;
+        }
+    }
+
+    const unsigned char* payload = pkt + pos;
+    size_t n = LFTP_TS_PACKET - pos;
+
+    if (pid == 0 || pid == r->pmt_pid) {
+        if (start) {
+            LftpRemuxSection(r, pid, payload, n);
+        }
+        return;
+    }
+
+    LftpRemuxTrack* t = NULL;
+    if (pid == r->video.pid) {
+        t = &r->video;
+    } else if (pid == r->audio.pid) {
+        t = &r->audio;
+    } else {
+        return;
+    }
+
+    if (start) {
+        if (t->pes.size()) {
+            LftpRemuxPes(r, t);
+        }
+    } else if (t->pes.empty()) {
+        // joined in the middle of a pes
+        return;
+    }
+
+    t->pes.insert(t->pes.end(), payload, payload + n);
+}
+
+static void LftpRemuxTrackInit(LftpRemuxTrack* t, unsigned int timescale)
+{
+    t->pid = -1;
+    t->id = 0;
+    t->timescale = timescale;
+    t->have_ts = false;
+    t->last_ts = 0;
+    t->configured = false;
+    t->width = 0;
+    t->height = 0;
+    t->asc[0] = t->asc[1] = 0;
+    t->channels = 0;
+    t->sample_rate = 0;
+    t->base_time = 0;
+    t->base_set = false;
+}
+
+LftpRemux* LftpRemuxCreate(LftpRemuxOutput output, void* ctx)
+{
+    LftpRemux* r = new LftpRemux;
+
+    r->output = output;
+    r->ctx = ctx;
+    r->pkt_len = 0;
+    r->pmt_pid = -1;
+    LftpRemuxTrackInit(&r->video, LFTP_TS_CLOCK);
+    LftpRemuxTrackInit(&r->audio, 0);
+    r->started = false;
+    r->start = 0;
+    r->init_written = false;
+    r->sequence = 0;
+    r->failed = false;
+
+    return r;
+}
+
+int LftpRemuxFeed(LftpRemux* r, const unsigned char* data, size_t len)
+{
+    while (len && !r->failed) {
+        if (r->pkt_len == 0) {
+            // resync on the next sync byte
+            const unsigned char* sync = (const unsigned char*)memchr(data, LFTP_TS_SYNC, len);
+            if (!sync) {
+                return 0;
+            }
+            len -= sync - data;
+            data = sync;
+
+            if (len >= LFTP_TS_PACKET) {
+                LftpRemuxPacket(r, data);
+                data += LFTP_TS_PACKET;
+                len -= LFTP_TS_PACKET;
+                continue;
+            }
+        }
+
+        size_t n = LFTP_TS_PACKET - r->pkt_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(r->pkt + r->pkt_len, data, n);
+        r->pkt_len += n;
+        data += n;
+        len -= n;
+
+        if (r->pkt_len == LFTP_TS_PACKET) {
+            LftpRemuxPacket(r, r->pkt);
+            r->pkt_len = 0;
+        }
+    }
+
+    return r->failed ? -1 : 0;
+}
+
+int LftpRemuxFinish(LftpRemux* r)
+{
+    if (r->failed) {
+        return -1;
+    }
+
+    if (r->video.pes.size()) {
+        LftpRemuxPes(r, &r->video);
+    }
+    if (r->audio.pes.size()) {
+        LftpRemuxPes(r, &r->audio);
+    }
+
+    // too short to ever see the aac config
+    if (!r->init_written && LftpRemuxHasAudio(r) && !r->audio.configured) {
+        r->audio.pid = -1;
+    }
+
+    if (LftpRemuxHasVideo(r) ? !r->video.configured : !r->audio.configured) {
+        LFTP_LOG("nothing to remux");
+        return -1;
+    }
+
+    if (LftpRemuxFlush(r) != 0 || r->failed) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void LftpRemuxDestroy(LftpRemux* r)
+{
+    delete r;
+}
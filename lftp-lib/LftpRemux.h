@@ -0,0 +1,51 @@
+/**
+ * @file LftpRemux.h
+ * @author fox
+ * @brief streaming mpeg-ts to fragmented mp4 remuxer (h.264 + aac)
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPREMUX_H
+#define LFTPREMUX_H
+
+#include <stddef.h>
+
+/**
+ * @brief receives the mp4 byte stream, boxes are handed out in file order
+ *
+ * @return int 0 success, -1 stops the remux
+ */
+typedef int (*LftpRemuxOutput)(void* ctx, const unsigned char* buf, size_t len);
+
+typedef struct _LftpRemux LftpRemux;
+
+/**
+ * @brief create a remuxer, nothing is written until the first video key frame
+ *
+ * @param output
+ * @param ctx passed to output
+ * @return LftpRemux* NULL on failure
+ */
+LftpRemux* LftpRemuxCreate(LftpRemuxOutput output, void* ctx);
+
+/**
+ * @brief push ts bytes, any chunk size, packets may span calls
+ *
+ * @return int 0 success, -1 output failed or the stream can not be remuxed
+ */
+int LftpRemuxFeed(LftpRemux* r, const unsigned char* data, size_t len);
+
+/**
+ * @brief flush the last fragment
+ *
+ * @return int 0 success, -1 fail
+ */
+int LftpRemuxFinish(LftpRemux* r);
+
+void LftpRemuxDestroy(LftpRemux* r);
+
+#endif
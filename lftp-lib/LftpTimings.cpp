@@ -0,0 +1,206 @@
+/**
+ * @file LftpTimings.cpp
+ * @author fox
+ * @brief latency histograms of the upload phases of a session
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "LftpLog.h"
+#include "LftpTimings.h"
+
+static unsigned long long LftpTimingsNowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// values below 2^SUB_BITS get a bucket each, above the top SUB_BITS bits after the msb pick it
+static int LftpHistIndex(unsigned long long ns)
+{
+    if (ns < (1ULL << LFTP_HIST_SUB_BITS)) {
+        return ns;
+    }
+
+    int msb = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (msb - LFTP_HIST_SUB_BITS)) & ((1 << LFTP_HIST_SUB_BITS) - 1);
+
+    return ((msb - LFTP_HIST_SUB_BITS + 1) << LFTP_HIST_SUB_BITS) + sub;
+}
+
+// middle of the bucket, 1/16 of its lower bound off at most
+static double LftpHistValue(int index)
+{
+    if (index < (1 << LFTP_HIST_SUB_BITS)) {
+        return index;
+    }
+
+    int msb = (index >> LFTP_HIST_SUB_BITS) + LFTP_HIST_SUB_BITS - 1;
+    int sub = index & ((1 << LFTP_HIST_SUB_BITS) - 1);
+    double width = (double)(1ULL << (msb - LFTP_HIST_SUB_BITS));
+
+    return (double)(1ULL << msb) + sub * width + width / 2;
+}
+
+static double LftpHistQuantile(const LftpHist* h, double q)
+{
+    if (!h->count) {
+        return 0;
+    }
+
+    unsigned long long rank = (unsigned long long)(q * h->count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    unsigned long long seen = 0;
+    for (int i = 0; i < LFTP_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            double value = LftpHistValue(i);
+            return value < h->max_ns ? value : h->max_ns;
+        }
+    }
+
+    return h->max_ns;
+}
+
+int LftpTimingsInit(LftpTimings* t)
+{
+    memset(t->phases, 0, sizeof(t->phases));
+    t->write_ms = 0;
+
+    return pthread_mutex_init(&t->lock, NULL) == 0 ? 0 : -1;
+}
+
+void LftpTimingsDestroy(LftpTimings* t)
+{
+    pthread_mutex_destroy(&t->lock);
+}
+
+void LftpTimingsAdd(LftpTimings* t, LFTP_PHASE phase, unsigned long long ns)
+{
+    LftpHist* h = &t->phases[phase];
+
+    pthread_mutex_lock(&t->lock);
+    h->buckets[LftpHistIndex(ns)]++;
+    h->count++;
+    h->sum_ns += ns;
+    if (ns > h->max_ns) {
+        h->max_ns = ns;
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void LftpTimingsGetLocked(LftpTimings* t, LftpStats& stats)
+{
+    for (int i = 0; i < LFTP_PHASE_MAX; i++) {
+        const LftpHist* h = &t->phases[i];
+        LftpPhaseStats* s = &stats.phases[i];
+
+        s->count = h->count;
+        s->total_ms = h->sum_ns / 1e6;
+        s->p50_ms = LftpHistQuantile(h, 0.50) / 1e6;
+        s->p99_ms = LftpHistQuantile(h, 0.99) / 1e6;
+        s->max_ms = h->max_ns / 1e6;
+    }
+}
+
+void LftpTimingsGet(LftpTimings* t, LftpStats& stats)
+{
+    pthread_mutex_lock(&t->lock);
+    LftpTimingsGetLocked(t, stats);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void LftpTimingsPrometheus(FILE* fp, const LftpStats& stats)
+{
+    fprintf(fp, "# HELP lftp_phase_seconds Time spent in each upload phase.\n");
+    fprintf(fp, "# TYPE lftp_phase_seconds summary\n");
+    for (int i = 0; i < LFTP_PHASE_MAX; i++) {
+        const LftpPhaseStats* s = &stats.phases[i];
+        const char* name = LftpPhaseName((LFTP_PHASE)i);
+
+        fprintf(fp, "lftp_phase_seconds{phase=\"%s\",quantile=\"0.5\"} %.9g\n", name, s->p50_ms / 1e3);
+        fprintf(fp, "lftp_phase_seconds{phase=\"%s\",quantile=\"0.99\"} %.9g\n", name, s->p99_ms / 1e3);
+        fprintf(fp, "lftp_phase_seconds_sum{phase=\"%s\"} %.9g\n", name, s->total_ms / 1e3);
+        fprintf(fp, "lftp_phase_seconds_count{phase=\"%s\"} %llu\n", name, s->count);
+    }
+
+    fprintf(fp, "# HELP lftp_phase_max_seconds Longest run of each upload phase.\n");
+    fprintf(fp, "# TYPE lftp_phase_max_seconds gauge\n");
+    for (int i = 0; i < LFTP_PHASE_MAX; i++) {
+        fprintf(fp, "lftp_phase_max_seconds{phase=\"%s\"} %.9g\n", LftpPhaseName((LFTP_PHASE)i),
+            stats.phases[i].max_ms / 1e3);
+    }
+}
+
+static void LftpTimingsJson(FILE* fp, const LftpStats& stats)
+{
+    fprintf(fp, "{\n  \"phases\": {\n");
+    for (int i = 0; i < LFTP_PHASE_MAX; i++) {
+        const LftpPhaseStats* s = &stats.phases[i];
+
+        fprintf(fp, "    \"%s\": { \"count\": %llu, \"total_ms\": %.6f, \"p50_ms\": %.6f, \"p99_ms\": %.6f, "
+            "\"max_ms\": %.6f }%s\n", LftpPhaseName((LFTP_PHASE)i), s->count, s->total_ms, s->p50_ms,
+            s->p99_ms, s->max_ms, i + 1 < LFTP_PHASE_MAX ? "," : "");
+    }
+    fprintf(fp, "  }\n}\n");
+}
+
+int LftpTimingsWrite(LftpTimings* t, const string& path, LFTP_STATS_FORMAT format, bool force)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&t->lock);
+
+    unsigned long long now_ms = LftpTimingsNowMs();
+    if (!force && now_ms - t->write_ms < LFTP_TIMINGS_WRITE_MS) {
+        pthread_mutex_unlock(&t->lock);
+        return 0;
+    }
+    t->write_ms = now_ms;
+
+    LftpStats stats;
+    LftpTimingsGetLocked(t, stats);
+
+    // readers see the old file or the new one, never a part
+    string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "we");
+    if (!fp) {
+        LFTP_LOG("open %s failed: %s", tmp.c_str(), strerror(errno));
+        pthread_mutex_unlock(&t->lock);
+        return -1;
+    }
+
+    if (format == LFTP_STATS_JSON) {
+        LftpTimingsJson(fp, stats);
+    } else {
+        LftpTimingsPrometheus(fp, stats);
+    }
+
+    bool failed = ferror(fp) != 0;
+    if (fclose(fp) != 0) {
+        failed = true;
+    }
+
+    if (failed || rename(tmp.c_str(), path.c_str()) != 0) {
+        LFTP_LOG("write %s failed: %s", path.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+        ret = -1;
+    }
+
+    pthread_mutex_unlock(&t->lock);
+
+    return ret;
+}
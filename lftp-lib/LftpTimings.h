@@ -0,0 +1,74 @@
+/**
+ * @file LftpTimings.h
+ * @author fox
+ * @brief latency histograms of the upload phases of a session
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPTIMINGS_H
+#define LFTPTIMINGS_H
+
+#include <pthread.h>
+
+#include <string>
+
+using std::string;
+
+#include "LftpLib.h"
+
+#define LFTP_TIMINGS_WRITE_MS 1000  // the stats file is rewritten at most once per interval
+
+// log-linear buckets, 2^LFTP_HIST_SUB_BITS per power of two of ns
+#define LFTP_HIST_SUB_BITS 3
+#define LFTP_HIST_BUCKETS ((64 - LFTP_HIST_SUB_BITS + 1) << LFTP_HIST_SUB_BITS)
+
+typedef struct _LftpHist {
+    unsigned long long buckets[LFTP_HIST_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+} LftpHist;
+
+/*
+ * One histogram per phase, any thread of the session adds to them. Writes
+ * of the stats file go through the same lock, so they never interleave.
+ */
+typedef struct _LftpTimings {
+    pthread_mutex_t lock;
+    LftpHist phases[LFTP_PHASE_MAX];
+    unsigned long long write_ms;
+} LftpTimings;
+
+/**
+ * @brief empty histograms
+ *
+ * @return int 0 success, -1 fail
+ */
+int LftpTimingsInit(LftpTimings* t);
+
+void LftpTimingsDestroy(LftpTimings* t);
+
+/**
+ * @brief one run of phase that took ns
+ */
+void LftpTimingsAdd(LftpTimings* t, LFTP_PHASE phase, unsigned long long ns);
+
+/**
+ * @brief counts, totals and quantiles of all phases
+ */
+void LftpTimingsGet(LftpTimings* t, LftpStats& stats);
+
+/**
+ * @brief write path.tmp and rename it over path
+ *
+ * @param force false skips the write if the last one is less than
+ * LFTP_TIMINGS_WRITE_MS ago
+ * @return int 0 success or skipped, -1 fail
+ */
+int LftpTimingsWrite(LftpTimings* t, const string& path, LFTP_STATS_FORMAT format, bool force);
+
+#endif
@@ -0,0 +1,205 @@
+/**
+ * @file LftpUring.cpp
+ * @author fox
+ * @brief minimal io_uring ring on the raw syscalls, used by the uring upload engine
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "LftpLog.h"
+#include "LftpUring.h"
+
+// the kernel reads the tails and writes the heads the other side owns
+#define LFTP_URING_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LFTP_URING_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int LftpUringSetup(unsigned int entries, struct io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int LftpUringEnter(int fd, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+int LftpUringInit(LftpUring* ring, unsigned int entries)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = LftpUringSetup(entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_size > ring->sq_size) {
+        ring->sq_size = ring->cq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        LftpUringExit(ring);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            LftpUringExit(ring);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        LftpUringExit(ring);
+        return -1;
+    }
+
+    char* sq = (char*)ring->sq_ptr;
+    ring->sq_head = (unsigned int*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local = *ring->sq_tail;
+
+    char* cq = (char*)ring->cq_ptr;
+    ring->cq_head = (unsigned int*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+void LftpUringExit(LftpUring* ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+bool LftpUringSupported(void)
+{
+    LftpUring ring;
+
+    // seccomp filters and io_uring_disabled fail the setup, not the build
+    if (LftpUringInit(&ring, 2) != 0) {
+        LFTP_LOG("io_uring not available: %s", strerror(errno));
+        return false;
+    }
+    LftpUringExit(&ring);
+
+    return true;
+}
+
+int LftpUringRegisterBuffers(LftpUring* ring, const struct iovec* iov, unsigned int count)
+{
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) == 0 ? 0 : -1;
+}
+
+unsigned int LftpUringSpace(LftpUring* ring)
+{
+    return ring->sq_entries - (ring->sq_local - LFTP_URING_LOAD(ring->sq_head));
+}
+
+struct io_uring_sqe* LftpUringSqe(LftpUring* ring, int op, int fd, const void* addr, unsigned int len,
+    unsigned long long off, unsigned long long user_data)
+{
+    if (!LftpUringSpace(ring)) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    unsigned int index = ring->sq_local & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(unsigned long)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    ring->sq_local++;
+
+    return sqe;
+}
+
+int LftpUringSubmit(LftpUring* ring, unsigned int wait)
+{
+    LFTP_URING_STORE(ring->sq_tail, ring->sq_local);
+
+    // sqes the kernel did not take last time are still between head and tail
+    unsigned int submit = ring->sq_local - LFTP_URING_LOAD(ring->sq_head);
+
+    while (submit || wait) {
+        int ret = LftpUringEnter(ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0 && (errno == EBUSY || errno == EAGAIN)) {
+            // completions have to be reaped first, the caller does that next
+            return 0;
+        } else if (ret < 0) {
+            return -1;
+        }
+
+        submit -= (unsigned int)ret < submit ? ret : submit;
+        if (!submit || !ret) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+bool LftpUringCqe(LftpUring* ring, struct io_uring_cqe* cqe)
+{
+    unsigned int head = *ring->cq_head;
+
+    if (head == LFTP_URING_LOAD(ring->cq_tail)) {
+        return false;
+    }
+
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    LFTP_URING_STORE(ring->cq_head, head + 1);
+
+    return true;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file LftpUring.h
+ * @author fox
+ * @brief minimal io_uring ring on the raw syscalls, used by the uring upload engine
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPURING_H
+#define LFTPURING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+
+/*
+ * One ring, used by one thread. Sqes are queued with LftpUringSqe and go to
+ * the kernel together with the next LftpUringSubmit, completions are taken
+ * one by one with LftpUringCqe.
+ */
+typedef struct _LftpUring {
+    int fd;
+
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned int sq_entries;
+    unsigned int sq_local;      // tail including the queued sqes
+
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;               // sq_ptr with IORING_FEAT_SINGLE_MMAP
+    size_t cq_size;
+    size_t sqes_size;
+} LftpUring;
+
+/**
+ * @brief create a ring with at least entries submission slots
+ *
+ * @return int 0 success, -1 fail (errno set, ENOSYS without io_uring)
+ */
+int LftpUringInit(LftpUring* ring, unsigned int entries);
+
+void LftpUringExit(LftpUring* ring);
+
+/**
+ * @brief true if the kernel lets this process create a ring
+ */
+bool LftpUringSupported(void);
+
+/**
+ * @brief register buffers for IORING_OP_READ_FIXED, buf_index is the index in iov
+ *
+ * @return int 0 success, -1 fail
+ */
+int LftpUringRegisterBuffers(LftpUring* ring, const struct iovec* iov, unsigned int count);
+
+/**
+ * @brief free sqes, check before queueing a linked chain so it is never cut
+ */
+unsigned int LftpUringSpace(LftpUring* ring);
+
+/**
+ * @brief next free sqe, cleared and filled in, queued until LftpUringSubmit
+ *
+ * @return struct io_uring_sqe* NULL the submission queue is full
+ */
+struct io_uring_sqe* LftpUringSqe(LftpUring* ring, int op, int fd, const void* addr, unsigned int len,
+    unsigned long long off, unsigned long long user_data);
+
+/**
+ * @brief submit all queued sqes with one syscall and wait for completions
+ *
+ * @param wait completions to wait for, 0 returns at once
+ * @return int 0 success, -1 fail
+ */
+int LftpUringSubmit(LftpUring* ring, unsigned int wait);
+
+/**
+ * @brief take the oldest completion
+ *
+ * @return true cqe filled in
+ * @return false none waiting
+ */
+bool LftpUringCqe(LftpUring* ring, struct io_uring_cqe* cqe);
+
+#endif
@@ -0,0 +1,573 @@
+/**
+ * @file LftpBenchFtpd.cpp
+ * @author fox
+ * @brief in-process ftp server the upload benchmark sends to
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <set>
+#include <string>
+
+using std::set;
+using std::string;
+
+#include "../LftpCrc.h"
+#include "LftpBenchFtpd.h"
+
+#define BENCH_FTPD_LINE_MAX 1024
+#define BENCH_FTPD_BUF_SIZE (256 * 1024)
+
+// a client that asked for a data connection and never opened it
+#define BENCH_FTPD_ACCEPT_TIMEOUT_MS 10000
+
+struct _BenchFtpd {
+    string root;
+    int listen_fd;
+    int port;
+    pthread_t tid;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    set<int> fds;           // open sockets, shut down on stop, under lock
+    int conns;              // running connection threads, under lock
+    bool stopping;          // under lock
+
+    std::atomic<double> first_ns;
+    std::atomic<unsigned long long> bytes;
+};
+
+typedef struct _BenchFtpdConn {
+    BenchFtpd* ftpd;
+    int fd;
+    int pasv_fd;
+    string cwd;
+    unsigned long long rest;
+
+    char buf[BENCH_FTPD_LINE_MAX];
+    size_t len;
+} BenchFtpdConn;
+
+static double BenchFtpdNowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// sockets are registered so stop can shut them down, closed under the same lock
+static void BenchFtpdAddFd(BenchFtpd* ftpd, int fd)
+{
+    pthread_mutex_lock(&ftpd->lock);
+    if (ftpd->stopping) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    ftpd->fds.insert(fd);
+    pthread_mutex_unlock(&ftpd->lock);
+}
+
+static void BenchFtpdCloseFd(BenchFtpd* ftpd, int fd)
+{
+    if (fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&ftpd->lock);
+    ftpd->fds.erase(fd);
+    close(fd);
+    pthread_mutex_unlock(&ftpd->lock);
+}
+
+static int BenchFtpdReply(BenchFtpdConn* c, const char* format, ...)
+{
+    char line[BENCH_FTPD_LINE_MAX];
+    va_list args;
+
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line) - 2, format, args);
+    va_end(args);
+
+    if (n < 0) {
+        return -1;
+    }
+    if (n > (int)sizeof(line) - 3) {
+        n = sizeof(line) - 3;
+    }
+    line[n++] = '\r';
+    line[n++] = '\n';
+
+    return send(c->fd, line, n, MSG_NOSIGNAL) == n ? 0 : -1;
+}
+
+static int BenchFtpdReadLine(BenchFtpdConn* c, string& line)
+{
+    while (true) {
+        char* nl = (char*)memchr(c->buf, '\n', c->len);
+        if (nl) {
+            size_t n = nl - c->buf;
+            line.assign(c->buf, n && nl[-1] == '\r' ? n - 1 : n);
+            c->len -= n + 1;
+            memmove(c->buf, nl + 1, c->len);
+            return 0;
+        }
+
+        if (c->len == sizeof(c->buf)) {
+            return -1;
+        }
+
+        ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        c->len += n;
+    }
+}
+
+// path as seen by the client, "" when it leaves the root
+static string BenchFtpdVirtual(BenchFtpdConn* c, const string& arg)
+{
+    string path = arg.size() && arg[0] == '/' ? arg : c->cwd + "/" + arg;
+    string out;
+    size_t pos = 0;
+
+    while (pos < path.size()) {
+        size_t end = path.find('/', pos);
+        if (end == string::npos) {
+            end = path.size();
+        }
+        string part = path.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (part.empty() || part == ".") {
+            continue;
+        }
+        if (part == "..") {
+            return "";
+        }
+        out += "/" + part;
+    }
+
+    return out.empty() ? "/" : out;
+}
+
+static string BenchFtpdLocal(BenchFtpdConn* c, const string& arg)
+{
+    string path = BenchFtpdVirtual(c, arg);
+
+    return path.empty() ? path : c->ftpd->root + path;
+}
+
+static int BenchFtpdPassive(BenchFtpdConn* c, bool extended)
+{
+    BenchFtpdCloseFd(c->ftpd, c->pasv_fd);
+
+    c->pasv_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->pasv_fd < 0) {
+        return BenchFtpdReply(c, "425 no socket");
+    }
+    BenchFtpdAddFd(c->ftpd, c->pasv_fd);
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(c->pasv_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(c->pasv_fd, 1) != 0
+        || getsockname(c->pasv_fd, (struct sockaddr*)&addr, &len) != 0) {
+        BenchFtpdCloseFd(c->ftpd, c->pasv_fd);
+        c->pasv_fd = -1;
+        return BenchFtpdReply(c, "425 can not listen");
+    }
+
+    int port = ntohs(addr.sin_port);
+    if (extended) {
+        return BenchFtpdReply(c, "229 Entering Extended Passive Mode (|||%d|)", port);
+    }
+
+    return BenchFtpdReply(c, "227 Entering Passive Mode (127,0,0,1,%d,%d)", port >> 8, port & 0xff);
+}
+
+static int BenchFtpdAccept(BenchFtpdConn* c)
+{
+    if (c->pasv_fd < 0) {
+        return -1;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = c->pasv_fd;
+    pfd.events = POLLIN;
+
+    int fd = -1;
+    if (poll(&pfd, 1, BENCH_FTPD_ACCEPT_TIMEOUT_MS) == 1) {
+        fd = accept(c->pasv_fd, NULL, NULL);
+    }
+
+    BenchFtpdCloseFd(c->ftpd, c->pasv_fd);
+    c->pasv_fd = -1;
+
+    if (fd >= 0) {
+        BenchFtpdAddFd(c->ftpd, fd);
+    }
+
+    return fd;
+}
+
+static int BenchFtpdStor(BenchFtpdConn* c, const string& arg)
+{
+    BenchFtpd* ftpd = c->ftpd;
+    string path = BenchFtpdLocal(c, arg);
+    unsigned long long rest = c->rest;
+
+    c->rest = 0;
+
+    int fd = path.empty() ? -1 : open(path.c_str(), O_WRONLY | O_CREAT | (rest ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        BenchFtpdCloseFd(ftpd, c->pasv_fd);
+        c->pasv_fd = -1;
+        return BenchFtpdReply(c, "553 can not create %s", arg.c_str());
+    }
+    if (rest && ftruncate(fd, rest) != 0) {
+        close(fd);
+        return BenchFtpdReply(c, "553 can not restart %s", arg.c_str());
+    }
+
+    if (BenchFtpdReply(c, "150 Ok to send data.") != 0) {
+        close(fd);
+        return -1;
+    }
+
+    int data = BenchFtpdAccept(c);
+    if (data < 0) {
+        close(fd);
+        return BenchFtpdReply(c, "425 no data connection");
+    }
+
+    char* buf = (char*)malloc(BENCH_FTPD_BUF_SIZE);
+    off_t pos = rest;
+    bool failed = false;
+
+    while (true) {
+        ssize_t n = recv(data, buf, BENCH_FTPD_BUF_SIZE, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            failed = n < 0;
+            break;
+        }
+
+        double zero = 0;
+        ftpd->first_ns.compare_exchange_strong(zero, BenchFtpdNowNs());
+        ftpd->bytes += n;
+
+        if (pwrite(fd, buf, n, pos) != n) {
+            failed = true;
+            break;
+        }
+        pos += n;
+    }
+
+    free(buf);
+    close(fd);
+    BenchFtpdCloseFd(ftpd, data);
+
+    return failed ? BenchFtpdReply(c, "426 Failure writing network stream.")
+                  : BenchFtpdReply(c, "226 Transfer complete.");
+}
+
+static int BenchFtpdList(BenchFtpdConn* c, bool mlsd)
+{
+    string path = BenchFtpdLocal(c, ".");
+    DIR* dir = path.empty() ? NULL : opendir(path.c_str());
+
+    if (!dir) {
+        BenchFtpdCloseFd(c->ftpd, c->pasv_fd);
+        c->pasv_fd = -1;
+        return BenchFtpdReply(c, "550 can not list");
+    }
+
+    string out;
+    struct dirent* e;
+    while ((e = readdir(dir))) {
+        struct stat st;
+        if (e->d_name[0] == '.' || fstatat(dirfd(dir), e->d_name, &st, 0) != 0) {
+            continue;
+        }
+
+        char line[BENCH_FTPD_LINE_MAX];
+        bool is_dir = S_ISDIR(st.st_mode);
+        if (mlsd) {
+            snprintf(line, sizeof(line), "type=%s;size=%lld; %s\r\n", is_dir ? "dir" : "file",
+                (long long)st.st_size, e->d_name);
+        } else {
+            snprintf(line, sizeof(line), "%crw-r--r-- 1 ftp ftp %lld Jan 01 00:00 %s\r\n", is_dir ? 'd' : '-',
+                (long long)st.st_size, e->d_name);
+        }
+        out += line;
+    }
+    closedir(dir);
+
+    if (BenchFtpdReply(c, "150 Here comes the directory listing.") != 0) {
+        return -1;
+    }
+
+    int data = BenchFtpdAccept(c);
+    if (data < 0) {
+        return BenchFtpdReply(c, "425 no data connection");
+    }
+
+    bool failed = send(data, out.data(), out.size(), MSG_NOSIGNAL) != (ssize_t)out.size();
+    BenchFtpdCloseFd(c->ftpd, data);
+
+    return failed ? BenchFtpdReply(c, "426 Failure writing network stream.")
+                  : BenchFtpdReply(c, "226 Directory send OK.");
+}
+
+static int BenchFtpdCrc(BenchFtpdConn* c, const string& arg)
+{
+    string path = BenchFtpdLocal(c, arg);
+    int fd = path.empty() ? -1 : open(path.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return BenchFtpdReply(c, "550 no such file");
+    }
+
+    char* buf = (char*)malloc(BENCH_FTPD_BUF_SIZE);
+    unsigned int crc = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, BENCH_FTPD_BUF_SIZE)) > 0) {
+        crc = LftpCrc32(crc, buf, n);
+    }
+    free(buf);
+    close(fd);
+
+    return BenchFtpdReply(c, "250 %08X", crc);
+}
+
+static int BenchFtpdCommand(BenchFtpdConn* c, const string& line)
+{
+    size_t space = line.find(' ');
+    string cmd = line.substr(0, space);
+    string arg = space == string::npos ? "" : line.substr(space + 1);
+    struct stat st;
+
+    for (size_t i = 0; i < cmd.size(); i++) {
+        cmd[i] = toupper(cmd[i]);
+    }
+
+    if (cmd == "USER") {
+        return BenchFtpdReply(c, "331 Please specify the password.");
+    } else if (cmd == "PASS") {
+        return BenchFtpdReply(c, "230 Login successful.");
+    } else if (cmd == "TYPE") {
+        return BenchFtpdReply(c, "200 Switching to Binary mode.");
+    } else if (cmd == "PWD") {
+        return BenchFtpdReply(c, "257 \"%s\"", c->cwd.c_str());
+    } else if (cmd == "CWD") {
+        string path = BenchFtpdVirtual(c, arg);
+        if (path.empty() || stat((c->ftpd->root + path).c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            return BenchFtpdReply(c, "550 Failed to change directory.");
+        }
+        c->cwd = path;
+        return BenchFtpdReply(c, "250 Directory successfully changed.");
+    } else if (cmd == "MKD") {
+        string path = BenchFtpdLocal(c, arg);
+        if (path.empty() || mkdir(path.c_str(), 0755) != 0) {
+            return BenchFtpdReply(c, "550 Create directory operation failed.");
+        }
+        return BenchFtpdReply(c, "257 \"%s\" created", BenchFtpdVirtual(c, arg).c_str());
+    } else if (cmd == "SIZE") {
+        string path = BenchFtpdLocal(c, arg);
+        if (path.empty() || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            return BenchFtpdReply(c, "550 Could not get file size.");
+        }
+        return BenchFtpdReply(c, "213 %lld", (long long)st.st_size);
+    } else if (cmd == "EPSV" || cmd == "PASV") {
+        return BenchFtpdPassive(c, cmd == "EPSV");
+    } else if (cmd == "REST") {
+        c->rest = strtoull(arg.c_str(), NULL, 10);
+        return BenchFtpdReply(c, "350 Restart position accepted (%llu).", c->rest);
+    } else if (cmd == "STOR") {
+        return BenchFtpdStor(c, arg);
+    } else if (cmd == "MLSD" || cmd == "LIST") {
+        return BenchFtpdList(c, cmd == "MLSD");
+    } else if (cmd == "XCRC") {
+        return BenchFtpdCrc(c, arg);
+    } else if (cmd == "NOOP") {
+        return BenchFtpdReply(c, "200 NOOP ok.");
+    } else if (cmd == "QUIT") {
+        BenchFtpdReply(c, "221 Goodbye.");
+        return -1;
+    }
+
+    return BenchFtpdReply(c, "502 Command not implemented.");
+}
+
+static void* BenchFtpdConnThread(void* arg)
+{
+    BenchFtpdConn* c = (BenchFtpdConn*)arg;
+    BenchFtpd* ftpd = c->ftpd;
+    string line;
+
+    if (BenchFtpdReply(c, "220 bench ftpd") == 0) {
+        while (BenchFtpdReadLine(c, line) == 0 && BenchFtpdCommand(c, line) == 0) {
+        }
+    }
+
+    BenchFtpdCloseFd(ftpd, c->pasv_fd);
+    BenchFtpdCloseFd(ftpd, c->fd);
+    delete c;
+
+    pthread_mutex_lock(&ftpd->lock);
+    ftpd->conns--;
+    pthread_cond_broadcast(&ftpd->cond);
+    pthread_mutex_unlock(&ftpd->lock);
+
+    return NULL;
+}
+
+static void* BenchFtpdAcceptThread(void* arg)
+{
+    BenchFtpd* ftpd = (BenchFtpd*)arg;
+
+    while (true) {
+        int fd = accept(ftpd->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+        // replies go out at once, like the commands of the client
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        BenchFtpdConn* c = new BenchFtpdConn;
+        c->ftpd = ftpd;
+        c->fd = fd;
+        c->pasv_fd = -1;
+        c->cwd = "/";
+        c->rest = 0;
+        c->len = 0;
+
+        pthread_mutex_lock(&ftpd->lock);
+        ftpd->conns++;
+        pthread_mutex_unlock(&ftpd->lock);
+        BenchFtpdAddFd(ftpd, fd);
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, BenchFtpdConnThread, c) != 0) {
+            BenchFtpdCloseFd(ftpd, fd);
+            delete c;
+            pthread_mutex_lock(&ftpd->lock);
+            ftpd->conns--;
+            pthread_mutex_unlock(&ftpd->lock);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    return NULL;
+}
+
+BenchFtpd* BenchFtpdStart(const char* root)
+{
+    BenchFtpd* ftpd = new BenchFtpd;
+
+    ftpd->root = root;
+    ftpd->conns = 0;
+    ftpd->stopping = false;
+    ftpd->first_ns = 0;
+    ftpd->bytes = 0;
+    pthread_mutex_init(&ftpd->lock, NULL);
+    pthread_cond_init(&ftpd->cond, NULL);
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    ftpd->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (ftpd->listen_fd < 0 || bind(ftpd->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(ftpd->listen_fd, 64) != 0 || getsockname(ftpd->listen_fd, (struct sockaddr*)&addr, &len) != 0
+        || pthread_create(&ftpd->tid, NULL, BenchFtpdAcceptThread, ftpd) != 0) {
+        if (ftpd->listen_fd >= 0) {
+            close(ftpd->listen_fd);
+        }
+        pthread_mutex_destroy(&ftpd->lock);
+        pthread_cond_destroy(&ftpd->cond);
+        delete ftpd;
+        return NULL;
+    }
+    ftpd->port = ntohs(addr.sin_port);
+
+    return ftpd;
+}
+
+int BenchFtpdPort(BenchFtpd* ftpd)
+{
+    return ftpd->port;
+}
+
+void BenchFtpdReset(BenchFtpd* ftpd)
+{
+    ftpd->first_ns = 0;
+    ftpd->bytes = 0;
+}
+
+double BenchFtpdFirstByteNs(BenchFtpd* ftpd)
+{
+    return ftpd->first_ns;
+}
+
+unsigned long long BenchFtpdBytes(BenchFtpd* ftpd)
+{
+    return ftpd->bytes;
+}
+
+void BenchFtpdStop(BenchFtpd* ftpd)
+{
+    // wakes the accept thread
+    shutdown(ftpd->listen_fd, SHUT_RDWR);
+    pthread_join(ftpd->tid, NULL);
+    close(ftpd->listen_fd);
+
+    pthread_mutex_lock(&ftpd->lock);
+    ftpd->stopping = true;
+    for (set<int>::iterator it = ftpd->fds.begin(); it != ftpd->fds.end(); ++it) {
+        shutdown(*it, SHUT_RDWR);
+    }
+    while (ftpd->conns) {
+        pthread_cond_wait(&ftpd->cond, &ftpd->lock);
+    }
+    pthread_mutex_unlock(&ftpd->lock);
+
+    pthread_mutex_destroy(&ftpd->lock);
+    pthread_cond_destroy(&ftpd->cond);
+    delete ftpd;
+}
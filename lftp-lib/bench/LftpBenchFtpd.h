@@ -0,0 +1,56 @@
+/**
+ * @file LftpBenchFtpd.h
+ * @author fox
+ * @brief in-process ftp server the upload benchmark sends to
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+
+#ifndef LFTPBENCHFTPD_H
+#define LFTPBENCHFTPD_H
+
+/*
+ * Just what the native engine uses: USER, PASS, TYPE, CWD, MKD, SIZE, EPSV,
+ * PASV, REST, STOR, MLSD, LIST, XCRC and QUIT. It listens on an ephemeral port
+ * of 127.0.0.1, every connection runs on its own thread and files are written
+ * below root, put it on tmpfs so the disk is not measured.
+ */
+typedef struct _BenchFtpd BenchFtpd;
+
+/**
+ * @brief start listening
+ *
+ * @param root existing directory, "/" of the server
+ * @return BenchFtpd* NULL on failure
+ */
+BenchFtpd* BenchFtpdStart(const char* root);
+
+/**
+ * @brief the port it listens on
+ */
+int BenchFtpdPort(BenchFtpd* ftpd);
+
+/**
+ * @brief forget the first byte time and the byte count, before a run
+ */
+void BenchFtpdReset(BenchFtpd* ftpd);
+
+/**
+ * @brief CLOCK_MONOTONIC in ns of the first data byte after the reset, 0 none yet
+ */
+double BenchFtpdFirstByteNs(BenchFtpd* ftpd);
+
+/**
+ * @brief data bytes stored since the reset
+ */
+unsigned long long BenchFtpdBytes(BenchFtpd* ftpd);
+
+/**
+ * @brief close all connections, wait for their threads and free the server
+ */
+void BenchFtpdStop(BenchFtpd* ftpd);
+
+#endif
@@ -0,0 +1,109 @@
+/**
+ * @file LftpCrcBench.cpp
+ * @author fox
+ * @brief cost of the upload checksums in bytes per cycle
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../LftpCrc.h"
+
+typedef unsigned int (*BenchCrc)(unsigned int crc, const void* buf, size_t len);
+
+static double BenchNowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// tsc ticks on x86, they run at the nominal clock, not the boost clock
+static unsigned long long BenchCycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void BenchRun(const char* name, BenchCrc crc_func, const unsigned char* buf, size_t size, int rounds)
+{
+    unsigned int crc = 0;
+
+    // warm up the tables and the cache
+    crc_func(0, buf, size);
+
+    double start = BenchNowNs();
+    unsigned long long cycles = BenchCycles();
+    for (int r = 0; r < rounds; r++) {
+        crc = crc_func(crc, buf, size);
+    }
+    cycles = BenchCycles() - cycles;
+    double ns = BenchNowNs() - start;
+
+    double bytes = (double)size * rounds;
+    if (cycles) {
+        printf("%-18s: %8.2f GB/s %6.2f bytes/cycle  crc %08x\n", name, bytes / ns, bytes / cycles, crc);
+    } else {
+        printf("%-18s: %8.2f GB/s %6s bytes/cycle  crc %08x\n", name, bytes / ns, "n/a", crc);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    // one upload chunk, it stays in the cache like the chunk just sent
+    size_t size = argc > 1 ? atoi(argv[1]) : 64 * 1024;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+
+    unsigned char* buf = (unsigned char*)malloc(size);
+    srand(1);
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = rand();
+    }
+
+    // "123456789" is the check value of both crcs
+    if (LftpCrc32c(0, "123456789", 9) != 0xe3069283 || LftpCrc32cSoftware(0, "123456789", 9) != 0xe3069283
+        || LftpCrc32(0, "123456789", 9) != 0xcbf43926 || LftpCrc32Software(0, "123456789", 9) != 0xcbf43926) {
+        printf("check value mismatch\n");
+        return 1;
+    }
+
+    // every length and offset the hardware paths split differently, continued from a running crc
+    for (size_t off = 0; off < 16 && off < size; off++) {
+        for (size_t len = 0; off + len <= size && len < 600; len++) {
+            if (LftpCrc32c(off, buf + off, len) != LftpCrc32cSoftware(off, buf + off, len)
+                || LftpCrc32(off, buf + off, len) != LftpCrc32Software(off, buf + off, len)) {
+                printf("hardware mismatch at offset %zu length %zu\n", off, len);
+                return 1;
+            }
+        }
+    }
+
+    char name[64];
+    char name32[64];
+    snprintf(name, sizeof(name), "crc32c %s", LftpCrc32cName());
+    snprintf(name32, sizeof(name32), "crc32 %s", LftpCrc32Name());
+
+    printf("buffer             : %zu bytes x %d\n", size, rounds);
+    BenchRun(name, LftpCrc32c, buf, size, rounds);
+    BenchRun("crc32c software", LftpCrc32cSoftware, buf, size, rounds);
+    BenchRun(name32, LftpCrc32, buf, size, rounds);
+    BenchRun("crc32 software", LftpCrc32Software, buf, size, rounds);
+
+    free(buf);
+
+    return 0;
+}
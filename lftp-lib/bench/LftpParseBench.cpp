@@ -0,0 +1,142 @@
+/**
+ * @file LftpParseBench.cpp
+ * @author fox
+ * @brief compare LftpParseProgressLine with the former std::regex parser
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <fstream>
+#include <regex>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+#include "../LftpParse.h"
+
+typedef struct _BenchResult {
+    int type;
+    unsigned long long bytes;
+    string rate;
+    string eta;
+} BenchResult;
+
+static double BenchNowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// the parser LftpParseOutput used before, kept verbatim as the reference
+static void BenchRegexParse(const string& output, BenchResult* r)
+{
+    std::smatch match;
+
+    r->type = LFTP_LINE_OTHER;
+
+    if (output.find("Sending") != std::string::npos) {
+        std::regex pattern(R"(`(.*?)' at (\d+) \((\d+)%\) (\d+\.\d+\w\/s) eta:(\w+) )");
+        std::regex pattern_ex(R"(`(.*?)' at (\d+) \((\d+)%\) )");
+
+        r->type = LFTP_LINE_SENDING;
+
+        if (std::regex_search(output, match, pattern)) {
+            r->bytes = atoll(match[2].str().c_str());
+            r->rate = match[4].str();
+            r->eta = match[5].str();
+        } else if (std::regex_search(output, match, pattern_ex)) {
+            r->bytes = atoll(match[2].str().c_str());
+        }
+    } else if (output.find("transferred") != std::string::npos) {
+        std::regex pattern("(\\d+) bytes transferred in (\\d+) seconds? \\(([^)]+)\\)");
+        std::regex pattern_ex("(\\d+) bytes transferred");
+
+        r->type = LFTP_LINE_TRANSFERRED;
+
+        if (std::regex_search(output, match, pattern)) {
+            r->bytes = atoll(match[1].str().c_str());
+            r->rate = match[3].str();
+        } else if (std::regex_search(output, match, pattern_ex)) {
+            r->bytes = atoll(match[1].str().c_str());
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const char* path = argc > 1 ? argv[1] : "bench/lftp-output.txt";
+    int rounds = argc > 2 ? atoi(argv[2]) : 2000;
+
+    std::ifstream in(path);
+    if (!in) {
+        printf("open %s failed\n", path);
+        return 1;
+    }
+
+    vector<string> lines;
+    string line;
+    while (std::getline(in, line)) {
+        if (line.size()) {
+            lines.push_back(line);
+        }
+    }
+
+    // both parsers must agree before timing them
+    int mismatch = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+        BenchResult ref = BenchResult();
+        LftpProgressLine fast;
+
+        BenchRegexParse(lines[i], &ref);
+        LftpParseProgressLine(lines[i].data(), lines[i].size(), &fast);
+
+        if (ref.type != fast.type || ref.bytes != fast.bytes
+            || ref.rate != string(fast.rate.ptr ? fast.rate.ptr : "", fast.rate.len)
+            || ref.eta != string(fast.eta.ptr ? fast.eta.ptr : "", fast.eta.len)) {
+            printf("mismatch: %s\n", lines[i].c_str());
+            mismatch++;
+        }
+    }
+
+    unsigned long long sink = 0;
+    int regex_rounds = rounds / 20 ? rounds / 20 : 1;
+
+    double start = BenchNowNs();
+    for (int r = 0; r < regex_rounds; r++) {
+        for (size_t i = 0; i < lines.size(); i++) {
+            BenchResult ref = BenchResult();
+            BenchRegexParse(lines[i], &ref);
+            sink += ref.bytes;
+        }
+    }
+    double regex_ns = (BenchNowNs() - start) / (regex_rounds * lines.size());
+
+    start = BenchNowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < lines.size(); i++) {
+            LftpProgressLine fast;
+            LftpParseProgressLine(lines[i].data(), lines[i].size(), &fast);
+            sink += fast.bytes;
+        }
+    }
+    double fast_ns = (BenchNowNs() - start) / (rounds * lines.size());
+
+    printf("lines      : %zu (%s)\n", lines.size(), path);
+    printf("mismatch   : %d\n", mismatch);
+    printf("std::regex : %10.1f ns/line\n", regex_ns);
+    printf("LftpParse  : %10.1f ns/line\n", fast_ns);
+    printf("speedup    : %10.1fx\n", regex_ns / fast_ns);
+    printf("checksum   : %llu\n", sink);
+
+    return mismatch ? 1 : 0;
+}
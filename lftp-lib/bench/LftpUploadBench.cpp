@@ -0,0 +1,494 @@
+/**
+ * @file LftpUploadBench.cpp
+ * @author fox
+ * @brief upload workloads against the in-process ftp server
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+using std::map;
+using std::string;
+using std::vector;
+
+#include "../LftpLib.h"
+#include "LftpBenchFtpd.h"
+
+#define BENCH_TS_PACKET 188
+#define BENCH_PID_PMT 0x100
+#define BENCH_PID_VIDEO 0x101
+#define BENCH_FPS 25
+#define BENCH_GOP 25
+
+// status poll while waiting to stop a run
+#define BENCH_POLL_MS 5
+
+typedef struct _BenchWorkload {
+    const char* name;
+    const char* prefix;         // source files are <prefix><n>.ts
+    int files;
+    int frames;                 // per file
+    int frame_bytes;            // p frame, the key frame is four times that
+    int workers;
+    LFTP_EXP_FMT format;
+    unsigned long long stop_after; // bytes the server gets before the run is stopped, 0 never
+    int rounds;
+    int split_parts;            // param.split_parts, the files are split from 1 MB
+} BenchWorkload;
+
+typedef struct _BenchResult {
+    int files;                  // finished with LFTP_STATE_TRANSFERRED
+    unsigned long long bytes;   // received by the server
+    double run_ns;              // start to all_finish
+    double ttfb_ns;             // start to the first byte at the server
+    double stop_ns;             // LftpSessionStop to all_finish
+    bool aborted;
+} BenchResult;
+
+static const BenchWorkload benchWorkloads[] = {
+    // hls sized segments, the per file round trips dominate
+    { "tiny", "tiny", 400, 8, 2048, 4, LFTP_EXP_FMT_TS, 0, 3, 1 },
+    // long recordings, the copy path dominates
+    { "huge", "huge", 2, 4096, 32 * 1024, 2, LFTP_EXP_FMT_TS, 0, 1, 1 },
+    // 30 s recordings remuxed on the way
+    { "mp4", "mp4", 6, 750, 20 * 1024, 2, LFTP_EXP_FMT_MP4, 0, 1, 1 },
+    // stopped while a huge file is on the wire
+    { "abort", "huge", 1, 4096, 32 * 1024, 1, LFTP_EXP_FMT_TS, 32 * 1024 * 1024, 5, 1 },
+    // one huge file as four parts on four connections
+    { "split", "huge", 1, 4096, 32 * 1024, 4, LFTP_EXP_FMT_TS, 0, 3, 4 },
+};
+
+static const unsigned char benchSps[] = { 0x67, 0x42, 0xc0, 0x1e, 0xda, 0x05, 0x07, 0xe4 }; // 320x240 baseline
+static const unsigned char benchPps[] = { 0x68, 0xce, 0x3c, 0x80 };
+
+static double BenchNowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned int BenchRandom(unsigned int* state)
+{
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *state = x;
+}
+
+// crc of the psi sections, msb first, no final xor
+static unsigned int BenchMpegCrc(const unsigned char* p, size_t len)
+{
+    unsigned int crc = 0xffffffff;
+
+    while (len--) {
+        crc ^= (unsigned int)*p++ << 24;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+        }
+    }
+
+    return crc;
+}
+
+static void BenchTsWrite(vector<unsigned char>& out, int pid, unsigned char* cc, const unsigned char* p, size_t n)
+{
+    bool start = true;
+
+    while (n) {
+        unsigned char pkt[BENCH_TS_PACKET];
+        size_t room = BENCH_TS_PACKET - 4;
+        size_t take = std::min(n, room);
+
+        pkt[0] = 0x47;
+        pkt[1] = (start ? 0x40 : 0) | ((pid >> 8) & 0x1f);
+        pkt[2] = pid & 0xff;
+
+        if (take < room) {
+            // stuffing in the adaptation field of the last packet
+            size_t af = room - take;
+            pkt[3] = 0x30 | (*cc & 0x0f);
+            pkt[4] = af - 1;
+            if (af > 1) {
+                pkt[5] = 0;
+                memset(pkt + 6, 0xff, af - 2);
+            }
+        } else {
+            pkt[3] = 0x10 | (*cc & 0x0f);
+        }
+        memcpy(pkt + BENCH_TS_PACKET - take, p, take);
+
+        out.insert(out.end(), pkt, pkt + BENCH_TS_PACKET);
+        (*cc)++;
+        start = false;
+        p += take;
+        n -= take;
+    }
+}
+
+static void BenchTsSection(vector<unsigned char>& out, int pid, unsigned char* cc, const unsigned char* s, size_t n)
+{
+    vector<unsigned char> sec(1, 0); // pointer_field
+    sec.insert(sec.end(), s, s + n);
+
+    unsigned int crc = BenchMpegCrc(s, n);
+    sec.push_back(crc >> 24);
+    sec.push_back(crc >> 16);
+    sec.push_back(crc >> 8);
+    sec.push_back(crc);
+
+    // a section is padded to the end of its packet
+    sec.resize(BENCH_TS_PACKET - 4, 0xff);
+    BenchTsWrite(out, pid, cc, sec.data(), sec.size());
+}
+
+static void BenchPutNal(vector<unsigned char>& es, const unsigned char* nal, size_t n)
+{
+    static const unsigned char start[] = { 0, 0, 0, 1 };
+
+    es.insert(es.end(), start, start + sizeof(start));
+    es.insert(es.end(), nal, nal + n);
+}
+
+/*
+ * A 188 byte aligned ts with one h.264 stream: PAT and PMT before every key
+ * frame, one pes per access unit and slices of random bytes. The remux only
+ * looks at the nal types and the parameter sets, so it takes it like a real
+ * recording.
+ */
+static int BenchWriteTs(const string& path, int frames, int frame_bytes, unsigned int seed)
+{
+    static const unsigned char pat[] = { 0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00, 0x00, 0x01,
+        0xe0 | (BENCH_PID_PMT >> 8), BENCH_PID_PMT & 0xff };
+    static const unsigned char pmt[] = { 0x02, 0xb0, 0x12, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0xe0 | (BENCH_PID_VIDEO >> 8), BENCH_PID_VIDEO & 0xff, 0xf0, 0x00,
+        0x1b, 0xe0 | (BENCH_PID_VIDEO >> 8), BENCH_PID_VIDEO & 0xff, 0xf0, 0x00 };
+    static const unsigned char aud[] = { 0x09, 0xf0 };
+
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        return -1;
+    }
+
+    unsigned char cc_pat = 0, cc_pmt = 0, cc_video = 0;
+    unsigned int state = seed | 1;
+    vector<unsigned char> out, es, pes;
+
+    for (int i = 0; i < frames; i++) {
+        bool key = i % BENCH_GOP == 0;
+        unsigned long long pts = 90000ULL + (unsigned long long)i * 90000 / BENCH_FPS;
+
+        out.clear();
+        if (key) {
+            BenchTsSection(out, 0, &cc_pat, pat, sizeof(pat));
+            BenchTsSection(out, BENCH_PID_PMT, &cc_pmt, pmt, sizeof(pmt));
+        }
+
+        es.clear();
+        BenchPutNal(es, aud, sizeof(aud));
+        if (key) {
+            BenchPutNal(es, benchSps, sizeof(benchSps));
+            BenchPutNal(es, benchPps, sizeof(benchPps));
+        }
+
+        // no zero bytes, they could make a start code
+        size_t n = key ? frame_bytes * 4 : frame_bytes;
+        size_t slice = es.size() + 4;
+        es.resize(slice + n);
+        es[slice - 4] = es[slice - 3] = es[slice - 2] = 0;
+        es[slice - 1] = 1;
+        es[slice] = key ? 0x65 : 0x41;
+        for (size_t k = 1; k < n; k++) {
+            es[slice + k] = (BenchRandom(&state) % 255) + 1;
+        }
+
+        unsigned char header[] = { 0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x05,
+            (unsigned char)(0x21 | ((pts >> 29) & 0x0e)), (unsigned char)(pts >> 22),
+            (unsigned char)(((pts >> 14) & 0xfe) | 1), (unsigned char)(pts >> 7),
+            (unsigned char)(((pts << 1) & 0xfe) | 1) };
+        pes.assign(header, header + sizeof(header));
+        pes.insert(pes.end(), es.begin(), es.end());
+        BenchTsWrite(out, BENCH_PID_VIDEO, &cc_video, pes.data(), pes.size());
+
+        if (fwrite(out.data(), 1, out.size(), fp) != out.size()) {
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+static int BenchRemoveEntry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+    return remove(path);
+}
+
+static void BenchRemoveTree(const string& path)
+{
+    nftw(path.c_str(), BenchRemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static string BenchFileName(const BenchWorkload* wl, int i)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "%s%d.ts", wl->prefix, i);
+
+    return name;
+}
+
+static int BenchPrepare(const BenchWorkload* wl, const string& src)
+{
+    for (int i = 0; i < wl->files; i++) {
+        string path = src + "/" + BenchFileName(wl, i);
+        if (access(path.c_str(), F_OK) == 0) {
+            continue;
+        }
+        if (BenchWriteTs(path, wl->frames, wl->frame_bytes, i + 1) != 0) {
+            fprintf(stderr, "can not write %s\n", path.c_str());
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int BenchRun(const BenchWorkload* wl, LFTP_ENGINE engine, BenchFtpd* ftpd, const string& src,
+    const string& remote, BenchResult* result)
+{
+    char port[16];
+    snprintf(port, sizeof(port), "%d", BenchFtpdPort(ftpd));
+
+    LftpParam param;
+    for (int i = 0; i < wl->files; i++) {
+        param.files.push_back(BenchFileName(wl, i));
+    }
+    param.path = src;
+    param.export_format = wl->format;
+    param.server = "127.0.0.1";
+    param.port = port;
+    param.username = "bench";
+    param.password = "bench";
+    param.remote_path = remote;
+    param.workers = wl->workers;
+    param.engine = engine;
+    param.split_parts = wl->split_parts;
+    param.split_min_bytes = 1024 * 1024;
+
+    LftpSession* session = LftpSessionCreate();
+    if (!session) {
+        return -1;
+    }
+
+    memset(result, 0, sizeof(*result));
+    BenchFtpdReset(ftpd);
+
+    double start = BenchNowNs();
+    double stop = 0;
+    double end = 0;
+
+    if (LftpSessionStart(session, param) != 0) {
+        LftpSessionDestroy(session);
+        return -1;
+    }
+
+    // parts of split files transferred so far, by index
+    map<int, int> parts;
+
+    struct pollfd pfd;
+    pfd.fd = LftpSessionStatusFd(session);
+    pfd.events = POLLIN;
+
+    while (!end && poll(&pfd, 1, wl->stop_after && !stop ? BENCH_POLL_MS : -1) >= 0) {
+        if (wl->stop_after && !stop && BenchFtpdBytes(ftpd) >= wl->stop_after) {
+            stop = BenchNowNs();
+            LftpSessionStop(session);
+        }
+
+        LftpStatus status;
+        while (LftpSessionStatus(session, status)) {
+            // the batch status repeats the state of the last file
+            if (!status.all_finish && status.file_index >= 0 && status.transfer_state == LFTP_STATE_TRANSFERRED
+                && (!status.file_parts || ++parts[status.file_index] == status.file_parts)) {
+                result->files++;
+            }
+            if (status.all_finish) {
+                end = BenchNowNs();
+                result->aborted = status.transfer_state == LFTP_STATE_ABORT;
+            }
+        }
+    }
+
+    LftpSessionDestroy(session);
+
+    double first = BenchFtpdFirstByteNs(ftpd);
+    result->bytes = BenchFtpdBytes(ftpd);
+    result->run_ns = end - start;
+    result->ttfb_ns = first ? first - start : 0;
+    result->stop_ns = stop ? end - stop : 0;
+
+    return end ? 0 : -1;
+}
+
+static void BenchReport(FILE* out, const BenchWorkload* wl, vector<BenchResult>& results)
+{
+    double run = 0, ttfb = 0, stop = 0, stop_max = 0;
+    unsigned long long bytes = 0;
+    int files = 0;
+
+    for (size_t i = 0; i < results.size(); i++) {
+        run += results[i].run_ns;
+        ttfb += results[i].ttfb_ns;
+        stop += results[i].stop_ns;
+        stop_max = std::max(stop_max, results[i].stop_ns);
+        bytes += results[i].bytes;
+        files += results[i].files;
+    }
+
+    int n = results.size();
+    fprintf(out, "%-6s %6d/%-6d %8.3f %9.1f %9.1f %9.2f", wl->name, files, wl->files * n, run / n / 1e9,
+        files / (run / 1e9), bytes / 1e6 / (run / 1e9), ttfb / n / 1e6);
+    if (wl->stop_after) {
+        fprintf(out, " %7.2f/%.2f", stop / n / 1e6, stop_max / 1e6);
+    } else {
+        fprintf(out, " %9s", "-");
+    }
+    fprintf(out, "\n");
+}
+
+static void BenchUsage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-v] [-e native|uring] [-d tmpfs dir] [tiny|huge|mp4|abort|split ...]\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* dir = "/dev/shm";
+    bool verbose = false;
+    LFTP_ENGINE engine = LFTP_ENGINE_NATIVE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ve:d:")) != -1) {
+        if (opt == 'v') {
+            verbose = true;
+        } else if (opt == 'e' && !strcmp(optarg, "native")) {
+            engine = LFTP_ENGINE_NATIVE;
+        } else if (opt == 'e' && !strcmp(optarg, "uring")) {
+            engine = LFTP_ENGINE_URING;
+        } else if (opt == 'd') {
+            dir = optarg;
+        } else {
+            BenchUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    int count = sizeof(benchWorkloads) / sizeof(benchWorkloads[0]);
+    vector<const BenchWorkload*> selected;
+    for (int i = optind; i < argc; i++) {
+        int k = 0;
+        while (k < count && strcmp(argv[i], benchWorkloads[k].name)) {
+            k++;
+        }
+        if (k == count) {
+            BenchUsage(argv[0]);
+            return 1;
+        }
+        selected.push_back(&benchWorkloads[k]);
+    }
+    if (selected.empty()) {
+        for (int i = 0; i < count; i++) {
+            selected.push_back(&benchWorkloads[i]);
+        }
+    }
+
+    // the library logs to stdout, the report goes to the real one
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!out || (!verbose && !freopen("/dev/null", "w", stdout))) {
+        return 1;
+    }
+    setvbuf(out, NULL, _IOLBF, 0);
+
+    char base[256];
+    snprintf(base, sizeof(base), "%s/lftp-bench-XXXXXX", dir);
+    if (!mkdtemp(base)) {
+        fprintf(stderr, "can not create a directory in %s\n", dir);
+        return 1;
+    }
+    string src = string(base) + "/src";
+    string root = string(base) + "/ftp";
+    if (mkdir(src.c_str(), 0755) != 0 || mkdir(root.c_str(), 0755) != 0) {
+        BenchRemoveTree(base);
+        return 1;
+    }
+
+    BenchFtpd* ftpd = BenchFtpdStart(root.c_str());
+    if (!ftpd) {
+        fprintf(stderr, "can not start the ftp server\n");
+        BenchRemoveTree(base);
+        return 1;
+    }
+
+    fprintf(out, "server : 127.0.0.1:%d, files in %s\n", BenchFtpdPort(ftpd), base);
+    fprintf(out, "%-6s %13s %8s %9s %9s %9s %9s\n", "load", "files", "sec", "files/s", "MB/s", "ttfb ms",
+        "stop ms");
+
+    int ret = 0;
+    int run = 0;
+    for (size_t i = 0; i < selected.size(); i++) {
+        const BenchWorkload* wl = selected[i];
+
+        if (BenchPrepare(wl, src) != 0) {
+            ret = 1;
+            break;
+        }
+
+        vector<BenchResult> results;
+        for (int r = 0; r < wl->rounds; r++) {
+            // a fresh remote directory, nothing is skipped as uploaded already
+            char remote[64];
+            snprintf(remote, sizeof(remote), "run%d", run++);
+
+            BenchResult result;
+            if (BenchRun(wl, engine, ftpd, src, remote, &result) != 0) {
+                fprintf(stderr, "%s: run failed\n", wl->name);
+                ret = 1;
+                break;
+            }
+            if (wl->stop_after && !result.aborted) {
+                fprintf(stderr, "%s: finished before the stop\n", wl->name);
+            }
+            results.push_back(result);
+            BenchRemoveTree(root + "/" + remote);
+        }
+
+        if (results.size()) {
+            BenchReport(out, wl, results);
+        }
+    }
+
+    BenchFtpdStop(ftpd);
+    BenchRemoveTree(base);
+    fclose(out);
+
+    return ret;
+}
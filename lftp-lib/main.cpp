@@ -0,0 +1,114 @@
+/**
+ * @file main.cpp
+ * @author fox
+ * @brief test lftp api
+ * @version 0.1
+ * @date 2024-03-19
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include <poll.h>
+#include <stdio.h>
+
+#include <string>
+
+using std::string;
+
+#include "LftpLib.h"
+#include "LftpLog.h"
+
+static string LftpBytesToString(unsigned long long bytes)
+{
+    char result[32] = { 0 };
+
+    if (bytes < 1024) {
+        sprintf(result, "%lluB", bytes);
+    } else if (bytes < 1024 * 1024) {
+        sprintf(result, "%.2fKB", (float)bytes / 1024);
+    } else if (bytes < 1024 * 1024 * 1024) {
+        sprintf(result, "%.2fMB", (float)bytes / (1024 * 1024));
+    } else {
+        sprintf(result, "%.2fGB", (float)bytes / (1024 * 1024 * 1024));
+    }
+
+    return string(result);
+}
+
+static string LftpSecondsToString(unsigned long long seconds)
+{
+    char result[32] = { 0 };
+
+    if (seconds < 60) {
+        sprintf(result, "%llds", seconds);
+    } else if (seconds < 60 * 60) {
+        sprintf(result, "%lldm", seconds / 60);
+    } else if (seconds < 60 * 60 * 24) {
+        sprintf(result, "%lldh", seconds / (60 * 60));
+    } else {
+        sprintf(result, "%lldd", seconds / (60 * 60 * 24));
+    }
+
+    return string(result);
+}
+
+static int LftpPrintStatus(LftpStatus& status)
+{
+    LFTP_LOG("******************************************************");
+    LFTP_LOG("* File name            : %s", status.file_name);
+    LFTP_LOG("* Transferred bytes    : %s", LftpBytesToString(status.transferred_bytes).c_str());
+    LFTP_LOG("* Transferred progress : %d", status.transferred_progress);
+    LFTP_LOG("* Transfer rate        : %s/s", LftpBytesToString(status.transfer_rate).c_str());
+    LFTP_LOG("* Remaining time       : %s", status.remaining_time < 0 ? "-" : LftpSecondsToString(status.remaining_time).c_str());
+    LFTP_LOG("* Transferred time     : %s", LftpSecondsToString(status.transferred_time).c_str());
+    LFTP_LOG("* Transfer state       : %d", status.transfer_state);
+    LFTP_LOG("* Transfer state str   : %s", status.transfer_state_str);
+    LFTP_LOG("* File index           : %d", status.file_index);
+    LFTP_LOG("* Files finished       : %d/%d", status.files_finished, status.files_total);
+    LFTP_LOG("* All transferred bytes: %s", LftpBytesToString(status.all_transferred_bytes).c_str());
+    LFTP_LOG("* All progress         : %d", status.all_progress);
+    LFTP_LOG("* Saved round trips    : %d", status.saved_round_trips);
+    LFTP_LOG("* Retries              : %d", status.retries);
+    LFTP_LOG("* Transfer all finish  : %d", status.all_finish);
+    LFTP_LOG("******************************************************");
+
+    return 0;
+}
+
+int main(void)
+{
+    LftpParam param;
+
+    param.files = { "swz.ts", "wucf-tv.ts" };
+    param.path = "~/Videos/ts-files";
+    param.server = "127.0.0.1";
+    param.port = "21";
+    param.username = "ftp";
+    param.password = "ftp-test";
+    param.remote_path = "lftp-test";
+    param.export_format = LFTP_EXP_FMT_TS;
+    param.workers = 2;
+
+    LftpUploadFilesStart(param);
+
+    struct pollfd pfd;
+    pfd.fd = LftpUploadFilesStatusFd();
+    pfd.events = POLLIN;
+
+    bool finish = false;
+    while (!finish && poll(&pfd, 1, -1) >= 0) {
+        LftpStatus status;
+        while (LftpUploadFilesStatus(status)) {
+            LftpPrintStatus(status);
+            if (status.all_finish) {
+                finish = true;
+            }
+        }
+    }
+
+    LftpUploadFilesStop();
+
+    LftpUploadFilesDestroy();
+
+    return 0;
+}
\ No newline at end of file